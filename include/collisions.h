@@ -0,0 +1,64 @@
+//
+//  collisions.h
+//  SymUniverse - Routines for detecting and resolving swept sphere collisions.
+//
+//
+
+#ifndef collisions_h
+#define collisions_h
+
+#include "universe.h"
+#include "threadpool.h"
+
+typedef struct Collision {  // Narrow phase result, in the rest frame of body i
+    uint64_t    i;
+    uint64_t    j;
+    Vector      v;          // Velocity of j relative to i
+    Vector      chi;        // Vector defining the bisector (point of closest approach)
+    double      vel;        // |v|
+    double      b;          // Impact parameter
+    double      R;          // Sum of radii
+    double      xi;         // Initial displacement along v (negative means approaching)
+} Collision;
+
+typedef struct CollisionPair {
+    uint64_t    i;
+    uint64_t    j;
+} CollisionPair;
+
+#define COLLISION_LANES 4    // Candidate pairs per collision_filter() call
+
+typedef struct CollisionSoA {       // Columns for the vectorized narrow phase.  Padded to a multiple of COLLISION_LANES.
+    uint64_t    n;
+    double      *px;                // ps positions
+    double      *py;
+    double      *pz;
+    double      *vx;                // s velocities
+    double      *vy;
+    double      *vz;
+    double      *r;                 // s radius, NAN for bodies that don't take part
+} CollisionSoA;
+
+typedef struct CollisionStats {
+    uint64_t    ncollide;   // Pairs that really collided
+    uint64_t    nfail;      // Collisions the resolver couldn't handle
+    uint64_t    nbatch;     // Conflict-free batches used
+} CollisionStats;
+
+typedef int (*CollisionResolver)(Slice *s, Collision *c, double ts);
+
+double collision_timestep(Slice *ps, Slice *s);
+int collision_detect(Slice *ps, Slice *s, uint64_t i, uint64_t j, double ts, Collision *c);
+int collision_resolve_point(Slice *s, Collision *c, double ts);
+int collision_resolve_sphere(Slice *s, Collision *c, double ts);
+
+int collision_soa_load(CollisionSoA *a, Slice *ps, Slice *s);
+void collision_soa_update(CollisionSoA *a, Slice *s, uint64_t i);
+unsigned collision_filter(CollisionSoA *a, uint64_t i, uint64_t j, double ts);
+
+int collision_resolve_all(Slice *ps, Slice *s, double ts, CollisionResolver resolve, CollisionStats *stats);
+int collision_schedule(CollisionPair *pairs, uint64_t npair, uint64_t nbody, uint64_t **batch_off, uint64_t *nbatch);
+int collision_resolve_pairs(ThreadPool *pool, Slice *ps, Slice *s, double ts, CollisionPair *pairs, uint64_t npair,
+                            CollisionResolver resolve, CollisionStats *stats);
+
+#endif /* collisions_h */
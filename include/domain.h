@@ -0,0 +1,60 @@
+//
+//  domain.h
+//  SymUniverse - Spatial domain decomposition and collective universe I/O for MPI runs (see msym).
+//
+//
+
+#ifndef domain_h
+#define domain_h
+
+#include <mpi.h>
+#include "universe.h"
+
+typedef struct DomainNode { // Node of the orthogonal recursive bisection tree, covering ranks [lo, hi)
+    int         lo;
+    int         hi;
+    int         axis;       // Bodies with pos[axis] < at go to ranks [lo, lo + (hi - lo) / 2), the rest to the upper half
+    double      at;
+    int         left;       // Child nodes (-1 for a single rank)
+    int         right;
+    Vector      min;        // The part of space this node covers
+    Vector      max;
+} DomainNode;
+
+typedef struct Domain {
+    MPI_Comm    comm;
+    int         rank;
+    int         size;
+    MPI_Datatype particle;  // One Particle, as bytes
+    int         nnode;
+    DomainNode  *nodes;     // nodes[0] covers every rank
+    int         *leaf;      // Node of each rank
+    uint64_t    nlocal;     // While ghosts are attached: bodies this rank owns (they come first in s)
+    uint64_t    nps;        // ... and the size of ps before they were attached
+    uint64_t    nghost;
+} Domain;
+
+typedef struct DomainFile { // A universe file written by every rank at once
+    MPI_File    fh;
+    Domain      *d;
+    uint64_t    nslice;
+    uint32_t    version;    // Of the file, see universe.h
+    long        *slice_idx; // Version 1: only kept up to date on rank 0, which writes the headers and index
+    long        block;      // Version 2: the newest index block (rank 0)
+    long        end;        // Where the next slice goes (a version 1 index follows the slice data)
+} DomainFile;
+
+Domain *domain_create(MPI_Comm comm);
+void domain_free(Domain *d);
+int domain_owner(Domain *d, Vector *pos);
+int domain_balance(Domain *d, Slice *s, double weight);
+int64_t domain_migrate(Domain *d, Slice *s);
+int domain_ghosts(Domain *d, Slice *ps, Slice *s, double halo);
+void domain_drop_ghosts(Domain *d, Slice *ps, Slice *s);
+
+int domain_read_last_slice(Domain *d, const char *path, Slice *s);
+DomainFile *domain_file_open(Domain *d, const char *path);
+int domain_file_append(DomainFile *f, Slice *s);
+int domain_file_close(DomainFile *f);
+
+#endif /* domain_h */
@@ -0,0 +1,63 @@
+//
+//  live.h
+//  SymUniverse - The newest slice of a running sym, published in POSIX shared memory (sym -S, see uwatch).
+//
+//  The publisher copies each finished slice (or a sample of it) into one of two slots and never waits for anyone.
+//  Each slot has a seqlock, so a reader that was overtaken mid-copy just tries again, and with two slots that only
+//  happens if it takes longer than a whole step.
+//
+//
+
+#ifndef live_h
+#define live_h
+
+#include "universe.h"
+
+#define LIVE_MAGIC "SYMLIVE"
+#define LIVE_VERSION 1
+#define LIVE_NSLOT 2
+
+// The 64 bit fields are kept 8 byte aligned (universe.h leaves pack(4) on), so they can't be torn
+typedef struct LiveSlot {
+    volatile uint64_t   seq;            // Odd while the publisher is writing it
+    uint64_t            time;
+    uint64_t            nbody;          // Bodies in the slot
+    uint64_t            ntotal;         // Live bodies in the slice they're sampled from
+    uint64_t            stride;         // The slot has every stride'th of those (1 = all of them)
+    Vector              bound_min;
+    Vector              bound_max;
+} LiveSlot;
+
+typedef struct LiveHeader { // Start of the shared memory.  LIVE_NSLOT arrays of capacity bodies follow.
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            particle_size;  // sizeof(Particle) of the publisher
+    uint64_t            capacity;
+    volatile uint64_t   published;      // Slices so far
+    volatile uint32_t   latest;         // Slot with the newest one
+    volatile uint32_t   finished;       // The publisher is done, nothing more is coming
+    LiveSlot            slots[LIVE_NSLOT];
+} LiveHeader;
+
+typedef struct LivePublisher {
+    char                *name;          // shm_open name
+    double              fraction;       // Publish this fraction of the bodies (1 = all of them)
+    LiveHeader          *h;             // Mapped at the first slice, sized from it
+    size_t              size;
+} LivePublisher;
+
+typedef struct LiveReader {
+    LiveHeader          *h;
+    size_t              size;
+} LiveReader;
+
+LivePublisher *live_publisher_create(const char *name, double fraction);
+int live_publish(LivePublisher *p, Slice *s);
+void live_publisher_free(LivePublisher *p);
+
+LiveReader *live_reader_open(const char *name, int quiet);
+int live_read(LiveReader *r, Slice *s, LiveSlot *info);
+int live_finished(LiveReader *r);
+void live_reader_close(LiveReader *r);
+
+#endif /* live_h */
@@ -0,0 +1,199 @@
+//
+//  sim.h
+//  SymUniverse - The simulation driver as a library (libsym): module loading, the pipeline and the step loop.
+//
+//  sym is a thin command line wrapper around this.  Other programs can use it to run many simulations in one
+//  process, stepping in-memory slices without going through universe files at all:
+//
+//      SimModules *mods = sim_open_modules("modules/");
+//      SimOptions opt;
+//      sim_default_options(&opt, mods);
+//      opt.timesteps = 100;
+//      char *pipe[] = { "fgrav", "integrate[timestep=0.1]" };
+//      Sim *sim = sim_create(&opt, 2, pipe);
+//      sim_set_slice(sim, initial);
+//      sim_run(sim);
+//      ... sim_slice(sim) is the final state ...
+//      sim_destroy(sim);
+//      sim_free_modules(mods);
+//
+//
+
+#ifndef sim_h
+#define sim_h
+
+#include <semaphore.h>
+#include "universe.h"
+#include "writer.h"
+#include "threadpool.h"
+#include "sym.h"
+#ifdef SYM_MPI
+#include "domain.h"
+#endif
+
+#define SIM_MODULE_INDEX "modules.idx"   // Written into the module directory by sim_index_modules (sym --index-modules)
+#define SIM_TUNE_STEPS 3                // sim_default_tune's
+#define SIM_TUNE_ACCURACY 1e-6
+#define SIM_ANALYSIS_DEPTH 4            // Default SimOptions.analysis_depth
+
+typedef struct SimModuleEntry { // What the index knows about a module, so it doesn't have to be opened to find or describe it
+    char            *name;
+    char            *file;              // In the module directory
+    int             abi;                // Its abi_version
+    long            mtime;              // The .mod as it was indexed.  If it has changed since, the entry is ignored.
+    long            size;
+    char            *help;              // What its help() printed
+} SimModuleEntry;
+
+typedef struct SimModules { // The modules in a directory.  They're only opened once asked for, and sims copy what they use,
+    char            *path;              // so one set serves any number of them.
+    int             n;
+    Module          *modules;           // Opened so far (built in ones first)
+    char            **files;            // ... and the file each came from (NULL if built in)
+    int             nindex;
+    SimModuleEntry  *index;             // From SIM_MODULE_INDEX, if there is one
+} SimModules;
+
+typedef void (*SimOutput)(void *arg, Slice *s);     // Sees every finished slice.  It mustn't keep or modify s.
+
+typedef struct SimOptions {
+    SimModules      *modules;
+    int             timesteps;          // Steps before the sim is done, -1 = until a module asks to exit
+    int             huge;               // Back slices and scratch with huge pages
+    double          pack_threshold;     // Put off packing until this fraction of bodies is deleted
+    UniverseWriter  *writer;            // Background writer for the output file, NULL to write synchronously
+    int             write_every;        // Only write every this many steps (0 = every step) ...
+    uint64_t        write_time;         // ... or once the slice time reaches a multiple of this (0 = never).  Either way,
+                                        // the last slice always gets written (see sim_finish).
+    double          lod;                // Every step, also write this fraction of the bodies (a stratified sample) to the
+                                        // universe_lod_path of the output file, for quick looks.  0 = off.
+    int             columnar;           // Create output files (and companions) with universe_create_columnar.  Not with SYM_MPI.
+    ThreadPool      *tpool;             // Runs fused stages, NULL to run them in the calling thread
+    int             numa;               // Give each tpool thread a fixed share of the bodies to copy (so first touch)
+                                        // and run fused stages over, so their pages stay on its NUMA node.  Pin tpool.
+    int             concurrent;         // Run independent stages of the pipeline at the same time
+    int             verbose;            // Print the pipeline and what's being opened
+    SimOutput       output;             // Optional, called after every step
+    void            *output_arg;
+    int             nanalysis;          // In-situ analysis plug-ins ("name[module options]", see sym.h), each fed every
+    char            **analysis;         // finished slice on its own thread.  They never hold up a step: one that's
+    int             analysis_depth;     // this many slices behind misses the next ones (0 = SIM_ANALYSIS_DEPTH).
+#ifdef SYM_MPI
+    Domain          *domain;            // Which bodies this rank owns.  Required.
+    double          halo;               // Only ghost bodies this close to a rank's box for MODULE_REACH_NEAR levels (0 = all of them)
+    double          rebalance;          // Rebalance once the busiest rank is this far over the mean (0 = never)
+#endif
+} SimOptions;
+
+typedef struct SimStage {   // A run of consecutive pipeline modules
+    int             first;
+    int             n;
+    int             fused;              // All n have exec_range, run them together one block of bodies at a time
+    ModuleFields    f;                  // Union of the modules' fields
+    int             exclusive;          // Has to run on its own (undeclared fields, or adds/removes bodies)
+    int             level;              // Stages on the same level don't depend on each other and run concurrently
+    int             private_acc;        // Accumulates acc alongside an earlier stage of its level, so gets its own copy
+    int             reach;              // Widest MODULE_REACH_* of its modules
+} SimStage;
+
+typedef struct SimAnalysis {   // An analysis plug-in instance and the thread feeding it slices
+    Module          m;
+    SlicePool       *pool;              // Analysed slices go back here
+    Slice           **ring;             // Slices waiting for it.  Lock free: one producer (the step loop), one consumer.
+    uint64_t        depth;
+    volatile uint64_t head;             // Next to analyse, only moved by the thread
+    volatile uint64_t tail;             // Next free entry, only moved by the step loop
+    uint64_t        dropped;            // Slices it was too far behind to be given
+    sem_t           ready;              // Posted once per slice, and once more to shut down
+    pthread_mutex_t lock;               // Only for waiting until it's caught up (see sim_finish), the step loop never takes it
+    pthread_cond_t  idle;
+    pthread_t       thread;
+    int             running;
+    volatile int    failed;             // analyze returned 0, so it gets nothing more
+} SimAnalysis;
+
+typedef struct SimSpecies { // Bodies selected by a uflags mask, kept across steps until the bodies change
+    uint32_t        mask;
+    uint64_t        n;
+    uint64_t        size;
+    uint64_t        *idx;
+    uint64_t        nbody;              // Slice size the index was built for
+} SimSpecies;
+
+typedef struct Sim {        // One universe being simulated: its own pipeline instances, buffers and (optional) output file
+    SimOptions      opt;
+    Universe        *universe;          // NULL for in-memory sims
+    Universe        *lod;               // Level of detail companion (see SimOptions.lod), NULL if there isn't one
+    char            *lod_path;
+    SlicePool       *lod_pool;          // Its samples are much smaller, so they get their own
+    Slice           *lod_last;          // The last one written (held, so sim_finish can wait for it)
+    int             npipeline;
+    Module          *pipeline;
+    SlicePool       *pool;
+    Arena           *scratch;
+    uint32_t        carry;              // Particle fields that have to be copied from one slice to the next
+    UniverseWriter  *writer;            // From opt, NULL once it's gone
+    ThreadPool      *tpool;
+    int             nstage;
+    SimStage        *stages;
+    int             nlevel;
+    int             *level_off;         // Stages of level l are order[level_off[l]] .. order[level_off[l+1] - 1]
+    int             *order;
+    int             width;              // Most stages on any one level
+    ThreadPool      *dagpool;           // Runs the stages of a level, NULL to run them one after another
+    Arena           **arenas;           // Scratch for concurrent stages (slot 0 is scratch)
+    Slice           *views;             // Per slot view of the current slice
+    int             *rets;
+    int             nspecies;
+    SimSpecies      *species;           // One per distinct {mask=...} in the pipeline
+    int             species_stale;      // Bodies were packed, or their uflags changed
+    Slice           *pslice;            // Last finished slice
+    Slice           *slice;             // The one being worked on
+    int             step;
+    int             done;               // Ran all its timesteps, or a module asked to exit
+    int             written;            // pslice is in the output (or doesn't need to be)
+    int             nanalysis;
+    SimAnalysis     *analyses;
+#ifdef SYM_MPI
+    DomainFile      *dfile;             // Shared output, written by every rank at once
+    DomainFile      *lod_dfile;
+    double          busy;               // Seconds spent in modules since the last rebalance
+#endif
+} Sim;
+
+typedef struct SimTune {    // sim_autotune's settings, and the pipeline it picked
+    int             steps;              // Timed calibration steps per candidate (after one untimed one)
+    double          accuracy;           // Largest error allowed against the reference candidate: positions relative to the
+                                        // slice's extent, velocities relative to its fastest body
+    int             threads;            // Most threads a module may be tuned to use
+    const char      *cache;             // Choices are remembered here per (module, N, threads).  NULL for no cache.
+    int             argc;               // The tuned pipeline, free with sim_tune_free
+    char            **argv;
+} SimTune;
+
+#ifdef SYM_BUILTIN
+extern const int sim_nbuiltin;                  // Modules compiled into ssym.  They win over .mod files of the same name.
+void sim_builtin_modules(Module *modules);      // Fills in all sim_nbuiltin of them (generated, see builtin_modules.c.in)
+#endif
+
+SimModules *sim_open_modules(const char *path);
+void sim_free_modules(SimModules *mods);    // Only once every sim using them is destroyed
+Module *sim_find_module(SimModules *mods, const char *name);
+int sim_help_modules(SimModules *mods);
+int sim_index_modules(const char *path);
+
+void sim_default_options(SimOptions *opt, SimModules *mods);
+Sim *sim_create(SimOptions *opt, int argc, char *argv[]);
+int sim_open(Sim *sim, const char *in_file, const char *out_file);
+int sim_set_slice(Sim *sim, Slice *s);
+Slice *sim_slice(Sim *sim);
+int sim_step(Sim *sim);
+int sim_run(Sim *sim);
+int sim_finish(Sim *sim);
+void sim_destroy(Sim *sim);
+
+void sim_default_tune(SimTune *tune);
+int sim_autotune(SimTune *tune, SimOptions *opt, int argc, char *argv[], Slice *s);     // Not with SYM_MPI
+void sim_tune_free(SimTune *tune);
+
+#endif /* sim_h */
@@ -13,6 +13,9 @@
 
 #define DEFAULT_MODULE_PATH "modules/"
 
+// Bump whenever Module, ModuleFields, Slice or Particle change shape.  sym refuses modules built for another version.
+#define MODULE_ABI_VERSION 3
+
 #define MPRINTF(f_, ...) printf("[%s] " f_, name, __VA_ARGS__)
 
 // Module return flags
@@ -21,11 +24,45 @@
 #define MOD_RET_EXIT 2      // Exit after appending slice (e.g. we met a finalization condition)
 #define MOD_RET_PACK 4      // Usually means module marked some particles for deletion
 
+// How far a module looks from each body (ModuleFields.reach).  Only msym cares: it has to bring in copies of other ranks'
+// bodies (flagged PARTICLE_FLAG_GHOST, after all the local ones) for anything but MODULE_REACH_SELF.
+#define MODULE_REACH_ALL  0     // Any body can affect any other (e.g. gravity).  The default, since it's always safe.
+#define MODULE_REACH_NEAR 1     // Only bodies within the msym -H halo of each other (e.g. collisions)
+#define MODULE_REACH_SELF 2     // Each body on its own (e.g. integration)
+
 // Modules must have the following symbols:
 // 1. name (function)   returns the name of the module
-// 2. init (function)   initialize module parameters for use in pipeline
-// 3. help (function)   prints help info for the module
-// 4. exec (function)   execute the module transorm
+// 2. abi_version (int) MODULE_ABI_VERSION, as it was when the module was built
+// 3. init (function)   initialize module parameters for use in pipeline
+// 4. help (function)   prints help info for the module
+// 5. exec (function)   execute the module transorm
+// Optionally:
+// 6. fields (function) declare which particle fields (PARTICLE_FIELD_*) exec touches.
+//                      If every module in the pipeline has it, sym only carries the fields that
+//                      change between slices instead of copying whole particles every step, and can run
+//                      modules that don't depend on each other at the same time.
+// 7. exec_range (function) like exec, but only for bodies [begin, end).  Only for modules where each body is
+//                      transformed independently of the others.  It is called concurrently on disjoint ranges,
+//                      so it must not use slice_scratch.  Consecutive modules with exec_range are fused by sym.
+// 8. tunables (function) candidate configurations for sym --autotune to time against each other, given the slice
+//                      size and how many threads it may use.  Writes the k'th into buf and returns 1, or returns 0
+//                      once there are no more.  A candidate is either options appended to the module's own (later
+//                      ones win, e.g. "tc=4"), or "othermodule[options]" doing the same job another way (the
+//                      brackets are what tell them apart).  Candidate 0
+//                      is the reference: the most accurate, the one the others have to agree with.
+// 9. analyze (function) makes the module an in-situ analysis plug-in (sym -a) rather than a transform, and then exec
+//                      isn't needed.  It's given every finished slice, read only, on a thread of its own, and returns 0
+//                      to stop being given any.  The slice may still hold bodies flagged PARTICLE_FLAG_DELETE.
+
+typedef struct {
+    uint32_t    ps_read;    // Fields read from the previous slice
+    uint32_t    s_read;     // Fields read from the current slice (i.e. as left by earlier modules)
+    uint32_t    s_write;    // Fields modified in the current slice
+    uint32_t    s_set;      // Subset of s_write that is overwritten for every body without being read first
+    uint32_t    s_accum;    // Subset of s_write that is only ever added to (and not read).  Only PARTICLE_FIELD_ACC for now.
+    int         resize;     // Adds or removes bodies (zeroed by sym, so most modules can ignore it)
+    int         reach;      // MODULE_REACH_*.  Pairwise modules should skip pairs of two ghosts, their owners handle those.
+} ModuleFields;
 
 typedef struct {
     void        *handle;
@@ -35,6 +72,11 @@ typedef struct {
     void        *(*init)(char *cfg_str);
     void        (*deinit)(void *cfg);
     int         (*exec)(void *cfg, Slice *ps, Slice *s);
+    void        (*fields)(void *cfg, ModuleFields *f);
+    int         (*exec_range)(void *cfg, Slice *ps, Slice *s, uint64_t begin, uint64_t end);
+    int         (*tunables)(void *cfg, uint64_t nbody, int nthread, int k, char *buf, size_t size);
+    int         (*analyze)(void *cfg, Slice *s);
+    uint32_t    mask;       // Only bodies with (uflags & mask) are passed to exec (0 = all).  Set by sym, see -m mod{mask=...}
 } Module;
 
 #endif /* sym_h */
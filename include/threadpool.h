@@ -0,0 +1,59 @@
+//
+//  threadpool.h
+//  SymUniverse - A simple persistent pthread pool for data-parallel loops.
+//
+//
+
+#ifndef threadpool_h
+#define threadpool_h
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Where to pin the pool's threads
+#define THREADPOOL_PIN_NONE     0   // Wherever the OS likes (the calling thread is one of them)
+#define THREADPOOL_PIN_COMPACT  1   // One per CPU, filling up a NUMA node before moving on to the next
+#define THREADPOOL_PIN_SCATTER  2   // One per CPU, round robin over the NUMA nodes
+
+typedef void (*ThreadPoolTask)(void *arg, int task);   // Called once per task index in [0, ntask)
+
+typedef struct ThreadTopology {     // The CPUs this process may run on, by NUMA node
+    int             ncpu;
+    int             nnode;
+    int             *cpus;          // Grouped by node, ascending within each
+    int             *node_off;      // Node k has cpus[node_off[k]] .. cpus[node_off[k + 1] - 1]
+    int             *node_id;       // ... and is node<node_id[k]> in sysfs (-1 for CPUs sysfs had no node for)
+} ThreadTopology;
+
+typedef struct ThreadPool {
+    int             nthread;        // Threads working on each loop
+    int             nworker;        // Threads started by the pool.  Unless they're pinned, the calling thread is one
+    pthread_t       *threads;       // of the nthread, so there's one less of these.
+    int             *cpus;          // CPU of each thread (-1 = not pinned), by threadpool_run_each task index
+    int             nstarted;       // Workers that have picked their index
+    int             each;           // The current loop runs its function once on every thread
+    pthread_mutex_t lock;
+    pthread_cond_t  start;
+    pthread_cond_t  done;
+    uint64_t        generation;     // Bumped every time a new loop is started
+    int             shutdown;
+    ThreadPoolTask  fn;
+    void            *arg;
+    int             ntask;
+    int             next;           // Next unclaimed task (claimed atomically)
+    int             nactive;        // Workers still busy with the current loop
+} ThreadPool;
+
+// Note: threadpool_run is not reentrant.  Don't call it on a pool from within one of its own tasks.
+ThreadPool *threadpool_create(int nthread);
+ThreadPool *threadpool_create_pinned(int nthread, int pin);
+void threadpool_run(ThreadPool *p, ThreadPoolTask fn, void *arg, int ntask);
+void threadpool_run_each(ThreadPool *p, ThreadPoolTask fn, void *arg);
+void threadpool_free(ThreadPool *p);
+
+ThreadTopology *threadpool_topology(void);
+int threadpool_pin_cpu(ThreadTopology *t, int pin, int thread);
+int threadpool_pin(int cpu);
+int threadpool_tune_count(int nthread, int k);
+
+#endif /* threadpool_h */
@@ -0,0 +1,40 @@
+//
+//  umap.h
+//  SymUniverse - Zero-copy, read-only access to a universe file through mmap (see utocsv).
+//
+//  umap_slice hands out views whose bodies point straight into the mapping, so reading a slice copies nothing and
+//  costs no system calls.  The map never changes once it's open, so any number of threads can read from it at once.
+//  It covers the slices that were in the file when it was opened; ones appended later need a new map.
+//
+//  Version 3 files keep each field in a column of its own, so their slices can't be viewed whole.  umap_column points at
+//  one field of a slice in any version, and umap_read copies just some fields out, so e.g. reading positions only
+//  touches the position columns.
+//
+//
+
+#ifndef umap_h
+#define umap_h
+
+#include "universe.h"
+
+#define UMAP_SEQUENTIAL 0           // Slices will be read front to back: read ahead, and drop pages behind
+#define UMAP_RANDOM 1               // Slices will be read in no particular order: don't read ahead
+
+typedef struct UniverseMap {
+    const char  *path;
+    const char  *base;              // The whole file, read only
+    size_t      size;
+    uint32_t    version;
+    uint64_t    nslice;
+    long        *slice_idx;         // Where each slice starts in base
+} UniverseMap;
+
+UniverseMap *umap_open(const char *path, int advice);
+int umap_slice(UniverseMap *m, uint64_t slice, Slice *view);
+const void *umap_column(UniverseMap *m, uint64_t slice, uint32_t field, size_t *stride, Slice *s);
+int umap_read(UniverseMap *m, uint64_t slice, uint32_t fields, Slice *dst);
+void umap_advise(UniverseMap *m, int advice);
+void umap_prefetch(UniverseMap *m, uint64_t slice);
+void umap_close(UniverseMap *m);
+
+#endif /* umap_h */
@@ -8,7 +8,9 @@
 
 // Universe file format: (while a little complicated, this allows for universes with different size slices)
 // Header:
+//  - char string[32], uint32_t version
 //  - uint64_t nslice
+//  - long first_block (version 2 only, see below)
 // Slices:
 //  - Slice
 //  -- uint64_t time
@@ -22,20 +24,57 @@
 //  --- double pos[3]
 //  --- double vel[3]
 //  --- double acc[3]
-// Index:
+// Index (version 1):
 //  long slice_pos[nslice]
+//
+// Version 2 keeps the index in blocks of UNIVERSE_BLOCK_SLICES entries (UniverseIndexBlock) instead, linked from the
+// header's first_block.  A new block is put right before the slice that starts it, so appending only ever adds to the
+// end of the file and fills in one index entry and the header's nslice: constant work, however long the file is.
+// Version 1 files are still read, and appended to the version 1 way.
+//
+// Version 3 (universe_create_columnar) is version 2 with the slices stored a column at a time: after each slice's
+// time, nbody and bounds comes a UniverseColumns, then one column per PARTICLE_FIELD_* in Particle order (flags,
+// uflags, mass, charge, radius, pos, vel, acc), nbody values each.  Columns where every body has the same value (the
+// constant mask) hold that value just once.  Readers that only want some fields (universe_get_slice_fields, or
+// umap_column) read only those columns.  A slice with no bodies has no columns.
+//
+// Streams (universe_create_stream, e.g. sym -o - | ...) are the same, except that the header's nslice is
+// UNIVERSE_STREAM and there is no index: slices just follow each other until the end of the data, each one sized by its
+// own nbody (and constant mask).  They can be written to pipes and read forward only (universe_open_stream), or landed
+// in a file, which universe_open indexes by walking the slice headers.
 
 #ifndef universe_h
 #define universe_h
 
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #define UNIVERSE_STRING "Universe Data File"    // Must be < char[32] (including null term)
-#define UNIVERSE_VERSION 1                      // Data file version
+#define UNIVERSE_VERSION 2                      // Data file version (1 can still be read and appended to)
+#define UNIVERSE_VERSION_COLUMNAR 3             // ... and the newest one, for universe_create_columnar
+#define UNIVERSE_BLOCK_SLICES 1024              // Entries per version 2 index block
+#define UNIVERSE_STREAM UINT64_MAX              // Header nslice of a stream: count unknown, no index
+#define UNIVERSE_STDIO "-"                      // Stream path meaning stdin/stdout
 
 #define PARTICLE_FLAG_DELETE 1      // Indicates a particle is to be deleted
 #define PARTICLE_FLAG_CREATE 2      // Keeps track of particles that weren't part of the original universe
 #define PARTICLE_FLAG_NOCOLL 4      // This particle doesn't collide
+#define PARTICLE_FLAG_GHOST 8       // Copy of a body owned by another MPI rank, only here for its neighbours to see (see msym)
+
+// Particle fields, for code that only needs to move some of them (see slice_copy_fields)
+#define PARTICLE_FIELD_FLAGS    0x01
+#define PARTICLE_FIELD_UFLAGS   0x02
+#define PARTICLE_FIELD_MASS     0x04
+#define PARTICLE_FIELD_CHARGE   0x08
+#define PARTICLE_FIELD_RADIUS   0x10
+#define PARTICLE_FIELD_POS      0x20
+#define PARTICLE_FIELD_VEL      0x40
+#define PARTICLE_FIELD_ACC      0x80
+#define PARTICLE_FIELD_ALL      0xff
+#define PARTICLE_NFIELD         8   // Field k is bit k
+
+#define UNIVERSE_ALIGN 64           // Alignment of body and scratch buffers (one cache line)
 
 #pragma pack(4) // Note: on most architectures pack(4) does nothing.  This is just to be certain.
 typedef struct Vector {     // Simple 3-vector
@@ -56,6 +95,22 @@ typedef struct Particle {   // Particle properties
     Vector      acc;
 } Particle;
 
+typedef struct ParticleField {  // Where a PARTICLE_FIELD_* is in a Particle (see particle_field)
+    uint32_t    field;
+    uint32_t    size;
+    size_t      offset;
+} ParticleField;
+
+typedef struct Arena {      // Per-step scratch memory: bump allocated, released all at once by arena_reset
+    char        *base;
+    size_t      size;
+    size_t      used;
+    size_t      want;       // Bytes asked for since the last reset; the block grows to this on reset
+    int         huge;       // Back with huge pages where possible
+    int         noverflow;  // Allocations that didn't fit in the block, freed on reset
+    void        **overflow;
+} Arena;
+
 #pragma pack(4)
 typedef struct Slice {      // Time slice: time index + body count + body array
     uint64_t    time;
@@ -63,15 +118,33 @@ typedef struct Slice {      // Time slice: time index + body count + body array
     Vector      bound_min;
     Vector      bound_max;
     Particle    *bodies;
+    // Everything below is in-memory only, it is not part of the file format
+    uint64_t    capacity;   // Number of bodies allocated
+    Arena       *scratch;   // Scratch memory for modules, valid until the end of the step (set by sym)
+    int         refs;       // Holders of a pooled slice, see slice_hold/slicepool_put
+    uint64_t    ndelete;    // Bodies flagged PARTICLE_FLAG_DELETE that haven't been packed out yet (they're never written)
 } Slice;
 
+typedef struct SlicePool {  // Recycles slices (and their body buffers) so steady-state loops don't hit the allocator
+    pthread_mutex_t lock;   // Slices may be put back from other threads (e.g. the writer)
+    int         huge;
+    int         nfree;
+    int         size;
+    Slice       **free;
+} SlicePool;
+
 typedef struct Universe {   // A universe: number of slices + slice array
     const char  *path;
     FILE        *fstream;
     char        is_open;
     char        is_modified;
-    uint64_t    nslice;
+    uint32_t    version;
+    char        is_stream;  // No index, slices are only ever appended (or read forward, see universe_next_slice)
+    char        at_end;     // universe_next_slice reached the end cleanly (rather than failing)
+    uint64_t    nslice;     // Slices in the file, UNIVERSE_STREAM when reading a stream forward
+    uint64_t    next;       // Slices read so far by universe_next_slice
     long        *slice_idx;
+    long        block;      // Version 2: the newest index block, 0 if there isn't one yet
 } Universe;
 
 #pragma pack(4)
@@ -79,7 +152,19 @@ typedef struct UniverseHeader {
     char        string[32];
     uint32_t    version;
     uint64_t    nslice;
-} UniverseHeader;
+} UniverseHeader;           // Version 2 follows it with long first_block
+
+#define UNIVERSE_FIRST_BLOCK_POS sizeof(UniverseHeader)
+
+typedef struct UniverseColumns {        // Version 3: after each slice header, before its columns
+    uint32_t    constant;   // PARTICLE_FIELD_*s whose column holds a single value
+    uint32_t    reserved;
+} UniverseColumns;
+
+typedef struct UniverseIndexBlock {     // Version 2
+    long        next;       // The next block, 0 if this is the newest
+    long        slice_pos[UNIVERSE_BLOCK_SLICES];
+} UniverseIndexBlock;
 
 // Function definitions
 void vector_add(Vector *dst, Vector *a, Vector *b);
@@ -88,11 +173,35 @@ double vector_dot(Vector *a, Vector *b);
 void vector_cross(Vector *dst, Vector *a, Vector *b);
 int vector_equal(Vector *a, Vector *b);
 
+void *universe_malloc(size_t size, int huge);
+
+Arena *arena_create(size_t size, int huge);
+void *arena_alloc(Arena *a, size_t size);
+void arena_reset(Arena *a);
+void arena_free(Arena *a);
+
+SlicePool *slicepool_create(int huge);
+Slice *slicepool_get(SlicePool *p, uint64_t nbody);
+void slicepool_put(SlicePool *p, Slice *s);
+void slicepool_free(SlicePool *p);
+
 int slice_free(Slice *s);
+void slice_hold(Slice *s);
+int slice_shared(Slice *s);
 Slice *slice_copy(Slice *s);
+int slice_copy_into(Slice *dst, Slice *src);
+int slice_copy_fields(Slice *dst, Slice *src, uint32_t fields);
+void slice_copy_range(Slice *dst, Slice *src, uint32_t fields, uint64_t begin, uint64_t end);
+void particle_copy_fields(Particle *dst, Particle *src, uint32_t fields);
+const ParticleField *particle_field(int k);
+int slice_reserve(Slice *s, uint64_t nbody, int huge);
+void *slice_scratch(Slice *s, size_t size);
 int slice_pack(Slice *);
+uint64_t slice_count_deleted(Slice *s);
+uint64_t slice_sample(Slice *s, uint64_t stride, Particle *dst);
 void slice_clear_create(Slice *s);
 int slice_append_particle(Slice *s, Particle *p);
+int slice_append_particles(Slice *s, Particle *p, uint64_t n);
 
 Universe *universe_create(const char *path);
 Universe *universe_open(const char *path);
@@ -101,7 +210,18 @@ int universe_free(Universe *u);
 Slice *universe_get_slice(Universe *u, uint64_t slice);
 Slice *universe_get_first_slice(Universe *u);
 Slice *universe_get_last_slice(Universe *u);
+Slice *universe_get_slice_fields(Universe *u, uint64_t slice, uint32_t fields);
+uint64_t universe_columns_size(uint64_t nbody, uint32_t constant, uint32_t fields);
 
 int universe_append_slice(Universe *u, Slice *s );
+char *universe_lod_path(const char *path);
+
+int universe_is_stream(const char *path);
+int universe_claim_stdout(void);
+Universe *universe_create_stream(const char *path);
+Universe *universe_create_columnar(const char *path);
+Universe *universe_open_stream(const char *path);
+Slice *universe_next_slice(Universe *u);
+Slice *universe_read_last_slice(const char *path);
 
 #endif /* universe_h */
@@ -0,0 +1,42 @@
+//
+//  writer.h
+//  SymUniverse - Background thread that appends slices to a universe file.
+//
+//
+
+#ifndef writer_h
+#define writer_h
+
+#include <pthread.h>
+#include "universe.h"
+
+typedef struct WriterItem {
+    Universe        *universe;      // Only touched by the writer thread while it has queued slices
+    SlicePool       *pool;          // The slice is released back here once it's written
+    Slice           *slice;
+} WriterItem;
+
+typedef struct UniverseWriter {     // One writer can serve several universes (e.g. an ensemble), in push order
+    Universe        *universe;      // Defaults for writer_push
+    SlicePool       *pool;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;           // Signalled whenever the queue changes
+    WriterItem      *queue;         // Ring buffer of slices waiting to be written
+    int             depth;
+    int             head;
+    int             count;          // Queued slices, including the one being written
+    int             shutdown;
+    int             error;          // An append failed, nothing more will be written
+} UniverseWriter;
+
+// The writer takes a reference on each pushed slice (see slice_hold) and puts it back to the pool once
+// it's on disk, so the caller must not modify a pushed slice until slice_shared() says it's the only holder.
+UniverseWriter *writer_create(Universe *u, SlicePool *pool, int depth);
+int writer_push(UniverseWriter *w, Slice *s);
+int writer_push_to(UniverseWriter *w, Universe *u, SlicePool *pool, Slice *s);
+int writer_wait(UniverseWriter *w, Slice *s);
+int writer_drain(UniverseWriter *w);
+int writer_free(UniverseWriter *w);
+
+#endif /* writer_h */
@@ -7,6 +7,7 @@
 //      2. Modify the new slide through a series of modular transformations
 //      3. Append the slice to the universe file
 //  All of the physics happens in the transformation modules.
+//  The driver itself is libsym (see sim.h); this is its command line front end.
 //
 //  Created by J. Lowell Wofford on 3/25/16.
 //  Copyright © 2016 J. Lowell Wofford. All rights reserved.
@@ -15,33 +16,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <dirent.h>
-#include <sys/types.h>
 #include <string.h>
-#include <dlfcn.h>
+#include <errno.h>
 #include <signal.h>
+#include <getopt.h>
 #include "universe.h"
+#include "writer.h"
+#include "threadpool.h"
 #include "sym.h"
+#include "sim.h"
+#include "live.h"
 #include "SymUniverseConfig.h"
-#ifdef LINUX
-#include <sys/stat.h>
-#include <getopt.h>
-#endif
 
 #define DEFAULT_IN_FILE "in.univ"
 #define DEFAULT_OUT_FILE "out.univ"
 #define DEFAULT_TIMESTEPS -1
+#define DEFAULT_QUEUE_DEPTH 4
+#define DEFAULT_THREADS 1
+#define DEFAULT_PACK_THRESHOLD 0.0
+#define DEFAULT_HALO 0.0
+#define DEFAULT_REBALANCE 0.2
+#define DEFAULT_TUNE_CACHE "sym.tune"
+
+#define OPT_TUNE_STEPS 256      // Long options without a short one
+#define OPT_TUNE_ACCURACY 257
+#define OPT_TUNE_CACHE 258
+
+typedef struct {            // One universe to simulate
+    const char      *in_file;
+    const char      *out_file;
+    Sim             *sim;
+    int             failed;
+} Run;
 
 struct {
     const char      *in_file;
     const char      *out_file;
+    const char      *ensemble_file;
     const char      *module_path;
-    int             nmodules;
-    Module          *modules;
-    int             npipeline;
-    Module          *pipeline;
-    Universe        *universe;
+    SimModules      *modules;
     int             timesteps;
+    int             huge;
+    int             queue_depth;        // Slices that may be waiting for the writer thread (0 = write synchronously)
+    int             write_every;        // Write cadence (see SimOptions)
+    uint64_t        write_time;
+    double          lod;                // Fraction of the bodies in the level of detail output (0 = none)
+    int             columnar;           // New output files are version 3 (-C)
+    const char      *live_name;         // Shared memory to publish each slice in (-S), NULL for none
+    int             nanalysis;          // In-situ analysis plug-ins (-a)
+    char            **analysis;
+    LivePublisher   *live;
+    UniverseWriter  *writer;
+    int             threads;
+    int             pin;                // THREADPOOL_PIN_* for tpool
+    ThreadPool      *tpool;             // Runs fused stages, or the runs themselves in ensemble mode
+    double          pack_threshold;     // Put off packing until this fraction of bodies is deleted
+    int             nrun;
+    Run             *runs;
+    int             ndone;              // Runs finished so far (ensemble progress)
+    SimTune         tune;               // --autotune settings, and the pipeline it picked
+#ifdef SYM_MPI
+    Domain          *domain;            // Which bodies this rank owns
+    double          halo;               // See SimOptions
+    double          rebalance;
+    int             finished;           // Every rank got to the end, so it's safe to finalize rather than abort
+#endif
 } cfg;
 int exit_loop;
 int sigint_caught;
@@ -60,184 +99,340 @@ void help(const char *cmd) {
            "Usage: %s [options]\n"
            "Options:\n"
            "\t-h : Print this help.\n"
-           "\t-i <file> : In universe file (default: %s).\n"
-           "\t-o <file> : Out universe file (default: %s).\n"
+           "\t-i <file> : In universe file (default: %s).  - (stdin) or a FIFO is read as a stream, to its last slice.\n"
+           "\t-o <file> : Out universe file (default: %s).  - streams it to stdout (everything else printed goes to stderr),\n"
+           "\t\t as does a FIFO, so it can be piped straight into another tool (e.g. utocsv - out.csv).\n"
+           "\t-e <file> : Ensemble mode.  Simulate every \"<in file> <out file>\" pair listed in file (one per line) instead of -i/-o.\n"
+           "\t\t Each universe gets its own instance of the pipeline, and they run concurrently on the -T threads.\n"
            "\t-M <dir> : Directory to modules (default: %s).\n"
+           "\t--index-modules : Write an index of the modules in the -M directory, then exit.  With it, sym only has to\n"
+           "\t\t open the modules in the pipeline.  Rerun it after adding or rebuilding modules.\n"
            "\t-t <steps> : Number of timesteps. -1 = infinite (default: %d)\n"
            "\t\t Simulations can always be safely stopped with Ctrl^c (a second Ctrl^c forces immedate abort).\n"
+           "\t-L : Back slice and scratch buffers with (transparent) huge pages where possible.\n"
+           "\t-w every=<steps>,time=<t> : Only write every <steps>th step, and/or the slices whose time is a multiple of <t>.\n"
+           "\t\t The steps in between stay in memory.  The last slice is always written, even after Ctrl^c.  (default: every step)\n"
+           "\t-l <fraction> : Every step, also write a stratified sample of this fraction of the bodies to <out>.lod.univ\n"
+           "\t\t (<out> without .univ), for quick looks.  Usually with -w, so the full slices are only written now and then.\n"
+           "\t-C : Store new output files a column (field) at a time, each column holding just one value where all the bodies\n"
+           "\t\t agree (e.g. mass and radius of a gas).  Smaller, and readers only wanting some fields read only those.\n"
+           "\t-a <plug-in>[options] : Run an analysis plug-in (e.g. reduce) on every finished slice, in the background.  It\n"
+           "\t\t never holds up the simulation, slices are skipped for it if it falls behind.  Can be given more than once.\n"
+           "\t-S <name> : Publish each finished slice (its -l sample, with -l) in POSIX shared memory <name>, for uwatch.\n"
+#ifdef SYM_MPI
+           "\t\t Each rank publishes its own bodies, in <name>.<rank>.\n"
+#endif
+           "\t-q <depth> : Number of slices that can be queued for the background writer.  0 = write synchronously (default: %d)\n"
+           "\t-T <threads> : Threads used to run fused modules, or ensemble members with -e (default: %d)\n"
+           "\t-A <compact|scatter|none> : Pin the -T threads to CPUs, filling one NUMA node at a time (compact) or round robin\n"
+           "\t\t over the nodes (scatter).  Pinned, each thread also copies and first touches its own share of the bodies,\n"
+           "\t\t so their pages stay on its node.  (default: none)\n"
+           "\t-P <fraction> : Only pack out deleted bodies once they are more than this fraction of the slice (default: %g)\n"
+#ifndef SYM_MPI
+           "\t--autotune : First time the configurations modules offer (thread counts, or another module doing the same job)\n"
+           "\t\t on a few steps of the input, and run the fastest that agrees with each module's reference configuration.\n"
+           "\t\t Modules get up to -T threads (every CPU with -T 1, or just one each with -e).\n"
+           "\t--tune-steps <steps> : Timed steps per configuration (default: %d)\n"
+           "\t--tune-accuracy <error> : How far a configuration may drift from the reference over those steps, relative to\n"
+           "\t\t the extent of the bodies' positions and the fastest body's speed (default: %g)\n"
+           "\t--tune-cache <file> : Choices are remembered here per module, size and threads, so runs of about the same\n"
+           "\t\t size don't tune again.  Delete it to retune (default: %s)\n"
+#endif
+#ifdef SYM_MPI
+           "\t-H <distance> : Modules that only look at nearby bodies (e.g. collisions) see other ranks' bodies within\n"
+           "\t\t this distance of the rank's box.  0 = all of them (default: %g)\n"
+           "\t-R <fraction> : Rebalance the ranks' boxes when the busiest is this fraction over the mean.  0 = never (default: %g)\n"
+#endif
            "\n"
            "-- Module Help --\n"
            "To add modules to the pipeline, use the syntax:\n"
-           "\t-m <mod_name>[module,option,string]\n"
+           "\t-m <mod_name>[module,option,string]{driver,options}\n"
            "\te.g. -m integrate[method=leapfrog,boundary=periodic]\n"
+           "The only driver option is mask=<uflags>: the module only sees bodies with (uflags & mask) != 0.\n"
+           "\te.g. -m fgrav[cleara=0]{mask=0x2}\n"
            "Modules are added to the pipeline in command line order.\n"
            "As a general rule add modules in this order: forces, integrate, collisions.\n"
+           "Analysis plug-ins (modules that only look at the finished slices, like reduce) go with -a instead of -m.\n"
            "Details on specific modules and options are below:\n\n",
-           cmd, DEFAULT_IN_FILE, DEFAULT_OUT_FILE, DEFAULT_MODULE_PATH, DEFAULT_TIMESTEPS
+           cmd, DEFAULT_IN_FILE, DEFAULT_OUT_FILE, DEFAULT_MODULE_PATH, DEFAULT_TIMESTEPS, DEFAULT_QUEUE_DEPTH, DEFAULT_THREADS, DEFAULT_PACK_THRESHOLD
+#ifndef SYM_MPI
+           , SIM_TUNE_STEPS, SIM_TUNE_ACCURACY, DEFAULT_TUNE_CACHE
+#endif
+#ifdef SYM_MPI
+           , DEFAULT_HALO, DEFAULT_REBALANCE
+#endif
     );
-    for(int i = 0; i < cfg.nmodules; i++) {
-        printf("Module name: %s\n", cfg.modules[i].name);
-        cfg.modules[i].help();
-        printf("\n");
+    sim_help_modules(cfg.modules);
+}
+
+void print_topology(ThreadTopology *t) {   // e.g. "8 CPUs on 2 NUMA nodes (node0: 0-3, node1: 4-7)"
+    printf("%d CPU%s on %d NUMA node%s (", t->ncpu, (t->ncpu == 1) ? "" : "s", t->nnode, (t->nnode == 1) ? "" : "s");
+    for(int k = 0; k < t->nnode; k++) {
+        if(t->node_id[k] < 0) {
+            printf("%sother: ", (k > 0) ? ", " : "");
+        } else {
+            printf("%snode%d: ", (k > 0) ? ", " : "", t->node_id[k]);
+        }
+        for(int i = t->node_off[k]; i < t->node_off[k + 1]; i++) {  // Runs of consecutive CPUs as ranges
+            int j = i;
+            while(j + 1 < t->node_off[k + 1] && t->cpus[j + 1] == t->cpus[j] + 1) { ++j; }
+            printf("%s%d", (i > t->node_off[k]) ? "," : "", t->cpus[i]);
+            if(j > i) { printf("-%d", t->cpus[j]); }
+            i = j;
+        }
     }
+    printf(")\n");
 }
 
-int load_module(char *path) {
-    ++cfg.nmodules;
-    if((cfg.modules = realloc(cfg.modules, sizeof(Module) * cfg.nmodules)) == NULL) {
-        printf("Memory allocation failure.\n");
+#ifndef SYM_MPI
+int autotune(SimOptions *opt, int argc, char *argv[]) {    // Tune the pipeline on the (first) run's starting slice
+    if(universe_is_stream(cfg.runs[0].in_file)) {
+        printf("--autotune has to read the input twice, so it can't be a stream.\n");
+        return 0;
+    }
+    Slice *s = universe_read_last_slice(cfg.runs[0].in_file);
+    if(s == NULL) {
         return 0;
     }
-    Module *m = &cfg.modules[cfg.nmodules - 1];
+    if(cfg.nrun > 1) {
+        cfg.tune.threads = 1;                   // The members already use every thread
+    } else {
+        cfg.tune.threads = (cfg.threads > 1) ? cfg.threads : threadpool_topology()->ncpu;
+    }
+    int ok = sim_autotune(&cfg.tune, opt, argc, argv, s);
+    slice_free(s);
+    return ok;
+}
+#endif
 
-    m->handle = dlopen(path, RTLD_LAZY);
-    if(m->handle == NULL) {
-        printf("Could not open module at %s.\n%s\n", path, dlerror());
-        exit(-1);
+int parse_cadence(char *str) {  // -w every=K,time=T.  Returns 0 if it doesn't make sense.
+    while(str != NULL && str[0] != '\0') {
+        char *val = strsep(&str, ",");
+        char *opt = strsep(&val, "=");
+        if(strcmp(opt, "every") == 0 && val != NULL && atoi(val) >= 1) {
+            cfg.write_every = atoi(val);
+        } else if(strcmp(opt, "time") == 0 && val != NULL && strtoull(val, NULL, 0) >= 1) {
+            cfg.write_time = strtoull(val, NULL, 0);
+        } else {
+            printf("Invalid write cadence, %s.  Valid options are: -w every=<steps>,time=<t>\n", opt);
+            return 0;
+        }
     }
-    m->cfg = NULL;
-    m->name = *(char **)dlsym(m->handle, "name");
-    m->init = dlsym(m->handle, "init");
-    m->deinit = dlsym(m->handle, "deinit");
-    m->help = dlsym(m->handle, "help");
-    m->exec = dlsym(m->handle, "exec");
     return 1;
 }
 
-void load_modules() {
-    DIR *d;
-    struct dirent *dir;
-    d = opendir(cfg.module_path);
-    if(d) {
-        while((dir = readdir(d)) != NULL) {
-#ifdef APPLE
-            if(dir->d_type != DT_REG) { continue; }
-            if(dir->d_namlen < 5) { continue; }
-            if(strncmp(&dir->d_name[dir->d_namlen - 4], ".mod", 4) != 0) { continue; }
-            char *full_path = calloc(strlen(cfg.module_path) + dir->d_namlen + 2, sizeof(char));
-            if(full_path == NULL) {
-                printf("Memory allocation failure.\n");
-                exit(-1);
-            }
-            sprintf(full_path, "%s/%s", cfg.module_path, dir->d_name);
-#elif LINUX
-            char *full_path = calloc(strlen(cfg.module_path) + strlen(dir->d_name) + 2, sizeof(char));
-            sprintf(full_path, "%s/%s", cfg.module_path, dir->d_name);
-            struct stat buf;
-            if(stat(full_path, &buf)) { free(full_path); continue; }
-            if(!(S_ISREG(buf.st_mode))) { free(full_path); continue; }
-            if(strncmp(&dir->d_name[strlen(dir->d_name) - 4], ".mod", 4) != 0) { free(full_path); continue; }
-#endif
-            if(!load_module(full_path)) {
-                exit(-1);
-            }
-            free(full_path);
-        }
+void publish_live(void *arg, Slice *s) {   // SimOutput for -S
+    if(cfg.live != NULL && !live_publish(cfg.live, s)) {
+        printf("Stopped publishing to %s.\n", cfg.live_name);
+        live_publisher_free(cfg.live);
+        cfg.live = NULL;
     }
 }
 
+void close_live() {         // Wrapper for atexit
+    live_publisher_free(cfg.live);
+    cfg.live = NULL;
+}
+
 void unload_modules() { // Should be called after pipeline is destroyed!
-    for(int i = 0; i < cfg.nmodules; i++) {
-        dlclose(cfg.modules[i].handle);
+    sim_free_modules(cfg.modules);
+    cfg.modules = NULL;
+}
+
+void catch_SIGINT(int sig) {    // Only async-signal-safe calls in here
+    static const char first[] = "\nCaught SIGINT, will exit after this loop iteration. SIGINT again to exit now.\n";
+    static const char second[] = "\nCaught second SIGINT, exiting now!\n";
+    ++sigint_caught;
+    if(sigint_caught == 1) {
+        write(STDOUT_FILENO, first, sizeof(first) - 1);     // Queued slices are still written on the way out
+        exit_loop = 1;
+    } else {
+        write(STDOUT_FILENO, second, sizeof(second) - 1);
+        _exit(1);                   // Not exit: the atexit teardown would join the writer and free runs still in use
     }
-    cfg.nmodules = 0;
-    free(cfg.modules);
 }
 
-void free_pipeline() {
-    for(int i = 0; i < cfg.npipeline; i++) {
-        cfg.pipeline[i].deinit(cfg.pipeline[i].cfg);
+static void _ensemble_task(void *arg, int task) {   // Runs one member of the ensemble start to finish
+    Run *r = &cfg.runs[task];
+    if(exit_loop) { return; }                       // Interrupted before this one got going
+    if(!sim_open(r->sim, r->in_file, r->out_file)) {
+        r->failed = 1;
+    }
+    while(!r->failed && !r->sim->done && !exit_loop) {
+        if(!sim_step(r->sim)) { r->failed = 1; }
     }
-    cfg.npipeline = 0;
-    free(cfg.pipeline);
+    if(!sim_finish(r->sim)) { r->failed = 1; }
+    sim_destroy(r->sim);                            // Give its memory back while the others carry on
+    r->sim = NULL;
+    int n = __sync_add_and_fetch(&cfg.ndone, 1);
+    printf("\033[2K\rUniverses: %d/%d", n, cfg.nrun);
 }
 
-Module *find_module_by_name(const char *name) {
-    for(int i = 0; i < cfg.nmodules; i++) {
-        if(strcmp(name, cfg.modules[i].name) == 0) {
-            return &cfg.modules[i];
+int add_run(const char *in_file, const char *out_file) {
+    for(int k = 0; k < cfg.nrun; k++) {         // They'd be appending to the same file at the same time
+        if(strcmp(cfg.runs[k].out_file, out_file) == 0) {
+            printf("Output file %s is used more than once.\n", out_file);
+            return 0;
         }
     }
-    return NULL;
+    Run *runs = realloc(cfg.runs, sizeof(Run) * (cfg.nrun + 1));
+    if(runs == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    cfg.runs = runs;
+    Run *r = &cfg.runs[cfg.nrun];
+    memset(r, 0, sizeof(Run));
+    r->in_file = strdup(in_file);
+    r->out_file = strdup(out_file);
+    ++cfg.nrun;
+    if(r->in_file == NULL || r->out_file == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    return 1;
 }
 
-void init_pipeline(int argc, char *argv[]) {
-    cfg.pipeline = realloc(cfg.pipeline, sizeof(Module) * argc);
-    if(cfg.pipeline == NULL) {
-        printf("Memory allocation error.\n");
-        exit(-1);
+int load_ensemble(const char *path) {       // One "<in file> <out file>" pair per line.  # starts a comment.
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        printf("Could not open ensemble list, %s, because: %s\n", path, strerror(errno));
+        return 0;
     }
-    printf("Pipeline: ");
-    for(int i = 0; i < argc; i++) {
-        char *margv = argv[i];
-        char *mname = strsep(&margv, "[");
-        margv = strsep(&margv, "]");
-        Module *m = find_module_by_name(mname);
-        memcpy(&cfg.pipeline[i], m, sizeof(Module));
-        if((cfg.pipeline[i].cfg = cfg.pipeline[i].init(margv)) == NULL) {
-            printf("Initialization of pipeline module, %s, failed!\n", mname);
-            exit(-1);
+    char line[4096], in[2048], out[2048];
+    int lineno = 0;
+    while(fgets(line, sizeof(line), f) != NULL) {
+        ++lineno;
+        char *c = strchr(line, '#');
+        if(c != NULL) { *c = '\0'; }
+        int n = sscanf(line, "%2047s %2047s", in, out);
+        if(n <= 0) { continue; }
+        if(n != 2 || !add_run(in, out)) {
+            if(n != 2) { printf("%s:%d: expected an in and an out universe file.\n", path, lineno); }
+            fclose(f);
+            return 0;
         }
-        ++cfg.npipeline;
-        printf(" %s %s", mname, (argc == i + 1) ? "" : "->");
     }
-    printf("\n");
+    fclose(f);
+    if(cfg.nrun == 0) {
+        printf("No universes listed in %s.\n", path);
+        return 0;
+    }
+    return 1;
 }
 
-void catch_SIGINT(int sig) {
-    ++sigint_caught;
-    if(sigint_caught == 1) {
-        printf("\nCaught SIGINT, will exit after this loop iteration. SIGINT again to exit now.\n");
-        exit_loop = 1;
-    } else {
-        printf("\nCaught second SIGINT, exiting now!\n");
-        exit(0);
+void free_runs() {          // Wrapper for atexit
+#ifdef SYM_MPI
+    if(!cfg.finished) { return; }       // Closing the output is collective, so not if another rank may have gone
+#endif
+    for(int k = 0; k < cfg.nrun; k++) {
+        Run *r = &cfg.runs[k];
+        sim_destroy(r->sim);
+        free((char *)r->in_file);
+        free((char *)r->out_file);
+    }
+    free(cfg.runs);
+    cfg.runs = NULL;
+    cfg.nrun = 0;
+    threadpool_free(cfg.tpool);
+    cfg.tpool = NULL;
+#ifdef SYM_MPI
+    domain_free(cfg.domain);
+    cfg.domain = NULL;
+#endif
+}
+
+void close_writer() {       // Wrapper for atexit.  Blocks until every queued slice is on disk.
+    if(!writer_free(cfg.writer)) {
+        printf("Failed to write some slices!\n");
+    }
+    cfg.writer = NULL;
+    for(int k = 0; k < cfg.nrun; k++) {
+        if(cfg.runs[k].sim != NULL) { cfg.runs[k].sim->writer = NULL; }
     }
 }
 
-void _universe_close() {    // Wrapper for atexit
-    universe_close(cfg.universe);
+#ifdef SYM_MPI
+void mpi_exit() {           // Wrapper for atexit.  If this rank is leaving early, the others can't finish without it.
+    if(cfg.finished) {
+        MPI_Finalize();
+    } else {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 }
+#endif
 
 int main(int argc, const char * argv[]) {   // Entry point
     // Parse args
     cfg.in_file = DEFAULT_IN_FILE;
     cfg.out_file = DEFAULT_OUT_FILE;
+    cfg.ensemble_file = NULL;
     cfg.module_path = DEFAULT_MODULE_PATH;
     cfg.timesteps = DEFAULT_TIMESTEPS;
-    cfg.nmodules = 0;
-    cfg.npipeline = 0;
-    cfg.modules = malloc(sizeof(Module));
-    if(cfg.modules == NULL) {
-        printf("Memory allocation error.\n");
+    cfg.huge = 0;
+    cfg.queue_depth = DEFAULT_QUEUE_DEPTH;
+    cfg.write_every = 0;
+    cfg.write_time = 0;
+    cfg.lod = 0;
+    cfg.columnar = 0;
+    cfg.live_name = NULL;
+    cfg.nanalysis = 0;
+    cfg.analysis = NULL;
+    cfg.live = NULL;
+    cfg.threads = DEFAULT_THREADS;
+    cfg.pin = THREADPOOL_PIN_NONE;
+    cfg.pack_threshold = DEFAULT_PACK_THRESHOLD;
+    cfg.tpool = NULL;
+    cfg.writer = NULL;
+    cfg.nrun = 0;
+    cfg.runs = NULL;
+    cfg.ndone = 0;
+    cfg.modules = NULL;
+#ifdef SYM_MPI
+    MPI_Init(&argc, (char ***)&argv);
+    atexit(mpi_exit);               // Registered first, so it runs after everything else
+    cfg.domain = NULL;
+    cfg.halo = DEFAULT_HALO;
+    cfg.rebalance = DEFAULT_REBALANCE;
+    cfg.finished = 0;
+    if((cfg.domain = domain_create(MPI_COMM_WORLD)) == NULL) {
         exit(-1);
     }
+    int root = (cfg.domain->rank == 0);     // Only rank 0 talks
+#else
+    int root = 1;
+#endif
     atexit(unload_modules);
-    cfg.pipeline = malloc(sizeof(Module));
-    if(cfg.pipeline == NULL) {
-        printf("Memory allocation error.\n");
-        exit(-1);
-    }
-    atexit(free_pipeline);
 
-    printf("\n%s Version %d.%d by %s\n",
-            SymUniverse_PROJECT_NAME, SymUniverse_VERSION_MAJOR, 
-            SymUniverse_VERSION_MINOR, SymUniverse_PROJECT_AUTHOR);
-    
-    int ch, h = 0, pipe_argc = 0;
+    int ch, h = 0, index_modules = 0, tune = 0, pipe_argc = 0;
+    struct option long_options[] = {
+        { "index-modules", no_argument, &index_modules, 1 },
+        { "autotune", no_argument, &tune, 1 },
+        { "tune-steps", required_argument, NULL, OPT_TUNE_STEPS },
+        { "tune-accuracy", required_argument, NULL, OPT_TUNE_ACCURACY },
+        { "tune-cache", required_argument, NULL, OPT_TUNE_CACHE },
+        { NULL, 0, NULL, 0 }
+    };
+    sim_default_tune(&cfg.tune);
+    cfg.tune.cache = DEFAULT_TUNE_CACHE;
     char **pipe_argv = malloc(sizeof(char *));
     if(pipe_argv == NULL) {
         printf("Memory allocation error.\n");
         exit(-1);
     }
-    while((ch = getopt(argc, (char * const *)argv, "hi:o:M:p:m:t:")) != -1) {
+    while((ch = getopt_long(argc, (char * const *)argv, "hi:o:e:M:p:m:a:t:Lq:w:l:CS:T:A:P:H:R:", long_options, NULL)) != -1) {
         switch (ch) {
+            case 0:     // Long option that just sets a flag
+                break;
             case 'i':
                 cfg.in_file = optarg;
                 break;
             case 'o':
                 cfg.out_file = optarg;
                 break;
+            case 'e':
+                cfg.ensemble_file = optarg;
+                break;
             case 'M':
                 cfg.module_path = optarg;
                 break;
@@ -250,9 +445,73 @@ int main(int argc, const char * argv[]) {   // Entry point
                 }
                 pipe_argv[pipe_argc - 1] = optarg;
                 break;
+            case 'a':
+                cfg.analysis = realloc(cfg.analysis, sizeof(char *) * (cfg.nanalysis + 1));
+                if(cfg.analysis == NULL) {
+                    printf("Memory allocation error.\n");
+                    exit(-1);
+                }
+                cfg.analysis[cfg.nanalysis++] = optarg;
+                break;
             case 't':
                 cfg.timesteps = atoi(optarg);
                 break;
+            case 'L':
+                cfg.huge = 1;
+                break;
+            case 'q':
+                cfg.queue_depth = atoi(optarg);
+                break;
+            case 'w':
+                if(!parse_cadence(optarg)) { h = 1; }
+                break;
+            case 'l':
+                cfg.lod = strtod(optarg, NULL);
+                if(cfg.lod <= 0 || cfg.lod > 1) {
+                    printf("The level of detail fraction has to be in (0, 1].\n");
+                    h = 1;
+                }
+                break;
+            case 'C':
+                cfg.columnar = 1;
+                break;
+            case 'S':
+                cfg.live_name = optarg;
+                break;
+            case 'T':
+                cfg.threads = atoi(optarg);
+                break;
+            case 'A':
+                if(strcmp(optarg, "compact") == 0) {
+                    cfg.pin = THREADPOOL_PIN_COMPACT;
+                } else if(strcmp(optarg, "scatter") == 0) {
+                    cfg.pin = THREADPOOL_PIN_SCATTER;
+                } else if(strcmp(optarg, "none") == 0) {
+                    cfg.pin = THREADPOOL_PIN_NONE;
+                } else {
+                    h = 1;
+                }
+                break;
+            case 'P':
+                cfg.pack_threshold = strtod(optarg, NULL);
+                break;
+            case OPT_TUNE_STEPS:
+                cfg.tune.steps = atoi(optarg);
+                break;
+            case OPT_TUNE_ACCURACY:
+                cfg.tune.accuracy = strtod(optarg, NULL);
+                break;
+            case OPT_TUNE_CACHE:
+                cfg.tune.cache = optarg;
+                break;
+#ifdef SYM_MPI
+            case 'H':
+                cfg.halo = strtod(optarg, NULL);
+                break;
+            case 'R':
+                cfg.rebalance = strtod(optarg, NULL);
+                break;
+#endif
             case '?':
             case 'h':
             default:
@@ -260,90 +519,180 @@ int main(int argc, const char * argv[]) {   // Entry point
         }
     }
     
-    load_modules();     // Load modules
+    if(strcmp(cfg.out_file, UNIVERSE_STDIO) == 0 && cfg.ensemble_file == NULL && !universe_claim_stdout()) {
+        exit(-1);                   // The universe goes to stdout, so everything else has to go somewhere else
+    }
+    if(root) {
+        printf("\n%s Version %d.%d by %s\n",
+                SymUniverse_PROJECT_NAME, SymUniverse_VERSION_MAJOR, 
+                SymUniverse_VERSION_MINOR, SymUniverse_PROJECT_AUTHOR);
+    }
+    
+    if(index_modules) {
+        int n = root ? sim_index_modules(cfg.module_path) : 0;
+        if(n < 0) { exit(-1); }
+        if(root) { printf("Indexed %d modules in %s/%s\n", n, cfg.module_path, SIM_MODULE_INDEX); }
+#ifdef SYM_MPI
+        cfg.finished = 1;
+#endif
+        exit(0);
+    }
+    if((cfg.modules = sim_open_modules(cfg.module_path)) == NULL) {     // Modules are opened as the pipeline asks for them
+        exit(-1);
+    }
     if(h != 0) {     // We want to load modules before displaying help so we can give mod help
-        help(argv[0]);
+        if(root) { help(argv[0]); }
         exit(-1);
     }
-    // Initialize pipeline
-    init_pipeline(pipe_argc, pipe_argv);
-    free(pipe_argv);
-    
-    // Load Univere(s)
-    if(access(cfg.out_file, W_OK) == 0) {
-        printf("Opening existing file for output: %s\n", cfg.out_file);
-        cfg.universe = universe_open(cfg.out_file);
-    } else {
-        printf("Creating new file for output: %s\n", cfg.out_file);
-        cfg.universe = universe_create(cfg.out_file);
-
+#ifdef SYM_MPI
+    if(cfg.ensemble_file != NULL) {
+        if(root) { printf("Ensemble mode (-e) isn't supported with MPI, run one universe per rank instead.\n"); }
+        exit(-1);
     }
-    if(cfg.universe == NULL) {
+    if(tune) {
+        if(root) { printf("--autotune isn't supported with MPI, tune with sym first.\n"); }
         exit(-1);
     }
-    atexit(_universe_close);
-    
-    Slice *pslice, *slice;
-    
-    if(strcmp(cfg.out_file, cfg.in_file) == 0) {
-        printf("Output and Input files are the same, resuming from last slice.\n");
-        pslice = universe_get_last_slice(cfg.universe);
-    } else {
-        printf("Reading initial configuration from: %s\n", cfg.in_file);
-        Universe *iu = universe_open(cfg.in_file);
-        pslice = universe_get_last_slice(iu);
-        universe_close(iu);
+    if(cfg.nanalysis > 0) {
+        if(root) { printf("Analysis plug-ins (-a) aren't supported with MPI.\n"); }
+        exit(-1);
     }
-    if(pslice == NULL) {
+    if(cfg.columnar) {              // Ranks write their bodies side by side, which only works a whole body at a time
+        if(root) { printf("Columnar output (-C) isn't supported with MPI.\n"); }
         exit(-1);
     }
-    slice = slice_copy(pslice);
-    ++slice->time;
+    cfg.queue_depth = 0;            // Slices are written collectively, straight from the main loop
+    cfg.pack_threshold = 0;         // Deleted bodies would be written, or sent to other ranks
+#endif
     
-    // Main loop
-    int loop_idx = 0;
-    exit_loop = (cfg.timesteps == 0) ? 1 : 0;
-    sigint_caught = 0;
-    signal(SIGINT, catch_SIGINT);
-    setbuf(stdout, NULL);
-    while(exit_loop == 0) {
-        printf("\033[2K\rTimestep: %d/%d", loop_idx + 1, cfg.timesteps);
-        int ret = 0;
-        for(int i = 0; i < cfg.npipeline; i++) {
-            ret |= cfg.pipeline[i].exec(cfg.pipeline[i].cfg, pslice, slice);
+    // One run per universe.  Each gets its own instance of every pipeline module.
+    int ensemble = (cfg.ensemble_file != NULL);
+    atexit(free_runs);
+    if(ensemble) {
+        if(!load_ensemble(cfg.ensemble_file)) {
+            exit(-1);
+        }
+    } else if(!add_run(cfg.in_file, cfg.out_file)) {
+        exit(-1);
+    }
+    for(int k = 0; ensemble && k < cfg.nrun; k++) {
+        if(strcmp(cfg.runs[k].out_file, UNIVERSE_STDIO) == 0) {
+            printf("Ensemble members can't stream to stdout, give them a FIFO each instead.\n");
+            exit(-1);
         }
-        
-        if(ret & MOD_RET_ABRT) { exit(-1); }            // Module requested abort without append
-        if(ret & MOD_RET_EXIT) { exit_loop = 1; }       // Module requested exit
-        if(ret & MOD_RET_PACK) {                        // Module thinks we need to repack
-            if(!slice_pack(slice)) {
-                exit(-1);                               // slice_pack failed, probably due to memory allocation.
-            }
+    }
+    if(cfg.nanalysis > 0 && ensemble) {     // They'd all write the same files
+        printf("Analysis plug-ins (-a) only work for one universe at a time, not with -e.\n");
+        exit(-1);
+    }
+    if(cfg.live_name != NULL) {
+        if(ensemble) {
+            printf("Publishing (-S) only works for one universe at a time, not with -e.\n");
+            exit(-1);
         }
-        else { slice_clear_create(slice); }             // This is redundant if we run slice_pack
-                                                        // ???: Could make clear_create based on ret value.
-        
-        if(!universe_append_slice(cfg.universe, slice)) {
+        char name[1024];
+        snprintf(name, sizeof(name), "%s", cfg.live_name);
+#ifdef SYM_MPI
+        if(cfg.domain->size > 1) { snprintf(name, sizeof(name), "%s.%d", cfg.live_name, cfg.domain->rank); }
+#endif
+        if((cfg.live = live_publisher_create(name, (cfg.lod > 0) ? cfg.lod : 1)) == NULL) {
+            exit(-1);
+        }
+        atexit(close_live);
+    }
+    if(root) {
+        printf("Topology: ");
+        print_topology(threadpool_topology());
+    }
+    if((cfg.tpool = threadpool_create_pinned(cfg.threads, cfg.pin)) == NULL) {
+        exit(-1);
+    }
+    if(cfg.queue_depth > 0) {       // Overlap output with compute.  Registered after free_runs so it drains before that runs.
+        if((cfg.writer = writer_create(NULL, NULL, cfg.queue_depth * cfg.nrun)) == NULL) {
+            exit(-1);
+        }
+        atexit(close_writer);
+    }
+    SimOptions opt;
+    sim_default_options(&opt, cfg.modules);
+    opt.timesteps = cfg.timesteps;
+    opt.huge = cfg.huge;
+    opt.pack_threshold = cfg.pack_threshold;
+    opt.writer = cfg.writer;
+    opt.write_every = cfg.write_every;
+    opt.write_time = cfg.write_time;
+    opt.lod = cfg.lod;
+    opt.columnar = cfg.columnar;
+    opt.nanalysis = cfg.nanalysis;
+    opt.analysis = cfg.analysis;
+    if(cfg.live != NULL) {
+        opt.output = publish_live;
+    }
+    opt.tpool = ensemble ? NULL : cfg.tpool;    // In ensemble mode tpool is busy running the members
+    opt.concurrent = !ensemble;                 // Ensemble members run in parallel with each other, not internally
+    opt.numa = (cfg.pin != THREADPOOL_PIN_NONE);
+#ifdef SYM_MPI
+    opt.domain = cfg.domain;
+    opt.halo = cfg.halo;
+    opt.rebalance = cfg.rebalance;
+#endif
+    char **run_argv = pipe_argv;
+#ifndef SYM_MPI
+    if(tune) {
+        opt.verbose = 1;
+        if(!autotune(&opt, pipe_argc, pipe_argv)) {
             exit(-1);
         }
-        slice_free(pslice);
-        pslice = slice;
-        slice = slice_copy(pslice);
-        if(slice == NULL) {
-            printf("Memory allocation error.\n");
+        run_argv = cfg.tune.argv;
+    }
+#endif
+    for(int k = 0; k < cfg.nrun; k++) {
+        opt.verbose = root && k == 0;
+        if((cfg.runs[k].sim = sim_create(&opt, pipe_argc, run_argv)) == NULL) {
             exit(-1);
         }
-        ++slice->time;
-        ++loop_idx;
-        if(cfg.timesteps >= 0 && loop_idx >= cfg.timesteps) {
-            exit_loop = 1;
+    }
+    free(pipe_argv);
+    free(cfg.analysis);
+    cfg.analysis = NULL;
+    sim_tune_free(&cfg.tune);
+    
+    // Main loop
+    exit_loop = 0;
+    sigint_caught = 0;
+    signal(SIGINT, catch_SIGINT);
+    setbuf(stdout, NULL);
+    if(ensemble) {
+        printf("Running %d universes on %d threads.\n", cfg.nrun, cfg.threads);
+        threadpool_run(cfg.tpool, _ensemble_task, NULL, cfg.nrun);
+        printf("\n");
+        int nfailed = 0;
+        for(int k = 0; k < cfg.nrun; k++) {
+            if(!cfg.runs[k].failed) { continue; }
+            printf("Failed to simulate %s -> %s!\n", cfg.runs[k].in_file, cfg.runs[k].out_file);
+            ++nfailed;
         }
+        return (nfailed > 0) ? -1 : 0;
     }
-    printf("\n");
     
-    // TODO: atexit doesn't take care of these.
-    slice_free(pslice);
-    slice_free(slice);
+    Sim *sim = cfg.runs[0].sim;
+    if(!sim_open(sim, cfg.runs[0].in_file, cfg.runs[0].out_file)) {
+        exit(-1);
+    }
+    while(!sim->done && !exit_loop) {
+#ifdef SYM_MPI
+        MPI_Allreduce(MPI_IN_PLACE, &exit_loop, 1, MPI_INT, MPI_MAX, cfg.domain->comm);    // Ctrl^c reaches ranks at different times
+        if(exit_loop) { break; }
+#endif
+        if(root) { printf("\033[2K\rTimestep: %d/%d", sim->step + 1, cfg.timesteps); }
+        if(!sim_step(sim)) {
+            exit(-1);
+        }
+    }
+    if(root) { printf("\n"); }
+#ifdef SYM_MPI
+    cfg.finished = 1;
+#endif
     
-    return 0;
+    return 0;   // The writer may still hold slices, they're written and released at exit
 }
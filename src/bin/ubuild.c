@@ -184,6 +184,10 @@ int main(int argc, const char *argv[]) {   // Entry point
     s.bound_min.y = cfg.bound_min.y;
     s.bound_min.z = cfg.bound_min.z;
     s.bodies = (Particle *)calloc(cfg.nbody,sizeof(Particle));
+    s.capacity = cfg.nbody;
+    s.scratch = NULL;
+    s.refs = 1;
+    s.ndelete = 0;
     if(s.bodies == NULL) {
         printf("Memory allocation error.\n");
         exit(-1);
@@ -15,24 +15,32 @@
 #define NUM_FIELDS 21
 
 int main(int argc, char *argv[]) {
-    if(argc != 3) {
-        printf("Usage: %s <in_file> <universe_file>\n", argv[0]);
+    int columnar = (argc == 4 && strcmp(argv[1], "-c") == 0);
+    if(argc != 3 + columnar) {
+        printf("Usage: %s [-c] <in_file> <universe_file>\n"
+               "-c stores the universe a column (field) at a time, see sym -C.\n", argv[0]);
         return 1;
     }
-    FILE *i = fopen(argv[1], "r");
+    const char *in_file = argv[1 + columnar];
+    const char *out_file = argv[2 + columnar];
+    FILE *i = fopen(in_file, "r");
     if(i == NULL) {
-        printf("Unable to open input file: %s\n", argv[1]);
+        printf("Unable to open input file: %s\n", in_file);
         return 1;
     }
-    Universe *u = universe_create(argv[2]);
+    Universe *u = columnar ? universe_create_columnar(out_file) : universe_create(out_file);
     if(u == NULL) {
-        printf("Unable to create universe file: %s\n", argv[2]);
+        printf("Unable to create universe file: %s\n", out_file);
         fclose(i);
         return 1;
     }
     
     Slice s;
     s.bodies = malloc(sizeof(Particle));
+    s.capacity = 1;
+    s.scratch = NULL;
+    s.refs = 1;
+    s.ndelete = 0;
     s.time = 0;
     s.nbody = 0;
     s.bound_min.x = 0;
@@ -8,13 +8,39 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "universe.h"
+#include "umap.h"
+
+static void write_slice(FILE *o, Slice *s) {
+    for(int j = 0; j < s->nbody; j++) {
+        fprintf(o,
+                "%llu,"
+                "%g,%g,%g,"
+                "%g,%g,%g,"
+                "%x,%x,"
+                "%g,%g,%g,"
+                "%g,%g,%g,"
+                "%g,%g,%g,"
+                "%g,%g,%g\n",
+                s->time,
+                s->bound_min.x, s->bound_min.y, s->bound_min.z,
+                s->bound_max.x, s->bound_max.y, s->bound_max.z,
+                s->bodies[j].flags, s->bodies[j].uflags,
+                s->bodies[j].mass, s->bodies[j].charge, s->bodies[j].radius,
+                s->bodies[j].pos.x, s->bodies[j].pos.y, s->bodies[j].pos.z,
+                s->bodies[j].vel.x, s->bodies[j].vel.y, s->bodies[j].vel.z,
+                s->bodies[j].acc.x, s->bodies[j].acc.y, s->bodies[j].acc.z
+                );
+    }
+}
 
 int main(int argc, char *argv[]) {
     
     if(argc < 3 || argc > 4) {
-        printf("Usage: %s [interval] <universe_file> <out_file>\n", argv[0]);
+        printf("Usage: %s [interval] <universe_file> <out_file>\n"
+               "<universe_file> can be - (stdin) or a FIFO, to convert a stream (e.g. from sym -o -) as it comes.  <out_file> can be - (stdout).\n", argv[0]);
         return 1;
     }
     
@@ -24,54 +50,63 @@ int main(int argc, char *argv[]) {
         interval = atoi(argv[argn++]);
     }
     
-    Universe *u = universe_open(argv[argn++]);
-    if(u == NULL) {
-        printf("Unable to open universe file: %s\n", argv[1]);
+    const char *in_file = argv[argn++];
+    const char *out_file = argv[argn++];
+    Universe *u = NULL;
+    UniverseMap *m = NULL;
+    if(universe_is_stream(in_file)) {
+        u = universe_open_stream(in_file);
+    } else {
+        m = umap_open(in_file, UMAP_SEQUENTIAL);    // Files are read in place, nothing is copied
+    }
+    if(u == NULL && m == NULL) {
+        printf("Unable to open universe file: %s\n", in_file);
         return 1;
     }
-    FILE *o = fopen(argv[argn++], "w+");
+    FILE *o = (strcmp(out_file, "-") == 0) ? stdout : fopen(out_file, "w+");
     if(o == NULL) {
-        printf("Unable to open output file: %s\n", argv[2]);
-        universe_close(u);
+        printf("Unable to open output file: %s\n", out_file);
+        if(u != NULL) { universe_close(u); }
+        umap_close(m);
         return 1;
     }
     
     fprintf(o, "time,min.x,min.y,min.z,max.x,max.y,max.z,flags,uflags,mass,charge,radius,"
             "pos.x,pos.y,pos.z,vel.x,vel.y,vel.z,acc.x,acc.y,acc.z\n");
             
-    for(int k = 0; k < floor((float)u->nslice/interval); k++) {
+    if(u != NULL) {     // Piped in, so every interval'th slice as it comes
+        Slice *s;
+        for(uint64_t i = 0; (s = universe_next_slice(u)) != NULL; i++) {
+            if(i % interval == 0) { write_slice(o, s); }
+            slice_free(s);
+        }
+        int ok = u->at_end;
+        if(!ok) { printf("Unable to read slice %llu.\n", (unsigned long long)u->next); }
+        fclose(o);
+        universe_close(u);
+        universe_free(u);
+        return ok ? 0 : 1;
+    }
+    Slice s, columns = { 0 };   // Version 3 slices are put back together in columns
+    int ok = 1;
+    for(int k = 0; ok && k < floor((float)m->nslice/interval); k++) {
         int i = k * interval;
-        Slice *s = universe_get_slice(u, i);
-        if(s == NULL) {
-            printf("Unable to read slice %d.\n", i);
-            fclose(o);
-            universe_close(u);
-            return 1;
+        if(m->version >= UNIVERSE_VERSION_COLUMNAR) {
+            ok = umap_read(m, i, PARTICLE_FIELD_ALL, &columns);
+            s = columns;
+        } else {
+            ok = umap_slice(m, i, &s);
         }
-        for(int j = 0; j < s->nbody; j++) {
-            fprintf(o,
-                    "%llu,"
-                    "%g,%g,%g,"
-                    "%g,%g,%g,"
-                    "%x,%x,"
-                    "%g,%g,%g,"
-                    "%g,%g,%g,"
-                    "%g,%g,%g,"
-                    "%g,%g,%g\n",
-                    s->time,
-                    s->bound_min.x, s->bound_min.y, s->bound_min.z,
-                    s->bound_max.x, s->bound_max.y, s->bound_max.z,
-                    s->bodies[j].flags, s->bodies[j].uflags,
-                    s->bodies[j].mass, s->bodies[j].charge, s->bodies[j].radius,
-                    s->bodies[j].pos.x, s->bodies[j].pos.y, s->bodies[j].pos.z,
-                    s->bodies[j].vel.x, s->bodies[j].vel.y, s->bodies[j].vel.z,
-                    s->bodies[j].acc.x, s->bodies[j].acc.y, s->bodies[j].acc.z
-                    );
+        if(!ok) {
+            printf("Unable to read slice %d.\n", i);
+            break;
         }
-        slice_free(s);
+        umap_prefetch(m, i + interval);
+        write_slice(o, &s);
     }
     
+    free(columns.bodies);
     fclose(o);
-    universe_close(u);
-    return 0;
+    umap_close(m);
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,94 @@
+//
+//  uwatch.c - Live statistics of a running sym (see sym -S)
+//  SymUniverse
+//
+//  Reads the newest slice straight out of shared memory, so watching costs the simulation nothing.
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include "universe.h"
+#include "live.h"
+
+#define DEFAULT_INTERVAL 1.0
+
+static void print_stats(Slice *s, LiveSlot *info) {    // Totals are estimated from the sample when there is one
+    double scale = (s->nbody > 0) ? (double)info->ntotal / s->nbody : 0;
+    double mass = 0, ke = 0, speed = 0, vmax = 0;
+    Vector com = {0, 0, 0};
+    for(uint64_t i = 0; i < s->nbody; i++) {
+        Particle *p = &s->bodies[i];
+        double v = sqrt(vector_dot(&p->vel, &p->vel));
+        mass += p->mass;
+        ke += 0.5 * p->mass * v * v;
+        speed += v;
+        vmax = (v > vmax) ? v : vmax;
+        com.x += p->mass * p->pos.x;
+        com.y += p->mass * p->pos.y;
+        com.z += p->mass * p->pos.z;
+    }
+    if(mass > 0) {
+        com.x /= mass;
+        com.y /= mass;
+        com.z /= mass;
+    }
+    printf("time %llu  bodies %llu", (unsigned long long)s->time, (unsigned long long)info->ntotal);
+    if(info->stride > 1) { printf(" (1 in %llu shown)", (unsigned long long)info->stride); }
+    printf("  mass %g  KE %g  <|v|> %g  max|v| %g  CoM (%g, %g, %g)\n", mass * scale, ke * scale,
+           (s->nbody > 0) ? speed / s->nbody : 0, vmax, com.x, com.y, com.z);
+}
+
+int main(int argc, char *argv[]) {
+    double interval = DEFAULT_INTERVAL;
+    int count = -1, ch;
+    while((ch = getopt(argc, argv, "n:c:h")) != -1) {
+        switch(ch) {
+            case 'n':
+                interval = strtod(optarg, NULL);
+                break;
+            case 'c':
+                count = atoi(optarg);
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if(argc == 0 || optind != argc - 1) {
+        printf("Usage: %s [-n <seconds between updates> (default: %g)] [-c <updates before exiting>] <name>\n"
+               "Print statistics of the slices a sym -S <name> publishes, as they come.\n", argv[0], DEFAULT_INTERVAL);
+        return 1;
+    }
+    const char *name = argv[optind];
+
+    LiveReader *r;
+    int waiting = 0;
+    while((r = live_reader_open(name, waiting)) == NULL) {     // Only the first try says what's wrong
+        if(!waiting) { printf("Waiting for %s...\n", name); }
+        waiting = 1;
+        usleep(interval * 1e6);
+    }
+    Slice s = { 0 };
+    LiveSlot info;
+    uint64_t last = 0;
+    int seen = 0;
+    while(count != 0) {
+        int finished = live_finished(r);    // Before reading, so the last slice isn't missed
+        if(live_read(r, &s, &info) && (!seen || s.time != last)) {
+            print_stats(&s, &info);
+            fflush(stdout);
+            last = s.time;
+            seen = 1;
+            if(count > 0) { --count; }
+        } else if(finished) {
+            printf("%s finished.\n", name);
+            break;
+        }
+        if(count != 0) { usleep(interval * 1e6); }
+    }
+    free(s.bodies);
+    live_reader_close(r);
+    return 0;
+}
@@ -0,0 +1,412 @@
+//
+//  collisions.c
+//  SymUniverse - Routines for detecting and resolving swept sphere collisions.
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "collisions.h"
+#include "threadpool.h"
+#include "universe.h"
+#include "SymUniverseConfig.h"
+
+double collision_timestep(Slice *ps, Slice *s) {    // Reverse engineer the timestep.  Returns 0 if nothing moved.
+    for(int i = 0; i < ps->nbody; i++) {    // A little odd.  Basically, we want to account for the fact that some particles may have zero v.x;
+        if(s->bodies[i].vel.x == 0 || (s->bodies[i].flags & PARTICLE_FLAG_DELETE)) { continue; }  // Deleted bodies don't move
+        return (s->bodies[i].pos.x - ps->bodies[i].pos.x) / s->bodies[i].vel.x;
+    }
+    return 0;
+}
+
+int collision_detect(Slice *ps, Slice *s, uint64_t i, uint64_t j, double ts, Collision *c) {  // Returns 1 if i and j collide during this step
+    Vector pp;
+
+    // 1. move into the rest frame of body i
+    vector_sub(&pp, &ps->bodies[j].pos, &ps->bodies[i].pos);
+    vector_sub(&c->v, &s->bodies[j].vel, &s->bodies[i].vel);
+
+    // 2. move to scattering frame
+    double v2 = vector_dot(&c->v, &c->v);
+    if(v2 == 0) { return 0; }
+    double t0 = - vector_dot(&c->v, &pp) / (v2 * ts);  // time to perpendicular bisector to infinite line defined by pp -> p
+
+    c->chi.x = c->v.x * t0 + pp.x;
+    c->chi.y = c->v.y * t0 + pp.y;
+    c->chi.z = c->v.z * t0 + pp.z;
+    c->b = sqrt(vector_dot(&c->chi, &c->chi));        // impact parameter
+    c->R = s->bodies[i].radius + s->bodies[j].radius;
+    if(c->b > c->R) { return 0; }                       // definitely don't collide
+
+    c->vel = sqrt(v2);                                  // note: this is always >= 0
+    c->xi = - c->vel * t0;
+    if(c->xi >= 0) { return 0; }                        // particle is moving away
+    double xf = c->vel * (ts - t0);
+    if(xf < - c->R) { return 0; }
+
+    c->i = i;
+    c->j = j;
+    return 1;
+}
+
+int collision_resolve_point(Slice *s, Collision *c, double ts) {   // Point-like resolution (see ptcollide)
+    Particle *bi = &s->bodies[c->i];
+    Particle *bj = &s->bodies[c->j];
+    double vel = c->vel, b = c->b;
+
+    double tc = - (c->xi + c->R) / vel;                 // time of collision
+    double v1f = 2 * bj->mass / (bj->mass + bi->mass) * vel;
+    double v2f = (bj->mass - bi->mass) / (bj->mass + bi->mass) * vel;
+    double x1f = v1f * (ts - tc);
+    double x2f = v2f * (ts - tc) - c->R;
+
+    // return to sym frame
+    if(b != 0) {
+        Vector ux, uy;          // together as a row matrix, these give the inverse rotation matrix.
+        ux.x = c->v.x / vel;
+        ux.y = c->v.y / vel;
+        ux.z = c->v.z / vel;
+        uy.x = c->chi.x / b;
+        uy.y = c->chi.y / b;
+        uy.z = c->chi.z / b;
+        // rotate + translate in one step
+        bj->pos.x = x2f * ux.x + b * uy.x + bi->pos.x;
+        bj->pos.y = x2f * ux.y + b * uy.y + bi->pos.y;
+        bj->pos.z = x2f * ux.z + b * uy.z + bi->pos.z;
+        bi->pos.x += x1f * ux.x;
+        bi->pos.y += x1f * ux.y;
+        bi->pos.z += x1f * ux.z;
+
+        bj->vel.x = v2f * ux.x + bi->vel.x;
+        bj->vel.y = v2f * ux.y + bi->vel.y;
+        bj->vel.z = v2f * ux.z + bi->vel.z;
+        bi->vel.x += v1f * ux.x;
+        bi->vel.y += v1f * ux.y;
+        bi->vel.z += v1f * ux.z;
+    } else {                    // in the off chance b = 0, we have a divide by zero, we have to do things differently
+        Vector uv;
+        uv.x = c->v.x / vel;    // Both position & velocity will lie relative to the velocity unit vector
+        uv.y = c->v.y / vel;
+        uv.z = c->v.z / vel;
+
+        bj->pos.x = x2f * uv.x + bi->pos.x;
+        bj->pos.y = x2f * uv.y + bi->pos.y;
+        bj->pos.z = x2f * uv.z + bi->pos.z;
+        bi->pos.x += x1f * uv.x;
+        bi->pos.y += x1f * uv.y;
+        bi->pos.z += x1f * uv.z;
+        bj->vel.x = v2f * uv.x + bi->vel.x;
+        bj->vel.y = v2f * uv.y + bi->vel.y;
+        bj->vel.z = v2f * uv.z + bi->vel.z;
+        bi->vel.x += v1f * uv.x;
+        bi->vel.y += v1f * uv.y;
+        bi->vel.z += v1f * uv.z;
+    }
+    return 1;
+}
+
+int collision_resolve_sphere(Slice *s, Collision *c, double ts) {  // Sphere resolution (see scollide).  Returns 0 if we can't handle it.
+    Particle *bi = &s->bodies[c->i];
+    Particle *bj = &s->bodies[c->j];
+    double vel = c->vel, b = c->b, R = c->R;
+
+    if(b == 0) { return 0; }    // we have a divide by zero, and no way to pick a scattering plane
+
+    // The "theory" here is that v1f should be along the line connecting the centers at the point of collision.
+    // The magnitude of v1f is then given by v1f = 2*vel*j.mass/(i.mass+j.mass)*cos(theta)
+    // We then just adjust v1f to conserve linear momentum.
+    double tc = - (c->xi + R) / vel;                    // time of collision
+
+    double vifx = 2*vel*bj->mass/(bj->mass + bi->mass)*(R*R-b*b)/(R*R);
+    double vify = - 2*vel*bj->mass/(bj->mass + bi->mass)*sqrt(R*R-b*b)/(R*R)*b;
+    double vjfx = - bi->mass/bj->mass*vifx + vel;
+    double vjfy = - bi->mass/bj->mass*vify;
+    double xifx = vifx * (ts - tc);
+    double xify = vify * (ts - tc);
+    double xjfx = vjfx * (ts - tc) - sqrt(R*R-b*b);
+    double xjfy = vjfx * (ts - tc) + b;
+
+    // return to sym frame
+    Vector ux, uy;              // together as a row matrix, these give the inverse rotation matrix.
+    ux.x = c->v.x / vel;
+    ux.y = c->v.y / vel;
+    ux.z = c->v.z / vel;
+    uy.x = c->chi.x / b;
+    uy.y = c->chi.y / b;
+    uy.z = c->chi.z / b;
+    // rotate + translate in one step
+    bj->pos.x = xjfx * ux.x + xjfy * uy.x + bi->pos.x;
+    bj->pos.y = xjfx * ux.y + xjfy * uy.y + bi->pos.y;
+    bj->pos.z = xjfx * ux.z + xjfy * uy.z + bi->pos.z;
+    bi->pos.x += xifx * ux.x + xify * uy.x;
+    bi->pos.y += xifx * ux.y + xify * uy.y;
+    bi->pos.z += xifx * ux.z + xify * uy.z;
+
+    bj->vel.x = vjfx * ux.x + vjfy * uy.x + bi->vel.x;
+    bj->vel.y = vjfx * ux.y + vjfy * uy.y + bi->vel.y;
+    bj->vel.z = vjfx * ux.z + vjfy * uy.z + bi->vel.z;
+    bi->vel.x += vifx * ux.x + vify * uy.x;
+    bi->vel.y += vifx * ux.y + vify * uy.y;
+    bi->vel.z += vifx * ux.z + vify * uy.z;
+    return 1;
+}
+
+// -- Vectorized narrow phase --
+// collision_filter() runs the same tests as collision_detect() on COLLISION_LANES pairs (i, j) .. (i, j + LANES - 1)
+// at once, without branches or square roots, and returns a bitmask of the pairs that may collide.  It is slightly
+// conservative (see _FILTER_SLACK) so it never rejects a pair that collision_detect() would accept; survivors still
+// have to go through collision_detect() for the real answer.
+
+#define _FILTER_SLACK 1e-9          // Relative slack on the filter comparisons, covers rounding differences
+
+typedef double v4d __attribute__((vector_size(COLLISION_LANES * sizeof(double))));
+typedef int64_t v4i __attribute__((vector_size(COLLISION_LANES * sizeof(int64_t))));
+
+#define _V4D_LOAD(v, p) memcpy(&(v), (p), sizeof(v4d))     // Unaligned load (a macro, vector returns trip -Wpsabi)
+
+int collision_soa_load(CollisionSoA *a, Slice *ps, Slice *s) {     // Columns live in s's scratch arena.  Returns 0 on allocation failure.
+    uint64_t n = ps->nbody;
+    uint64_t size = (n + 2 * COLLISION_LANES - 1) / COLLISION_LANES * COLLISION_LANES;    // Room for a full block past the end
+    double *buf = slice_scratch(s, sizeof(double) * size * 7);
+    if(buf == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    a->n = n;
+    a->px = buf;
+    a->py = &buf[size];
+    a->pz = &buf[2 * size];
+    a->vx = &buf[3 * size];
+    a->vy = &buf[4 * size];
+    a->vz = &buf[5 * size];
+    a->r = &buf[6 * size];
+    for(uint64_t i = 0; i < n; i++) {
+        a->px[i] = ps->bodies[i].pos.x;
+        a->py[i] = ps->bodies[i].pos.y;
+        a->pz[i] = ps->bodies[i].pos.z;
+        collision_soa_update(a, s, i);
+    }
+    for(uint64_t i = n; i < size; i++) {    // Padding never collides
+        a->px[i] = a->py[i] = a->pz[i] = 0;
+        a->vx[i] = a->vy[i] = a->vz[i] = 0;
+        a->r[i] = NAN;
+    }
+    return 1;
+}
+
+void collision_soa_update(CollisionSoA *a, Slice *s, uint64_t i) {    // Call after resolving a collision involving i
+    a->vx[i] = s->bodies[i].vel.x;
+    a->vy[i] = s->bodies[i].vel.y;
+    a->vz[i] = s->bodies[i].vel.z;
+    a->r[i] = (s->bodies[i].flags & (PARTICLE_FLAG_DELETE | PARTICLE_FLAG_CREATE)) ? NAN : s->bodies[i].radius;
+}
+
+unsigned collision_filter(CollisionSoA *a, uint64_t i, uint64_t j, double ts) {
+    v4d ppx, ppy, ppz, vx, vy, vz, R;
+    _V4D_LOAD(ppx, &a->px[j]);
+    _V4D_LOAD(ppy, &a->py[j]);
+    _V4D_LOAD(ppz, &a->pz[j]);
+    _V4D_LOAD(vx, &a->vx[j]);
+    _V4D_LOAD(vy, &a->vy[j]);
+    _V4D_LOAD(vz, &a->vz[j]);
+    _V4D_LOAD(R, &a->r[j]);
+    ppx -= a->px[i];
+    ppy -= a->py[i];
+    ppz -= a->pz[i];
+    vx -= a->vx[i];
+    vy -= a->vy[i];
+    vz -= a->vz[i];
+    R += a->r[i];                                   // NAN for anything that doesn't take part, fails every test below
+    v4d one = { 1.0, 1.0, 1.0, 1.0 };
+    v4d slack = one * (1.0 + _FILTER_SLACK);
+
+    v4d v2 = vx * vx + vy * vy + vz * vz;
+    v4i moving = (v2 > 0);
+    v4d den = (v4d)(((v4i)(v2 * ts) & moving) | ((v4i)one & ~moving));    // Avoid 0/0 in dead lanes
+    v4d t0 = - (vx * ppx + vy * ppy + vz * ppz) / den;
+
+    v4d cx = vx * t0 + ppx;
+    v4d cy = vy * t0 + ppy;
+    v4d cz = vz * t0 + ppz;
+    v4d b2 = cx * cx + cy * cy + cz * cz;
+    v4d R2 = R * R * slack;
+
+    v4d dt = t0 - ts;                               // xf >= -R  <=>  t0 <= ts or v2 * (t0 - ts)^2 <= R^2
+    v4i hit = moving &
+              (b2 <= R2) &                          // b <= R
+              (t0 > - _FILTER_SLACK * ts) &         // xi < 0, i.e. approaching
+              ((dt <= 0) | (v2 * dt * dt <= R2));
+
+    unsigned mask = 0;
+    for(int k = 0; k < COLLISION_LANES; k++) {
+        mask |= (hit[k] != 0) << k;
+    }
+    return mask;
+}
+
+// Serial all-pairs detection and resolution, in (i, j) order.  Pairs are filtered COLLISION_LANES at a time and only
+// the survivors see the scalar narrow phase and resolver.  Returns 0 on allocation failure.
+int collision_resolve_all(Slice *ps, Slice *s, double ts, CollisionResolver resolve, CollisionStats *stats) {
+    CollisionSoA a;
+    Collision c;
+    stats->ncollide = 0;
+    stats->nfail = 0;
+    stats->nbatch = 0;
+    if(!collision_soa_load(&a, ps, s)) { return 0; }
+
+    for(uint64_t i = 0; i < ps->nbody; i++) {
+        if(s->bodies[i].flags & (PARTICLE_FLAG_DELETE | PARTICLE_FLAG_CREATE | PARTICLE_FLAG_GHOST)) { continue; }  // Ghosts come last, so j would be one too
+        uint64_t j = i + 1;
+        while(j < ps->nbody) {
+            unsigned m = collision_filter(&a, i, j, ts);
+            uint64_t next = j + COLLISION_LANES;
+            while(m) {                      // Padding lanes never survive, so k < nbody
+                uint64_t k = j + __builtin_ctz(m);
+                m &= m - 1;
+                if(!collision_detect(ps, s, i, k, ts, &c)) { continue; }
+                ++stats->ncollide;
+                if(!resolve(s, &c, ts)) { ++stats->nfail; }
+                collision_soa_update(&a, s, i);
+                collision_soa_update(&a, s, k);
+                next = k + 1;               // i has a new velocity, so the rest of this block must be filtered again
+                break;
+            }
+            j = next;
+        }
+    }
+
+    return 1;
+}
+
+// Partition candidate pairs into conflict-free batches (no body appears twice in a batch).
+// Each pair goes in the batch after the last one that touched either of its bodies, so every body still sees its
+// pairs in the original order.  Resolving the batches in sequence (and the pairs within a batch in any order, or
+// concurrently) gives the same result every time.
+// On return pairs are reordered by batch, and batch b is pairs[batch_off[b]] .. pairs[batch_off[b+1] - 1].
+int collision_schedule(CollisionPair *pairs, uint64_t npair, uint64_t nbody, uint64_t **batch_off, uint64_t *nbatch) {
+    *batch_off = NULL;
+    *nbatch = 0;
+    if(npair == 0) { return 1; }
+
+    uint32_t *level = calloc(nbody, sizeof(uint32_t));
+    uint32_t *batch = malloc(sizeof(uint32_t) * npair);
+    CollisionPair *sorted = malloc(sizeof(CollisionPair) * npair);
+    if(level == NULL || batch == NULL || sorted == NULL) {
+        printf("Memory allocation error.\n");
+        free(level);
+        free(batch);
+        free(sorted);
+        return 0;
+    }
+
+    for(uint64_t p = 0; p < npair; p++) {
+        uint32_t l = level[pairs[p].i] > level[pairs[p].j] ? level[pairs[p].i] : level[pairs[p].j];
+        batch[p] = l;
+        level[pairs[p].i] = level[pairs[p].j] = l + 1;
+        if(l + 1 > *nbatch) { *nbatch = l + 1; }
+    }
+
+    uint64_t *off = calloc(*nbatch + 1, sizeof(uint64_t));
+    if(off == NULL) {
+        printf("Memory allocation error.\n");
+        free(level);
+        free(batch);
+        free(sorted);
+        return 0;
+    }
+    for(uint64_t p = 0; p < npair; p++) { ++off[batch[p] + 1]; }
+    for(uint64_t b = 0; b < *nbatch; b++) { off[b + 1] += off[b]; }
+
+    // Stable counting sort by batch
+    uint64_t *cur = malloc(sizeof(uint64_t) * *nbatch);
+    if(cur == NULL) {
+        printf("Memory allocation error.\n");
+        free(level);
+        free(batch);
+        free(sorted);
+        free(off);
+        return 0;
+    }
+    memcpy(cur, off, sizeof(uint64_t) * *nbatch);
+    for(uint64_t p = 0; p < npair; p++) {
+        sorted[cur[batch[p]]++] = pairs[p];
+    }
+    memcpy(pairs, sorted, sizeof(CollisionPair) * npair);
+
+    free(cur);
+    free(level);
+    free(batch);
+    free(sorted);
+    *batch_off = off;
+    return 1;
+}
+
+typedef struct {                    // Shared state for resolving one batch
+    Slice               *ps;
+    Slice               *s;
+    double              ts;
+    CollisionPair       *pairs;
+    char                *hit;
+    uint64_t            npair;
+    int                 ntask;
+    CollisionResolver   resolve;
+} _ResolveState;
+
+static void _resolve_task(void *arg, int t) {
+    _ResolveState *st = (_ResolveState *)arg;
+    uint64_t lo = st->npair * t / st->ntask;
+    uint64_t hi = st->npair * (t + 1) / st->ntask;
+    Collision c;
+    for(uint64_t p = lo; p < hi; p++) {     // Velocities may have changed in an earlier batch, so check again
+        st->hit[p] = collision_detect(st->ps, st->s, st->pairs[p].i, st->pairs[p].j, st->ts, &c);
+        if(st->hit[p] && !st->resolve(st->s, &c, st->ts)) {
+            st->hit[p] = 2;                 // Collided, but the resolver couldn't handle it
+        }
+    }
+}
+
+// Resolve candidate pairs (sorted in (i, j) order) batch by batch, each batch concurrently on pool (which may be NULL).
+// Returns 0 on allocation failure.
+int collision_resolve_pairs(ThreadPool *pool, Slice *ps, Slice *s, double ts, CollisionPair *pairs, uint64_t npair,
+                            CollisionResolver resolve, CollisionStats *stats) {
+    uint64_t *batch_off;
+    stats->ncollide = 0;
+    stats->nfail = 0;
+    if(!collision_schedule(pairs, npair, s->nbody, &batch_off, &stats->nbatch)) { return 0; }
+    if(npair == 0) { return 1; }
+
+    _ResolveState st;
+    st.ps = ps;
+    st.s = s;
+    st.ts = ts;
+    st.resolve = resolve;
+    if((st.hit = malloc(sizeof(char) * npair)) == NULL) {
+        printf("Memory allocation error.\n");
+        free(batch_off);
+        return 0;
+    }
+    int maxtask = (pool == NULL) ? 1 : pool->nthread * 4;
+    for(uint64_t b = 0; b < stats->nbatch; b++) {
+        st.pairs = &pairs[batch_off[b]];
+        st.npair = batch_off[b + 1] - batch_off[b];
+        st.ntask = (st.npair < maxtask) ? (int)st.npair : maxtask;
+        char *hit = st.hit;
+        st.hit = &hit[batch_off[b]];
+        if(pool == NULL) {
+            _resolve_task(&st, 0);
+        } else {
+            threadpool_run(pool, _resolve_task, &st, st.ntask);
+        }
+        st.hit = hit;
+    }
+
+    for(uint64_t p = 0; p < npair; p++) {
+        stats->ncollide += (st.hit[p] != 0);
+        stats->nfail += (st.hit[p] == 2);
+    }
+    free(st.hit);
+    free(batch_off);
+    return 1;
+}
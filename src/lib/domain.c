@@ -0,0 +1,562 @@
+//
+//  domain.c
+//  SymUniverse - Spatial domain decomposition and collective universe I/O for MPI runs (see msym).
+//
+//  Every rank owns the bodies in one box of an orthogonal recursive bisection of space.  The tree is small
+//  (one node per rank and cut), so every rank keeps all of it and can find any body's owner on its own.
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "domain.h"
+#include "SymUniverseConfig.h"
+
+#define _BISECT_STEPS 48                                        // Each halves the interval a cut can be in
+#define _SLICE_HEADER_SIZE (2 * (sizeof(uint64_t) + sizeof(Vector)))     // time, nbody, bound_min, bound_max
+
+static double *_axis(Vector *v, int a) {
+    return &(&v->x)[a];
+}
+
+Domain *domain_create(MPI_Comm comm) {
+    Domain *d = calloc(1, sizeof(Domain));
+    if(d == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    d->comm = comm;
+    MPI_Comm_rank(comm, &d->rank);
+    MPI_Comm_size(comm, &d->size);
+    MPI_Type_contiguous(sizeof(Particle), MPI_BYTE, &d->particle);
+    MPI_Type_commit(&d->particle);
+    d->nodes = calloc(2 * d->size - 1, sizeof(DomainNode));
+    d->leaf = calloc(d->size, sizeof(int));
+    if(d->nodes == NULL || d->leaf == NULL) {
+        printf("Memory allocation error.\n");
+        domain_free(d);
+        return NULL;
+    }
+    return d;
+}
+
+void domain_free(Domain *d) {
+    if(d == NULL) { return; }
+    MPI_Type_free(&d->particle);
+    free(d->nodes);
+    free(d->leaf);
+    free(d);
+}
+
+int domain_owner(Domain *d, Vector *pos) {  // Rank whose box pos is in
+    int n = 0;
+    while(d->nodes[n].left >= 0) {
+        DomainNode *node = &d->nodes[n];
+        n = (*_axis(pos, node->axis) < node->at) ? node->left : node->right;
+    }
+    return d->nodes[n].lo;
+}
+
+// Recompute the cuts so every rank gets the same share of the total weight, then send bodies to their new owners.
+// weight is what one of this rank's bodies costs (e.g. its share of the last step's time).  Collective.
+// The cuts are found by bisection on the coordinate, one allreduce of partial weights per step for all the cuts of a
+// level at once, so no rank ever needs to see more than its own bodies.
+int domain_balance(Domain *d, Slice *s, double weight) {
+    // 1. The root box is the slice bounds, grown to take in any body that has wandered outside them
+    Vector bmin = s->bound_min, bmax = s->bound_max;
+    for(uint64_t i = 0; i < s->nbody; i++) {
+        for(int a = 0; a < 3; a++) {
+            double x = *_axis(&s->bodies[i].pos, a);
+            if(x < *_axis(&bmin, a)) { *_axis(&bmin, a) = x; }
+            if(x > *_axis(&bmax, a)) { *_axis(&bmax, a) = x; }
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &bmin, 3, MPI_DOUBLE, MPI_MIN, d->comm);
+    MPI_Allreduce(MPI_IN_PLACE, &bmax, 3, MPI_DOUBLE, MPI_MAX, d->comm);
+
+    int *node_of = calloc(s->nbody > 0 ? s->nbody : 1, sizeof(int));   // Node each body is in so far
+    int *split = malloc(sizeof(int) * d->size);                         // Cut number of each node in the level (-1 = leaf)
+    double *part = malloc(sizeof(double) * 2 * d->size);                // Weight below the candidate cut, then the total
+    double *cmin = malloc(sizeof(double) * d->size);
+    double *cmax = malloc(sizeof(double) * d->size);
+    int ok = (node_of != NULL && split != NULL && part != NULL && cmin != NULL && cmax != NULL);
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, d->comm);
+    if(!ok) {
+        printf("Memory allocation error.\n");
+        free(node_of);
+        free(split);
+        free(part);
+        free(cmin);
+        free(cmax);
+        return 0;
+    }
+
+    // 2. Build the tree a level at a time
+    DomainNode *root = &d->nodes[0];
+    root->lo = 0;
+    root->hi = d->size;
+    root->min = bmin;
+    root->max = bmax;
+    root->left = root->right = -1;
+    d->nnode = 1;
+    int first = 0, last = 1;
+    while(first < last) {
+        int ncut = 0;
+        for(int n = first; n < last; n++) {
+            DomainNode *node = &d->nodes[n];
+            if(node->hi - node->lo == 1) {
+                split[n - first] = -1;
+                d->leaf[node->lo] = n;
+                continue;
+            }
+            node->axis = 0;                     // Cut across the longest side
+            for(int a = 1; a < 3; a++) {
+                if(*_axis(&node->max, a) - *_axis(&node->min, a) > *_axis(&node->max, node->axis) - *_axis(&node->min, node->axis)) {
+                    node->axis = a;
+                }
+            }
+            cmin[ncut] = *_axis(&node->min, node->axis);
+            cmax[ncut] = *_axis(&node->max, node->axis);
+            split[n - first] = ncut++;
+        }
+        if(ncut == 0) { break; }
+
+        memset(&part[ncut], 0, sizeof(double) * ncut);
+        for(uint64_t i = 0; i < s->nbody; i++) {
+            if(node_of[i] < first) { continue; }     // Already settled on a rank
+            int k = split[node_of[i] - first];
+            if(k >= 0) { part[ncut + k] += weight; }
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &part[ncut], ncut, MPI_DOUBLE, MPI_SUM, d->comm);
+        for(int step = 0; step < _BISECT_STEPS; step++) {
+            memset(part, 0, sizeof(double) * ncut);
+            for(uint64_t i = 0; i < s->nbody; i++) {
+                int n = node_of[i];
+                if(n < first || split[n - first] < 0) { continue; }
+                int k = split[n - first];
+                if(*_axis(&s->bodies[i].pos, d->nodes[n].axis) < 0.5 * (cmin[k] + cmax[k])) { part[k] += weight; }
+            }
+            MPI_Allreduce(MPI_IN_PLACE, part, ncut, MPI_DOUBLE, MPI_SUM, d->comm);
+            for(int n = first; n < last; n++) {
+                int k = split[n - first];
+                if(k < 0) { continue; }
+                DomainNode *node = &d->nodes[n];
+                double want = part[ncut + k] * ((node->hi - node->lo) / 2) / (node->hi - node->lo);
+                if(part[k] < want) { cmin[k] = 0.5 * (cmin[k] + cmax[k]); }
+                else { cmax[k] = 0.5 * (cmin[k] + cmax[k]); }
+            }
+        }
+
+        for(int n = first; n < last; n++) {     // Make the children
+            int k = split[n - first];
+            if(k < 0) { continue; }
+            DomainNode *node = &d->nodes[n];
+            DomainNode *l = &d->nodes[d->nnode], *r = &d->nodes[d->nnode + 1];
+            node->at = 0.5 * (cmin[k] + cmax[k]);
+            node->left = d->nnode;
+            node->right = d->nnode + 1;
+            d->nnode += 2;
+            *l = *node;
+            *r = *node;
+            l->hi = r->lo = node->lo + (node->hi - node->lo) / 2;
+            *_axis(&l->max, node->axis) = node->at;
+            *_axis(&r->min, node->axis) = node->at;
+            l->left = l->right = r->left = r->right = -1;
+        }
+        for(uint64_t i = 0; i < s->nbody; i++) {
+            DomainNode *node = &d->nodes[node_of[i]];
+            if(node->left < 0) { continue; }
+            node_of[i] = (*_axis(&s->bodies[i].pos, node->axis) < node->at) ? node->left : node->right;
+        }
+        first = last;
+        last = d->nnode;
+    }
+    free(node_of);
+    free(split);
+    free(part);
+    free(cmin);
+    free(cmax);
+
+    return domain_migrate(d, s) >= 0;
+}
+
+// Exchange bodies: send[sdispl[r]] .. send[sdispl[r] + scount[r] - 1] go to rank r, and whatever arrives is appended
+// to s in rank order.  Collective, even for ranks that failed to get ready (ok = 0), so nobody is left waiting.
+// Returns the number of bodies received, or -1 if any rank failed.
+static int64_t _domain_exchange(Domain *d, Particle *send, int *scount, Slice *s, int ok) {
+    int *sdispl = malloc(sizeof(int) * d->size);
+    int *rcount = malloc(sizeof(int) * d->size);
+    int *rdispl = malloc(sizeof(int) * d->size);
+    Particle *recv = NULL;
+    int64_t nrecv = 0;
+    if(sdispl == NULL || rcount == NULL || rdispl == NULL) {
+        printf("Memory allocation error.\n");
+        ok = 0;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, d->comm);
+    if(ok) {
+        MPI_Alltoall(scount, 1, MPI_INT, rcount, 1, MPI_INT, d->comm);
+        for(int r = 0; r < d->size; r++) {
+            sdispl[r] = (r == 0) ? 0 : sdispl[r - 1] + scount[r - 1];
+            rdispl[r] = (int)nrecv;
+            nrecv += rcount[r];
+        }
+        if((recv = malloc(sizeof(Particle) * (nrecv > 0 ? nrecv : 1))) == NULL) {
+            printf("Memory allocation error.\n");
+            ok = 0;
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, d->comm);
+    }
+    if(ok) {
+        MPI_Alltoallv(send, scount, sdispl, d->particle, recv, rcount, rdispl, d->particle, d->comm);
+        ok = slice_append_particles(s, recv, nrecv);
+    }
+    free(sdispl);
+    free(rcount);
+    free(rdispl);
+    free(recv);
+    return ok ? nrecv : -1;
+}
+
+// Send every body that has left this rank's box to its owner.  Collective.
+// Returns how many bodies came or went here (0 means s still holds the same bodies, in the same order), or -1 on failure.
+int64_t domain_migrate(Domain *d, Slice *s) {
+    int *scount = calloc(d->size, sizeof(int));
+    uint64_t *off = calloc(d->size, sizeof(uint64_t));
+    int *dest = malloc(sizeof(int) * (s->nbody > 0 ? s->nbody : 1));
+    Particle *send = NULL;
+    uint64_t nsend = 0;
+    int ok = (scount != NULL && off != NULL && dest != NULL);
+    if(ok) {
+        for(uint64_t i = 0; i < s->nbody; i++) {
+            dest[i] = domain_owner(d, &s->bodies[i].pos);
+            if(dest[i] == d->rank) { continue; }
+            ++scount[dest[i]];
+            ++nsend;
+        }
+        ok = ((send = malloc(sizeof(Particle) * (nsend > 0 ? nsend : 1))) != NULL);
+    }
+    if(ok) {                                    // Pack the leavers by destination, and close up the gaps (keeping the order of those that stay)
+        for(int r = 1; r < d->size; r++) {
+            off[r] = off[r - 1] + scount[r - 1];
+        }
+        uint64_t keep = 0;
+        for(uint64_t i = 0; i < s->nbody; i++) {
+            if(dest[i] != d->rank) {
+                send[off[dest[i]]++] = s->bodies[i];
+            } else {
+                if(keep != i) { s->bodies[keep] = s->bodies[i]; }
+                ++keep;
+            }
+        }
+        s->nbody = keep;
+    } else {
+        printf("Memory allocation error.\n");
+    }
+    int64_t nrecv = _domain_exchange(d, send, scount, s, ok);
+    free(scount);
+    free(off);
+    free(dest);
+    free(send);
+    return (nrecv < 0) ? -1 : (int64_t)nsend + nrecv;
+}
+
+static int _near_box(DomainNode *node, Vector *pos, double halo) {
+    for(int a = 0; a < 3; a++) {
+        double x = *_axis(pos, a);
+        if(x < *_axis(&node->min, a) - halo || x > *_axis(&node->max, a) + halo) { return 0; }
+    }
+    return 1;
+}
+
+// Attach copies of other ranks' bodies (flagged PARTICLE_FLAG_GHOST) to the end of ps and s, so modules that look at
+// neighbours see them.  halo < 0 gets every body (e.g. for gravity), otherwise only those within halo of this rank's box.
+// Each ghost arrives as it is in its owner's ps and s.  Undo with domain_drop_ghosts.  Collective.  Returns 0 on failure.
+int domain_ghosts(Domain *d, Slice *ps, Slice *s, double halo) {
+    d->nlocal = s->nbody;
+    d->nps = ps->nbody;
+    d->nghost = 0;
+    int ok = 1;
+    if(ps->nbody < s->nbody) {                  // Bodies created earlier in the step get stand-ins, so ghosts line up in ps and s
+        ok = slice_append_particles(ps, &s->bodies[ps->nbody], s->nbody - ps->nbody);
+    }
+
+    int *scount = calloc(d->size, sizeof(int));
+    uint64_t *off = calloc(d->size, sizeof(uint64_t));
+    Particle *send = NULL;
+    uint64_t nsend = 0;
+    for(int pass = 0; pass < 2 && ok; pass++) { // Count, then fill in
+        if(scount == NULL || off == NULL) {
+            ok = 0;
+            break;
+        }
+        for(uint64_t i = 0; i < d->nps; i++) {  // Each goes as a (ps, s) pair
+            if(s->bodies[i].flags & (PARTICLE_FLAG_DELETE | PARTICLE_FLAG_CREATE)) { continue; }
+            for(int r = 0; r < d->size; r++) {
+                if(r == d->rank) { continue; }
+                DomainNode *box = &d->nodes[d->leaf[r]];
+                if(halo >= 0 && !_near_box(box, &s->bodies[i].pos, halo) && !_near_box(box, &ps->bodies[i].pos, halo)) { continue; }
+                if(pass == 0) {
+                    scount[r] += 2;
+                    nsend += 2;
+                } else {
+                    send[off[r]++] = ps->bodies[i];
+                    send[off[r]++] = s->bodies[i];
+                }
+            }
+        }
+        if(pass == 0) {
+            if((send = malloc(sizeof(Particle) * (nsend > 0 ? nsend : 1))) == NULL) {
+                ok = 0;
+                break;
+            }
+            for(int r = 1; r < d->size; r++) {
+                off[r] = off[r - 1] + scount[r - 1];
+            }
+        }
+    }
+    if(!ok) { printf("Memory allocation error.\n"); }
+
+    // The pairs land on the end of s, then get split up between ps and s
+    uint64_t base = s->nbody;
+    int64_t nrecv = _domain_exchange(d, send, scount, s, ok);
+    free(send);
+    free(scount);
+    free(off);
+    if(nrecv < 0) { return 0; }
+    uint64_t nghost = nrecv / 2;
+    Particle *pair = &s->bodies[base];
+    for(uint64_t g = 0; g < nghost; g++) {
+        pair[2 * g].flags |= PARTICLE_FLAG_GHOST;
+        if(!slice_append_particle(ps, &pair[2 * g])) { return 0; }
+    }
+    for(uint64_t g = 0; g < nghost; g++) {     // Compact the s halves in place (g <= 2g + 1, so nothing is overwritten early)
+        pair[g] = pair[2 * g + 1];
+        pair[g].flags |= PARTICLE_FLAG_GHOST;
+    }
+    s->nbody = base + nghost;
+    d->nghost = nghost;
+    return 1;
+}
+
+void domain_drop_ghosts(Domain *d, Slice *ps, Slice *s) {   // Take off what domain_ghosts attached, keeping anything created since
+    ps->nbody = d->nps;
+    uint64_t tail = s->nbody - (d->nlocal + d->nghost);
+    memmove(&s->bodies[d->nlocal], &s->bodies[d->nlocal + d->nghost], sizeof(Particle) * tail);
+    s->nbody = d->nlocal + tail;
+    d->nghost = 0;
+}
+
+// Read bodies [lo, hi) of the version 3 slice whose columns start at off into s.  Each rank reads just its share of each
+// column (and the one value of constant ones).  Collective.  Returns 0 on failure.
+static int _read_columns(Domain *d, MPI_File fh, long off, uint64_t nbody, uint32_t constant, uint64_t lo, uint64_t hi, Slice *s) {
+    char *buf = malloc(sizeof(Vector) * (hi - lo + 1));
+    int ok = (buf != NULL);
+    if(buf == NULL) { printf("Memory allocation error.\n"); }
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, d->comm);
+    for(int k = 0; ok && nbody > 0 && k < PARTICLE_NFIELD; k++) {
+        const ParticleField *pf = particle_field(k);
+        long col = off + universe_columns_size(nbody, constant, pf->field - 1);
+        int one = (constant & pf->field) != 0;
+        uint64_t n = one ? 1 : hi - lo;
+        ok = (MPI_File_read_at_all(fh, col + (one ? 0 : lo * pf->size), buf, (int)(n * pf->size), MPI_BYTE,
+                                   MPI_STATUS_IGNORE) == MPI_SUCCESS);
+        for(uint64_t i = 0; ok && i < hi - lo; i++) { memcpy((char *)&s->bodies[i] + pf->offset, buf + (one ? 0 : i * pf->size), pf->size); }
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, d->comm);
+    }
+    free(buf);
+    return ok;
+}
+
+// Read the last slice of a universe, each rank getting an even share of the bodies.  Collective.  Returns 0 on failure.
+int domain_read_last_slice(Domain *d, const char *path, Slice *s) {
+    long off = 0;
+    uint32_t version = UNIVERSE_VERSION;
+    int ok = 1;
+    if(d->rank == 0) {
+        Universe *u = universe_open(path);
+        if(u == NULL || u->nslice == 0) {
+            if(u != NULL) { printf("%s has no slices.\n", path); }
+            ok = 0;
+        } else {
+            off = u->slice_idx[u->nslice - 1];
+            version = u->version;
+        }
+        if(u != NULL) {
+            universe_close(u);
+            universe_free(u);
+        }
+    }
+    MPI_Bcast(&ok, 1, MPI_INT, 0, d->comm);
+    if(!ok) { return 0; }
+    MPI_Bcast(&off, 1, MPI_LONG, 0, d->comm);
+    MPI_Bcast(&version, 1, MPI_UINT32_T, 0, d->comm);
+
+    MPI_File fh;
+    if(MPI_File_open(d->comm, (char *)path, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        printf("Could not open universe file, %s, for parallel reading.\n", path);
+        return 0;
+    }
+    Slice h;
+    UniverseColumns c = { 0, 0 };
+    ok = (MPI_File_read_at_all(fh, off, &h.time, _SLICE_HEADER_SIZE, MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+    if(ok && version >= UNIVERSE_VERSION_COLUMNAR) {
+        ok = (MPI_File_read_at_all(fh, off + _SLICE_HEADER_SIZE, &c, sizeof(UniverseColumns), MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+    }
+    uint64_t lo = ok ? h.nbody * d->rank / d->size : 0;
+    uint64_t hi = ok ? h.nbody * (d->rank + 1) / d->size : 0;
+    s->nbody = 0;
+    s->ndelete = 0;
+    if(ok && !slice_reserve(s, hi - lo, 0)) { ok = 0; }
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, d->comm);
+    if(ok && version >= UNIVERSE_VERSION_COLUMNAR) {
+        ok = _read_columns(d, fh, off + _SLICE_HEADER_SIZE + sizeof(UniverseColumns), h.nbody, c.constant, lo, hi, s);
+    } else if(ok) {
+        ok = (MPI_File_read_at_all(fh, off + _SLICE_HEADER_SIZE + lo * sizeof(Particle), s->bodies, (int)(hi - lo),
+                                   d->particle, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+        MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, d->comm);
+    }
+    MPI_File_close(&fh);
+    if(!ok) {
+        printf("Failed to read the last slice of %s.\n", path);
+        return 0;
+    }
+    s->time = h.time;
+    s->nbody = hi - lo;
+    s->bound_min = h.bound_min;
+    s->bound_max = h.bound_max;
+    return 1;
+}
+
+// Open (or create) a universe for every rank to append slices to.  Collective.
+DomainFile *domain_file_open(Domain *d, const char *path) {
+    DomainFile *f = calloc(1, sizeof(DomainFile));
+    int ok = (f != NULL);
+    if(f == NULL) { printf("Memory allocation error.\n"); }
+    if(ok && d->rank == 0) {                        // Rank 0 keeps the index, like universe_append_slice would
+        Universe *u = NULL;
+        if(universe_is_stream(path)) {
+            printf("Ranks can't all write to %s, it's a stream.\n", path);
+        } else {
+            u = (access(path, W_OK) == 0) ? universe_open(path) : universe_create(path);
+        }
+        if(u != NULL && u->version >= UNIVERSE_VERSION_COLUMNAR) {
+            printf("Ranks can't all append to %s, it's stored a column at a time.\n", path);
+            universe_close(u);
+            universe_free(u);
+            u = NULL;
+        }
+        if(u != NULL && u->is_stream) {
+            printf("Ranks can't all append to %s, it's a stream (no index).\n", path);
+            universe_close(u);
+            universe_free(u);
+            u = NULL;
+        }
+        if(u == NULL) {
+            ok = 0;
+        } else {
+            f->nslice = u->nslice;
+            f->version = u->version;
+            f->block = u->block;
+            f->slice_idx = malloc(sizeof(long) * (u->nslice > 0 ? u->nslice : 1));
+            if(f->slice_idx == NULL) {
+                printf("Memory allocation error.\n");
+                ok = 0;
+            } else {
+                memcpy(f->slice_idx, u->slice_idx, sizeof(long) * u->nslice);
+                fseek(u->fstream, 0, SEEK_END);
+                f->end = ftell(u->fstream) - ((f->version < 2) ? sizeof(long) * u->nslice : 0);
+            }
+            universe_close(u);
+            universe_free(u);
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, d->comm);
+    if(ok) {
+        MPI_Bcast(&f->nslice, 1, MPI_UINT64_T, 0, d->comm);
+        MPI_Bcast(&f->version, 1, MPI_UINT32_T, 0, d->comm);
+        MPI_Bcast(&f->end, 1, MPI_LONG, 0, d->comm);
+        f->d = d;
+        if(MPI_File_open(d->comm, (char *)path, MPI_MODE_WRONLY, MPI_INFO_NULL, &f->fh) != MPI_SUCCESS) {
+            printf("Could not open universe file, %s, for parallel writing.\n", path);
+            ok = 0;
+        }
+    }
+    if(!ok) {
+        if(f != NULL) { free(f->slice_idx); }
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+// Append a slice made of every rank's s, in rank order.  Collective.  Returns 0 on failure.
+int domain_file_append(DomainFile *f, Slice *s) {
+    Domain *d = f->d;
+    uint64_t n = s->nbody, before = 0, total = 0;
+    MPI_Exscan(&n, &before, 1, MPI_UINT64_T, MPI_SUM, d->comm);
+    if(d->rank == 0) { before = 0; }
+    MPI_Allreduce(&n, &total, 1, MPI_UINT64_T, MPI_SUM, d->comm);
+
+    long off = f->end, block = 0;
+    if(f->version >= 2 && f->nslice % UNIVERSE_BLOCK_SLICES == 0) {    // A new index block, right before the slice (see universe.h)
+        block = off;
+        off += sizeof(UniverseIndexBlock);
+    }
+    int ok = (MPI_File_write_at_all(f->fh, off + _SLICE_HEADER_SIZE + before * sizeof(Particle), s->bodies, (int)n,
+                                    d->particle, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+    f->end = off + _SLICE_HEADER_SIZE + total * sizeof(Particle);
+    ++f->nslice;
+    if(d->rank == 0 && f->version >= 2) {           // Slice header, its index entry (in a new block if need be) and file header
+        Slice h = *s;
+        h.nbody = total;
+        UniverseHeader header;
+        memset(&header, 0, sizeof(UniverseHeader));
+        strncpy(header.string, UNIVERSE_STRING, sizeof(header.string));
+        header.version = f->version;
+        header.nslice = f->nslice;
+        if(block > 0) {
+            static const UniverseIndexBlock empty;
+            long link = (f->block > 0) ? f->block : (long)UNIVERSE_FIRST_BLOCK_POS;
+            ok &= (MPI_File_write_at(f->fh, block, (void *)&empty, sizeof(UniverseIndexBlock), MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+            ok &= (MPI_File_write_at(f->fh, link, &block, 1, MPI_LONG, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+            f->block = block;
+        }
+        long entry = f->block + sizeof(long) * (1 + (f->nslice - 1) % UNIVERSE_BLOCK_SLICES);
+        ok &= (MPI_File_write_at(f->fh, off, &h.time, _SLICE_HEADER_SIZE, MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+        ok &= (MPI_File_write_at(f->fh, entry, &off, 1, MPI_LONG, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+        ok &= (MPI_File_write_at(f->fh, 0, &header, sizeof(UniverseHeader), MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+    } else if(d->rank == 0) {                       // Version 1: slice header, the whole index and file header
+        Slice h = *s;
+        h.nbody = total;
+        long *idx = realloc(f->slice_idx, sizeof(long) * f->nslice);
+        if(idx == NULL) {
+            printf("Memory allocation error.\n");
+            ok = 0;
+        } else {
+            f->slice_idx = idx;
+            f->slice_idx[f->nslice - 1] = off;
+            UniverseHeader header;
+            memset(&header, 0, sizeof(UniverseHeader));
+            strncpy(header.string, UNIVERSE_STRING, sizeof(header.string));
+            header.version = f->version;
+            header.nslice = f->nslice;
+            ok &= (MPI_File_write_at(f->fh, off, &h.time, _SLICE_HEADER_SIZE, MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+            ok &= (MPI_File_write_at(f->fh, f->end, f->slice_idx, (int)f->nslice, MPI_LONG, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+            ok &= (MPI_File_write_at(f->fh, 0, &header, sizeof(UniverseHeader), MPI_BYTE, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, d->comm);
+    if(!ok) { printf("Failed to write slice %llu.\n", (unsigned long long)s->time); }
+    return ok;
+}
+
+int domain_file_close(DomainFile *f) {
+    if(f == NULL) { return 1; }
+    int ok = (MPI_File_close(&f->fh) == MPI_SUCCESS);
+    free(f->slice_idx);
+    free(f);
+    return ok;
+}
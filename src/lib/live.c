@@ -0,0 +1,186 @@
+//
+//  live.c
+//  SymUniverse - The newest slice of a running sym, published in POSIX shared memory (see live.h).
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "live.h"
+
+#define _MIN_CAPACITY 64
+
+static char *_live_name(const char *name) {     // shm_open wants a leading /
+    char *n = malloc(strlen(name) + 2);
+    if(n == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    sprintf(n, "%s%s", (name[0] == '/') ? "" : "/", name);
+    return n;
+}
+
+static Particle *_live_bodies(LiveHeader *h, int slot) {
+    return (Particle *)((char *)h + sizeof(LiveHeader) + sizeof(Particle) * h->capacity * slot);
+}
+
+static uint64_t _stride(double fraction) {
+    return (fraction < 1) ? (uint64_t)(1 / fraction + 0.5) : 1;
+}
+
+LivePublisher *live_publisher_create(const char *name, double fraction) {  // Nothing is mapped until the first slice
+    LivePublisher *p = calloc(1, sizeof(LivePublisher));
+    if(p == NULL || (p->name = _live_name(name)) == NULL) {
+        printf("Memory allocation error.\n");
+        free(p);
+        return NULL;
+    }
+    p->fraction = (fraction > 0 && fraction < 1) ? fraction : 1;
+    return p;
+}
+
+static int _live_map(LivePublisher *p, Slice *s) {     // Room for twice s's sample, so it can grow a while before being thinned out
+    uint64_t capacity = (s->nbody / _stride(p->fraction) + 1) * 2;
+    if(capacity < _MIN_CAPACITY) { capacity = _MIN_CAPACITY; }
+    p->size = sizeof(LiveHeader) + sizeof(Particle) * capacity * LIVE_NSLOT;
+    shm_unlink(p->name);                    // A fresh segment, never a shrunk one: readers of an old one keep their mapping
+    int fd = shm_open(p->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0) {
+        printf("Could not create shared memory %s, because: %s\n", p->name, strerror(errno));
+        return 0;
+    }
+    if(ftruncate(fd, p->size) != 0) {
+        printf("Could not size shared memory %s, because: %s\n", p->name, strerror(errno));
+        close(fd);
+        shm_unlink(p->name);
+        return 0;
+    }
+    void *m = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED) {
+        printf("Could not map shared memory %s, because: %s\n", p->name, strerror(errno));
+        shm_unlink(p->name);
+        return 0;
+    }
+    p->h = m;                               // Fresh from ftruncate, so already zero
+    p->h->version = LIVE_VERSION;
+    p->h->particle_size = sizeof(Particle);
+    p->h->capacity = capacity;
+    __sync_synchronize();
+    memcpy(p->h->magic, LIVE_MAGIC, sizeof(p->h->magic));  // Last, readers ignore it until then
+    return 1;
+}
+
+// Copy s (or its sample) into the older slot.  After the first call (which creates the shared memory) this is just a
+// copy, no system calls.  Returns 0 on failure.
+int live_publish(LivePublisher *p, Slice *s) {
+    if(p->h == NULL && !_live_map(p, s)) {
+        return 0;
+    }
+    LiveHeader *h = p->h;
+    uint64_t stride = _stride(p->fraction);
+    if(s->nbody / stride + 1 > h->capacity) { stride = s->nbody / (h->capacity - 1) + 1; }     // Thin it out to fit
+    int k = (h->published > 0) ? 1 - (int)h->latest : 0;
+    LiveSlot *slot = &h->slots[k];
+    ++slot->seq;                            // Odd: readers of this slot retry
+    __sync_synchronize();
+    slot->time = s->time;
+    slot->ntotal = s->nbody - s->ndelete;
+    slot->stride = stride;
+    slot->bound_min = s->bound_min;
+    slot->bound_max = s->bound_max;
+    slot->nbody = slice_sample(s, stride, _live_bodies(h, k));
+    __sync_synchronize();
+    ++slot->seq;
+    __sync_synchronize();
+    h->latest = k;
+    ++h->published;
+    return 1;
+}
+
+void live_publisher_free(LivePublisher *p) {   // Readers that have it open can still see the last slice
+    if(p == NULL) { return; }
+    if(p->h != NULL) {
+        p->h->finished = 1;
+        munmap(p->h, p->size);
+        shm_unlink(p->name);
+    }
+    free(p->name);
+    free(p);
+}
+
+// NULL if nothing is being published there (yet).  quiet leaves out saying why, for callers that keep retrying.
+LiveReader *live_reader_open(const char *name, int quiet) {
+    char *n = _live_name(name);
+    if(n == NULL) { return NULL; }
+    int fd = shm_open(n, O_RDONLY, 0);
+    free(n);
+    if(fd < 0) { return NULL; }
+    struct stat st;
+    LiveReader *r = calloc(1, sizeof(LiveReader));
+    if(r == NULL || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(LiveHeader)) {
+        close(fd);
+        free(r);
+        return NULL;
+    }
+    r->size = st.st_size;
+    void *m = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED) {
+        free(r);
+        return NULL;
+    }
+    r->h = m;
+    __sync_synchronize();
+    if(memcmp(r->h->magic, LIVE_MAGIC, sizeof(r->h->magic)) != 0 || r->h->version != LIVE_VERSION ||
+       r->h->particle_size != sizeof(Particle) ||
+       r->size < sizeof(LiveHeader) + sizeof(Particle) * r->h->capacity * LIVE_NSLOT) {
+        if(!quiet) { printf("Shared memory %s isn't a live slice this version of SymUniverse understands (yet).\n", name); }
+        live_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Copy the newest slice into s (growing it as needed), and its slot header into info (if not NULL).  Returns 0 if
+// nothing has been published yet, or on allocation failure.
+int live_read(LiveReader *r, Slice *s, LiveSlot *info) {
+    LiveHeader *h = r->h;
+    while(h->published > 0) {
+        int k = h->latest;
+        LiveSlot *slot = &h->slots[k];
+        uint64_t seq = slot->seq;
+        __sync_synchronize();
+        if(seq & 1) { continue; }           // Being written
+        uint64_t n = slot->nbody;
+        if(n > h->capacity) { continue; }   // Torn, the seq check would catch it too
+        if(s->capacity < n && !slice_reserve(s, n, 0)) {
+            return 0;
+        }
+        memcpy(s->bodies, _live_bodies(h, k), sizeof(Particle) * n);
+        s->nbody = n;
+        s->time = slot->time;
+        s->bound_min = slot->bound_min;
+        s->bound_max = slot->bound_max;
+        if(info != NULL) { *info = *slot; }
+        __sync_synchronize();
+        if(slot->seq == seq) { return 1; }
+    }
+    return 0;
+}
+
+int live_finished(LiveReader *r) {
+    return r->h->finished;
+}
+
+void live_reader_close(LiveReader *r) {
+    if(r == NULL) { return; }
+    munmap(r->h, r->size);
+    free(r);
+}
@@ -0,0 +1,1412 @@
+//
+//  sim.c
+//  SymUniverse - The simulation driver as a library (see sim.h)
+//
+//  Each step copies the current slice, runs it through the pipeline of modules and appends it to the universe.
+//  All of the physics happens in the modules; this just runs them as fast as it can: fusing per-body modules,
+//  running independent ones concurrently, and recycling slices and scratch memory between steps.
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include "sim.h"
+#include "SymUniverseConfig.h"
+
+#define FUSE_BLOCK_BYTES (32 * 1024)    // Fused modules run over blocks of bodies this big (about an L1d), so later modules hit cache
+
+static int _mod_file(const char *file) {    // Is it named like a module?
+    size_t len = strlen(file);
+    return len > 4 && strcmp(&file[len - 4], ".mod") == 0;
+}
+
+static char *_mod_path(SimModules *mods, const char *file) {
+    char *full_path = calloc(strlen(mods->path) + strlen(file) + 2, sizeof(char));
+    if(full_path == NULL) {
+        printf("Memory allocation failure.\n");
+        return NULL;
+    }
+    sprintf(full_path, "%s/%s", mods->path, file);
+    return full_path;
+}
+
+static int _mod_stat(SimModules *mods, const char *file, long *mtime, long *size) {    // Returns 0 if it isn't a regular file
+    char *full_path = _mod_path(mods, file);
+    if(full_path == NULL) { return 0; }
+    struct stat buf;
+    int ok = (stat(full_path, &buf) == 0 && S_ISREG(buf.st_mode));
+    free(full_path);
+    if(ok) {
+        *mtime = (long)buf.st_mtime;
+        *size = (long)buf.st_size;
+    }
+    return ok;
+}
+
+static int _cmp_files(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static char **_list_modules(SimModules *mods, int *n) {   // Every .mod file in the directory, sorted.  NULL on failure.
+    char **files = malloc(sizeof(char *));
+    *n = 0;
+    if(files == NULL) {
+        printf("Memory allocation failure.\n");
+        return NULL;
+    }
+    DIR *d = opendir(mods->path);
+    struct dirent *dir;
+    while(d != NULL && (dir = readdir(d)) != NULL) {
+        long mtime, size;
+        if(!_mod_file(dir->d_name) || !_mod_stat(mods, dir->d_name, &mtime, &size)) { continue; }
+        char **more = realloc(files, sizeof(char *) * (*n + 1));
+        if(more == NULL || (more[*n] = strdup(dir->d_name)) == NULL) {
+            printf("Memory allocation failure.\n");
+            if(more != NULL) { files = more; }
+            for(int i = 0; i < *n; i++) { free(files[i]); }
+            free(files);
+            closedir(d);
+            return NULL;
+        }
+        files = more;
+        ++*n;
+    }
+    if(d != NULL) { closedir(d); }
+    qsort(files, *n, sizeof(char *), _cmp_files);
+    return files;
+}
+
+static void _free_list(char **files, int n) {
+    for(int i = 0; i < n; i++) {
+        free(files[i]);
+    }
+    free(files);
+}
+
+static SimModuleEntry *_index_entry(SimModules *mods, const char *name, const char *file) {   // Match on either.  NULL if stale.
+    for(int i = 0; i < mods->nindex; i++) {
+        SimModuleEntry *e = &mods->index[i];
+        if((name != NULL && strcmp(e->name, name) != 0) || (file != NULL && strcmp(e->file, file) != 0)) { continue; }
+        long mtime, size;
+        if(!_mod_stat(mods, e->file, &mtime, &size) || mtime != e->mtime || size != e->size) { return NULL; }
+        return e;
+    }
+    return NULL;
+}
+
+static void _read_index(SimModules *mods) {     // Missing or unreadable just means every module gets opened to find out
+    char *path = _mod_path(mods, SIM_MODULE_INDEX);
+    FILE *f = (path != NULL) ? fopen(path, "r") : NULL;
+    free(path);
+    if(f == NULL) { return; }
+    char line[4096], name[256], file[1024];
+    int version = 0, abi;
+    long mtime, size;
+    SimModuleEntry *e = NULL;
+    while(fgets(line, sizeof(line), f) != NULL) {
+        if(line[0] == '#') { continue; }
+        if(sscanf(line, "version %d", &version) == 1) { continue; }
+        if(version != 1) { break; }         // Don't know the format, ignore it
+        if(sscanf(line, "module %255s %d %1023s %ld %ld", name, &abi, file, &mtime, &size) == 5) {
+            SimModuleEntry *index = realloc(mods->index, sizeof(SimModuleEntry) * (mods->nindex + 1));
+            if(index == NULL) { break; }
+            mods->index = index;
+            e = &mods->index[mods->nindex];
+            e->name = strdup(name);
+            e->file = strdup(file);
+            e->help = strdup("");
+            e->abi = abi;
+            e->mtime = mtime;
+            e->size = size;
+            if(e->name == NULL || e->file == NULL || e->help == NULL) {
+                free(e->name);
+                free(e->file);
+                free(e->help);
+                break;
+            }
+            ++mods->nindex;
+        } else if(strncmp(line, "help ", 5) == 0 && e != NULL) {    // One per line of help text
+            char *help = realloc(e->help, strlen(e->help) + strlen(line) - 4);
+            if(help == NULL) { break; }
+            e->help = strcat(help, &line[5]);
+        }
+    }
+    fclose(f);
+}
+
+// Set up the modules in path.  The index is read if there is one, but no module is opened until it's asked for.
+SimModules *sim_open_modules(const char *path) {
+    SimModules *mods = calloc(1, sizeof(SimModules));
+    if(mods == NULL || (mods->path = strdup(path)) == NULL) {
+        printf("Memory allocation failure.\n");
+        free(mods);
+        return NULL;
+    }
+    _read_index(mods);
+#ifdef SYM_BUILTIN
+    mods->modules = malloc(sizeof(Module) * sim_nbuiltin);
+    mods->files = calloc(sim_nbuiltin, sizeof(char *));
+    if(mods->modules == NULL || mods->files == NULL) {
+        printf("Memory allocation failure.\n");
+        sim_free_modules(mods);
+        return NULL;
+    }
+    sim_builtin_modules(mods->modules);
+    mods->n = sim_nbuiltin;
+#endif
+    return mods;
+}
+
+void sim_free_modules(SimModules *mods) {
+    if(mods == NULL) { return; }
+    for(int i = 0; i < mods->n; i++) {
+        if(mods->modules[i].handle != NULL) { dlclose(mods->modules[i].handle); }
+        free(mods->files[i]);
+    }
+    for(int i = 0; i < mods->nindex; i++) {
+        free(mods->index[i].name);
+        free(mods->index[i].file);
+        free(mods->index[i].help);
+    }
+    free(mods->index);
+    free(mods->modules);
+    free(mods->files);
+    free(mods->path);
+    free(mods);
+}
+
+static Module *_load_module(SimModules *mods, const char *file) {   // Open a module file (once).  NULL if it can't be used.
+    for(int i = 0; i < mods->n; i++) {
+        if(mods->files[i] != NULL && strcmp(mods->files[i], file) == 0) { return &mods->modules[i]; }
+    }
+    Module *modules = realloc(mods->modules, sizeof(Module) * (mods->n + 1));
+    if(modules != NULL) { mods->modules = modules; }
+    char **files = realloc(mods->files, sizeof(char *) * (mods->n + 1));
+    if(files != NULL) { mods->files = files; }
+    char *full_path = _mod_path(mods, file);
+    if(modules == NULL || files == NULL || full_path == NULL || (files[mods->n] = strdup(file)) == NULL) {
+        printf("Memory allocation failure.\n");
+        free(full_path);
+        return NULL;
+    }
+    Module *m = &mods->modules[mods->n];
+
+    m->handle = dlopen(full_path, RTLD_LAZY);
+    if(m->handle == NULL) {
+        printf("Could not open module at %s.\n%s\n", full_path, dlerror());
+        free(full_path);
+        free(files[mods->n]);
+        return NULL;
+    }
+    char **name = dlsym(m->handle, "name");
+    const int *abi = dlsym(m->handle, "abi_version");
+    if(name == NULL || abi == NULL || *abi != MODULE_ABI_VERSION) {     // Its idea of the structs could be out of date
+        printf("Module at %s was built for module ABI %d, but this is version %d.  Rebuild it.\n",
+               full_path, (abi != NULL) ? *abi : 0, MODULE_ABI_VERSION);
+        dlclose(m->handle);
+        free(full_path);
+        free(files[mods->n]);
+        return NULL;
+    }
+    free(full_path);
+    m->cfg = NULL;
+    m->name = *name;
+    m->init = dlsym(m->handle, "init");
+    m->deinit = dlsym(m->handle, "deinit");
+    m->help = dlsym(m->handle, "help");
+    m->exec = dlsym(m->handle, "exec");
+    m->fields = dlsym(m->handle, "fields");     // Optional
+    m->exec_range = dlsym(m->handle, "exec_range");     // Optional
+    m->tunables = dlsym(m->handle, "tunables");     // Optional
+    m->analyze = dlsym(m->handle, "analyze");       // Only analysis plug-ins, which needn't have exec
+    m->mask = 0;
+    return &mods->modules[mods->n++];
+}
+
+// The module called name, opening it if need be.  Where to look comes from the index, or else <name>.mod, and only as
+// a last resort every module in the directory.  NULL if there's no such module, or it's too old.
+Module *sim_find_module(SimModules *mods, const char *name) {
+    for(int i = 0; i < mods->n; i++) {
+        if(strcmp(name, mods->modules[i].name) == 0) {
+            return &mods->modules[i];
+        }
+    }
+    SimModuleEntry *e = _index_entry(mods, name, NULL);
+    if(e != NULL) {
+        if(e->abi != MODULE_ABI_VERSION) {
+            printf("Module %s (%s) was built for module ABI %d, but this is version %d.  Rebuild it.\n",
+                   name, e->file, e->abi, MODULE_ABI_VERSION);
+            return NULL;
+        }
+        return _load_module(mods, e->file);
+    }
+    char *file = malloc(strlen(name) + 5);
+    long mtime, size;
+    Module *m = NULL;
+    if(file != NULL) {
+        sprintf(file, "%s.mod", name);
+        if(_mod_stat(mods, file, &mtime, &size) && (m = _load_module(mods, file)) != NULL && strcmp(m->name, name) != 0) {
+            m = NULL;
+        }
+        free(file);
+    }
+    if(m != NULL) { return m; }
+    int n;
+    char **files = _list_modules(mods, &n);
+    for(int i = 0; files != NULL && i < n && m == NULL; i++) {
+        if((m = _load_module(mods, files[i])) != NULL && strcmp(m->name, name) != 0) { m = NULL; }
+    }
+    if(files != NULL) { _free_list(files, n); }
+    return m;
+}
+
+static int _builtin(SimModules *mods, const char *name) {  // Is there a built in module by that name?
+    for(int i = 0; i < mods->n; i++) {
+        if(mods->files[i] == NULL && strcmp(mods->modules[i].name, name) == 0) { return 1; }
+    }
+    return 0;
+}
+
+int sim_help_modules(SimModules *mods) {    // Print every module's help, from the index where it's up to date
+    int n, nbuiltin = mods->n;
+    for(int i = 0; i < nbuiltin; i++) {
+        if(mods->files[i] != NULL) { continue; }
+        printf("Module name: %s (built in)\n", mods->modules[i].name);
+        mods->modules[i].help();
+        printf("\n");
+    }
+    char **files = _list_modules(mods, &n);
+    if(files == NULL) { return 0; }
+    for(int i = 0; i < n; i++) {
+        SimModuleEntry *e = _index_entry(mods, NULL, files[i]);
+        if(e != NULL) {
+            if(!_builtin(mods, e->name)) { printf("Module name: %s\n%s\n", e->name, e->help); }
+            continue;
+        }
+        Module *m = _load_module(mods, files[i]);
+        if(m == NULL || _builtin(mods, m->name)) { continue; }
+        printf("Module name: %s\n", m->name);
+        m->help();
+        printf("\n");
+    }
+    _free_list(files, n);
+    return 1;
+}
+
+static char *_capture_help(Module *m) {     // Whatever m->help() prints
+    FILE *tmp = tmpfile();
+    if(tmp == NULL) { return NULL; }
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(tmp), STDOUT_FILENO);
+    m->help();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    long len = ftell(tmp);
+    char *help = malloc(len + 1);
+    if(help != NULL) {
+        rewind(tmp);
+        help[fread(help, 1, len, tmp)] = '\0';
+    }
+    fclose(tmp);
+    return help;
+}
+
+// Open every module in path once and write down its name, ABI version and help in SIM_MODULE_INDEX, so later runs
+// only have to open the modules they use.  Returns the number indexed, or -1 on failure.
+int sim_index_modules(const char *path) {
+    SimModules *mods = sim_open_modules(path);
+    if(mods == NULL) { return -1; }
+    int n, count = 0;
+    char **files = _list_modules(mods, &n);
+    char *index_path = _mod_path(mods, SIM_MODULE_INDEX);
+    FILE *f = (files != NULL && index_path != NULL) ? fopen(index_path, "w") : NULL;
+    if(f == NULL) {
+        if(index_path != NULL) { printf("Could not write module index, %s, because: %s\n", index_path, strerror(errno)); }
+        free(index_path);
+        if(files != NULL) { _free_list(files, n); }
+        sim_free_modules(mods);
+        return -1;
+    }
+    fprintf(f, "# Module index, see sym --index-modules.  module <name> <abi version> <file> <mtime> <size>\nversion 1\n");
+    for(int i = 0; i < n; i++) {
+        long mtime, size;
+        void *handle;
+        char *full_path = _mod_path(mods, files[i]);
+        if(full_path == NULL || !_mod_stat(mods, files[i], &mtime, &size) || (handle = dlopen(full_path, RTLD_LAZY)) == NULL) {
+            printf("Skipping %s, it can't be opened.\n", files[i]);
+            free(full_path);
+            continue;
+        }
+        free(full_path);
+        char **name = dlsym(handle, "name");
+        const int *abi = dlsym(handle, "abi_version");
+        int version = (abi != NULL) ? *abi : 0;
+        if(name == NULL) {
+            printf("Skipping %s, it isn't a module.\n", files[i]);
+            dlclose(handle);
+            continue;
+        }
+        fprintf(f, "module %s %d %s %ld %ld\n", *name, version, files[i], mtime, size);
+        dlclose(handle);
+        ++count;
+        if(version != MODULE_ABI_VERSION) {     // Indexed anyway, so it's turned away without being opened
+            printf("%s was built for module ABI %d, but this is version %d.  Rebuild it.\n", files[i], version, MODULE_ABI_VERSION);
+            continue;
+        }
+        Module *m = _load_module(mods, files[i]);
+        char *help = (m != NULL) ? _capture_help(m) : NULL;
+        for(char *line = help; line != NULL && *line != '\0'; ) {
+            char *end = strchr(line, '\n');
+            int len = (end != NULL) ? (int)(end - line) : (int)strlen(line);
+            fprintf(f, "help %.*s\n", len, line);
+            line += len + (end != NULL);
+        }
+        free(help);
+    }
+    int ok = (fclose(f) == 0);
+    free(index_path);
+    _free_list(files, n);
+    sim_free_modules(mods);
+    return ok ? count : -1;
+}
+
+static void *_analysis_thread(void *arg) {  // Analyse slices in the order the step loop hands them over
+    SimAnalysis *a = (SimAnalysis *)arg;
+    while(1) {
+        while(sem_wait(&a->ready) != 0) { }     // Only EINTR
+        if(a->head == a->tail) { break; }       // The extra post from _free_analyses, and nothing is left
+        __sync_synchronize();
+        Slice *s = a->ring[a->head % a->depth];
+        if(!a->failed && !a->m.analyze(a->m.cfg, s)) {
+            printf("Analysis plug-in %s failed, it won't be given any more slices.\n", a->m.name);
+            a->failed = 1;
+        }
+        slicepool_put(a->pool, s);
+        pthread_mutex_lock(&a->lock);
+        ++a->head;
+        pthread_cond_broadcast(&a->idle);
+        pthread_mutex_unlock(&a->lock);
+    }
+    return NULL;
+}
+
+static int _init_analyses(Sim *sim, int argc, char *argv[]) {   // argv is modified.  Returns 0 on failure.
+    if(argc == 0) { return 1; }
+#ifdef SYM_MPI
+    printf("In-situ analysis isn't supported with MPI.\n");    // Ghosts get tacked onto the slices it would be reading
+    return 0;
+#endif
+    if((sim->analyses = calloc(argc, sizeof(SimAnalysis))) == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    uint64_t depth = (sim->opt.analysis_depth > 0) ? sim->opt.analysis_depth : SIM_ANALYSIS_DEPTH;
+    for(int i = 0; i < argc; i++) {
+        char *margv = argv[i];
+        char *mname = strsep(&margv, "[");
+        margv = strsep(&margv, "]");
+        Module *m = sim_find_module(sim->opt.modules, mname);
+        if(m == NULL) {
+            printf("No module named %s.\n", mname);
+            return 0;
+        } else if(m->analyze == NULL) {
+            printf("%s isn't an analysis plug-in.\n", mname);
+            return 0;
+        }
+        SimAnalysis *a = &sim->analyses[i];
+        a->m = *m;
+        a->pool = sim->pool;
+        a->depth = depth;
+        if((a->ring = malloc(sizeof(Slice *) * depth)) == NULL) {
+            printf("Memory allocation error.\n");
+            return 0;
+        }
+        if((a->m.cfg = a->m.init(margv)) == NULL) {
+            printf("Initialization of analysis plug-in, %s, failed!\n", mname);
+            free(a->ring);
+            return 0;
+        }
+        sem_init(&a->ready, 0, 0);
+        pthread_mutex_init(&a->lock, NULL);
+        pthread_cond_init(&a->idle, NULL);
+        ++sim->nanalysis;
+        if(pthread_create(&a->thread, NULL, _analysis_thread, (void *)a)) {
+            printf("Failed to create pthread.\n");
+            return 0;
+        }
+        a->running = 1;
+        if(sim->opt.verbose) { printf("Analysis: %s\n", mname); }
+    }
+    return 1;
+}
+
+static void _analyse(Sim *sim, Slice *s) {     // Hand s to every analysis plug-in that has room for it.  Never waits.
+    for(int i = 0; i < sim->nanalysis; i++) {
+        SimAnalysis *a = &sim->analyses[i];
+        if(a->failed) { continue; }
+        if(a->tail - a->head >= a->depth) {
+            ++a->dropped;
+            continue;
+        }
+        slice_hold(s);
+        a->ring[a->tail % a->depth] = s;
+        __sync_synchronize();                   // The entry is there before the thread can see it
+        ++a->tail;
+        sem_post(&a->ready);
+    }
+}
+
+static void _analysis_wait(Sim *sim) {  // Until every plug-in has caught up, so nothing but the sim holds its slices
+    for(int i = 0; i < sim->nanalysis; i++) {
+        SimAnalysis *a = &sim->analyses[i];
+        pthread_mutex_lock(&a->lock);
+        while(a->head != a->tail) {
+            pthread_cond_wait(&a->idle, &a->lock);
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+static void _free_analyses(Sim *sim) {
+    for(int i = 0; i < sim->nanalysis; i++) {
+        SimAnalysis *a = &sim->analyses[i];
+        if(a->running) {
+            sem_post(&a->ready);
+            pthread_join(a->thread, NULL);      // It only stops once it's analysed everything it was given
+        }
+        if(a->dropped > 0) {
+            printf("Analysis plug-in %s fell behind and missed %llu slices.\n", a->m.name, (unsigned long long)a->dropped);
+        }
+        a->m.deinit(a->m.cfg);
+        sem_destroy(&a->ready);
+        pthread_mutex_destroy(&a->lock);
+        pthread_cond_destroy(&a->idle);
+        free(a->ring);
+    }
+    sim->nanalysis = 0;
+    free(sim->analyses);
+    sim->analyses = NULL;
+}
+
+static void _free_pipeline(Sim *sim) {
+    for(int i = 0; i < sim->npipeline; i++) {
+        sim->pipeline[i].deinit(sim->pipeline[i].cfg);
+    }
+    sim->npipeline = 0;
+    free(sim->pipeline);
+}
+
+static uint32_t _pipeline_carry(Sim *sim) {    // Which particle fields need to be copied from ps to s each step?
+    // A field can stay behind if no module writes it (the spare buffer still holds the same values),
+    // or if the first module to touch it overwrites it for every body (one with a {mask=...} only sets its species').
+    uint32_t written = 0, set = 0, seen = 0;
+    for(int i = 0; i < sim->npipeline; i++) {
+        if(sim->pipeline[i].fields == NULL) { return PARTICLE_FIELD_ALL; }   // Don't know what it does, play it safe
+        ModuleFields f = { 0 };
+        sim->pipeline[i].fields(sim->pipeline[i].cfg, &f);
+        uint32_t touch = f.s_read | f.s_write;
+        if(sim->pipeline[i].mask != 0) { f.s_set = 0; }
+        set |= touch & ~seen & f.s_set & ~f.s_read;
+        written |= f.s_write;
+        seen |= touch;
+    }
+    return written & ~set & PARTICLE_FIELD_ALL;
+}
+
+static int _stage_conflict(SimStage *a, SimStage *b) { // Does the order of a and b matter?
+    uint32_t na = a->f.s_write & ~a->f.s_accum, nb = b->f.s_write & ~b->f.s_accum;
+    return (a->f.s_write & b->f.s_read) || (b->f.s_write & a->f.s_read) ||
+           (na & b->f.s_write) || (nb & a->f.s_write);     // Two stages may only write the same field if both just add to it
+}
+
+// Would stage k need its own copy of acc on its level (see SimStage.private_acc)?
+static int _needs_private_acc(Sim *sim, int k) {
+    uint32_t acc = 0;
+    for(int j = 0; j < k; j++) {
+        if(sim->stages[j].level == sim->stages[k].level) { acc |= sim->stages[j].f.s_write; }
+    }
+    return (acc & sim->stages[k].f.s_accum) != 0;
+}
+
+static int _build_levels(Sim *sim) {   // Turn the stage list into a DAG, flattened into levels of mutually independent stages
+    int floor = 0, top = -1;
+    for(int k = 0; k < sim->nstage; k++) {
+        SimStage *st = &sim->stages[k];
+        uint32_t plain = 0;
+        memset(&st->f, 0, sizeof(ModuleFields));
+        st->exclusive = 0;
+        st->reach = MODULE_REACH_SELF;
+        for(int i = st->first; i < st->first + st->n; i++) {
+            ModuleFields f = { 0 };
+            if(sim->pipeline[i].fields == NULL) {
+                st->exclusive = 1;
+                st->reach = MODULE_REACH_ALL;
+                continue;
+            }
+            sim->pipeline[i].fields(sim->pipeline[i].cfg, &f);
+            if(f.resize) { st->exclusive = 1; }
+            if(f.reach < st->reach) { st->reach = f.reach; }
+            st->f.ps_read |= f.ps_read;
+            st->f.s_read |= f.s_read;
+            st->f.s_write |= f.s_write;
+            st->f.s_accum |= f.s_accum & PARTICLE_FIELD_ACC;
+            plain |= f.s_write & ~f.s_accum;
+        }
+        st->f.s_accum &= ~plain;
+        
+        if(st->exclusive) {                     // Everything before runs first, everything after runs later
+            st->level = top + 1;
+            floor = st->level + 1;
+        } else {
+            st->level = floor;
+            for(int j = 0; j < k; j++) {
+                if(sim->stages[j].level >= st->level && _stage_conflict(&sim->stages[j], st)) {
+                    st->level = sim->stages[j].level + 1;
+                }
+            }
+            // Only acc is merged back from a private copy, so a stage writing anything else moves up to where it needs none
+            while((st->f.s_write & ~PARTICLE_FIELD_ACC) && _needs_private_acc(sim, k)) { ++st->level; }
+        }
+        if(st->level > top) { top = st->level; }
+    }
+    
+    sim->nlevel = top + 1;
+    sim->level_off = calloc(sim->nlevel + 1, sizeof(int));
+    sim->order = malloc(sizeof(int) * (sim->nstage > 0 ? sim->nstage : 1));
+    if(sim->level_off == NULL || sim->order == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    for(int k = 0; k < sim->nstage; k++) {
+        ++sim->level_off[sim->stages[k].level + 1];
+    }
+    sim->width = 1;
+    for(int l = 0; l < sim->nlevel; l++) {
+        if(sim->level_off[l + 1] > sim->width) { sim->width = sim->level_off[l + 1]; }
+        sim->level_off[l + 1] += sim->level_off[l];
+    }
+    for(int l = 0, n = 0; l < sim->nlevel; l++) {    // Keep pipeline order within a level, accumulations are merged in it
+        uint32_t acc = 0;
+        for(int k = 0; k < sim->nstage; k++) {
+            if(sim->stages[k].level != l) { continue; }
+            sim->stages[k].private_acc = (acc & sim->stages[k].f.s_accum) != 0;
+            acc |= sim->stages[k].f.s_write;
+            sim->order[n++] = k;
+        }
+        if(sim->opt.verbose && sim->level_off[l + 1] - sim->level_off[l] > 1) {
+            printf("Running concurrently:");
+            for(int m = sim->level_off[l]; m < sim->level_off[l + 1]; m++) {
+                SimStage *st = &sim->stages[sim->order[m]];
+                for(int i = st->first; i < st->first + st->n; i++) {
+                    printf(" %s", sim->pipeline[i].name);
+                }
+            }
+            printf("\n");
+        }
+    }
+    
+    sim->arenas = calloc(sim->width, sizeof(Arena *));
+    sim->views = malloc(sizeof(Slice) * sim->width);
+    sim->rets = malloc(sizeof(int) * sim->width);
+    if(sim->arenas == NULL || sim->views == NULL || sim->rets == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    for(int k = 1; k < sim->width; k++) {
+        if((sim->arenas[k] = arena_create(0, sim->opt.huge)) == NULL) {
+            return 0;
+        }
+    }
+    if(sim->opt.concurrent && sim->width > 1 && (sim->dagpool = threadpool_create(sim->width)) == NULL) {
+        return 0;
+    }
+    return 1;
+}
+
+static int _add_species(Sim *sim, uint32_t mask) {
+    if(mask == 0) { return 1; }
+    for(int k = 0; k < sim->nspecies; k++) {
+        if(sim->species[k].mask == mask) { return 1; }
+    }
+    SimSpecies *species = realloc(sim->species, sizeof(SimSpecies) * (sim->nspecies + 1));
+    if(species == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    sim->species = species;
+    memset(&sim->species[sim->nspecies], 0, sizeof(SimSpecies));
+    sim->species[sim->nspecies].mask = mask;
+    ++sim->nspecies;
+    sim->species_stale = 1;
+    return 1;
+}
+
+static SimSpecies *_find_species(Sim *sim, uint32_t mask) {
+    for(int k = 0; k < sim->nspecies; k++) {
+        if(sim->species[k].mask == mask) { return &sim->species[k]; }
+    }
+    return NULL;
+}
+
+static void _free_species(Sim *sim) {
+    for(int k = 0; k < sim->nspecies; k++) {
+        free(sim->species[k].idx);
+    }
+    free(sim->species);
+}
+
+static int _refresh_species(Sim *sim, Slice *s) {     // Rebuild the index lists if the bodies changed.  Returns 0 on allocation failure.
+    for(int k = 0; k < sim->nspecies; k++) {
+        SimSpecies *sp = &sim->species[k];
+        if(!sim->species_stale && sp->nbody == s->nbody) { continue; }
+        if(sp->size < s->nbody) {
+            uint64_t *idx = realloc(sp->idx, sizeof(uint64_t) * s->nbody);
+            if(idx == NULL) {
+                printf("Memory allocation error.\n");
+                return 0;
+            }
+            sp->idx = idx;
+            sp->size = s->nbody;
+        }
+        sp->n = 0;
+        for(uint64_t i = 0; i < s->nbody; i++) {
+            if(s->bodies[i].uflags & sp->mask) { sp->idx[sp->n++] = i; }
+        }
+        sp->nbody = s->nbody;
+    }
+    sim->species_stale = 0;
+    return 1;
+}
+
+static int _exec_masked(Sim *sim, Module *m, Slice *ps, Slice *s) {   // Run m on just its species: gather, exec, scatter back what it writes
+    SimSpecies *sp = _find_species(sim, m->mask);
+    uint64_t n = sp->n;
+    ModuleFields f = { 0 };
+    uint32_t write = PARTICLE_FIELD_ALL;
+    if(m->fields != NULL) {
+        m->fields(m->cfg, &f);
+        write = f.s_write;
+    }
+    int resize = (m->fields == NULL || f.resize);    // Might append, so the bodies have to be realloc()able
+    
+    Slice sub_ps = *ps, sub_s = *s;
+    sub_ps.bodies = slice_scratch(s, sizeof(Particle) * (n > 0 ? n : 1));
+    sub_s.bodies = resize ? universe_malloc(sizeof(Particle) * (n > 0 ? n : 1), 0) : slice_scratch(s, sizeof(Particle) * (n > 0 ? n : 1));
+    if(sub_ps.bodies == NULL || sub_s.bodies == NULL) {
+        printf("Memory allocation error.\n");
+        return MOD_RET_ABRT;
+    }
+    sub_ps.nbody = sub_s.nbody = sub_ps.capacity = sub_s.capacity = n;
+    sub_ps.scratch = NULL;
+    for(uint64_t j = 0; j < n; j++) {
+        uint64_t i = sp->idx[j];
+        sub_ps.bodies[j] = (i < ps->nbody) ? ps->bodies[i] : s->bodies[i];    // Bodies created this step have no past
+        sub_s.bodies[j] = s->bodies[i];
+    }
+    
+    int ret = m->exec(m->cfg, &sub_ps, &sub_s);
+    
+    for(uint64_t j = 0; j < n && j < sub_s.nbody; j++) {
+        particle_copy_fields(&s->bodies[sp->idx[j]], &sub_s.bodies[j], write);
+    }
+    for(uint64_t j = n; j < sub_s.nbody; j++) {     // New bodies go on the end of the full slice
+        slice_append_particle(s, &sub_s.bodies[j]);
+    }
+    if(resize) { free(sub_s.bodies); }
+    return ret;
+}
+
+static int _init_pipeline(Sim *sim, int argc, char *argv[]) {   // argv is modified.  Returns 0 on failure.
+    sim->pipeline = malloc(sizeof(Module) * (argc > 0 ? argc : 1));
+    if(sim->pipeline == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    if(sim->opt.verbose) { printf("Pipeline: "); }
+    for(int i = 0; i < argc; i++) {
+        char *margv = argv[i];
+        char *dargv = strchr(margv, '{');    // Driver options, e.g. {mask=0x2}
+        if(dargv != NULL) {
+            *dargv++ = '\0';
+            dargv = strsep(&dargv, "}");
+        }
+        char *mname = strsep(&margv, "[");
+        margv = strsep(&margv, "]");
+        Module *m = sim_find_module(sim->opt.modules, mname);
+        if(m == NULL) {
+            printf("No module named %s.\n", mname);
+            return 0;
+        }
+        if(m->exec == NULL) {
+            printf("%s is an analysis plug-in, not a transform (see SimOptions.analysis, sym -a).\n", mname);
+            return 0;
+        }
+        memcpy(&sim->pipeline[i], m, sizeof(Module));
+        sim->pipeline[i].mask = 0;
+        while(dargv != NULL && dargv[0] != '\0') {
+            char *val = strsep(&dargv, ",");
+            char *opt = strsep(&val, "=");
+            if(strcmp(opt, "mask") == 0 && val != NULL) {
+                sim->pipeline[i].mask = (uint32_t)strtoul(val, NULL, 0);
+                if(!_add_species(sim, sim->pipeline[i].mask)) { return 0; }
+            } else {
+                printf("Invalid driver option for %s, %s.  Valid options are: {mask=?}\n", mname, opt);
+                return 0;
+            }
+        }
+        if((sim->pipeline[i].cfg = sim->pipeline[i].init(margv)) == NULL) {
+            printf("Initialization of pipeline module, %s, failed!\n", mname);
+            return 0;
+        }
+        ++sim->npipeline;
+        if(sim->opt.verbose) { printf(" %s %s", mname, (argc == i + 1) ? "" : "->"); }
+    }
+    if(sim->opt.verbose) { printf("\n"); }
+    sim->carry = _pipeline_carry(sim);
+    
+    // Group consecutive exec_range modules so they make one pass over the bodies instead of one each
+    sim->stages = malloc(sizeof(SimStage) * (argc > 0 ? argc : 1));
+    if(sim->stages == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    sim->nstage = 0;
+    for(int i = 0; i < argc; i++) {
+        int fused = (sim->pipeline[i].exec_range != NULL && sim->pipeline[i].mask == 0);
+        if(sim->nstage > 0 && fused && sim->stages[sim->nstage - 1].fused) {
+            ++sim->stages[sim->nstage - 1].n;
+            continue;
+        }
+        sim->stages[sim->nstage].first = i;
+        sim->stages[sim->nstage].n = 1;
+        sim->stages[sim->nstage].fused = fused;
+        ++sim->nstage;
+    }
+    return _build_levels(sim);
+}
+
+static void _free_stages(Sim *sim) {
+    for(int k = 1; k < sim->width && sim->arenas != NULL; k++) {
+        arena_free(sim->arenas[k]);
+    }
+    free(sim->arenas);
+    free(sim->views);
+    free(sim->rets);
+    free(sim->level_off);
+    free(sim->order);
+    free(sim->stages);
+    threadpool_free(sim->dagpool);
+}
+
+typedef struct {
+    Sim         *sim;
+    SimStage    *stage;
+    Slice       *ps;
+    Slice       *s;
+    uint64_t    block;
+    int         ret;
+} FuseState;
+
+static uint64_t _share(uint64_t n, ThreadPool *p, int t) {     // Thread t's share of n things (with opt.numa) starts here
+    return n * t / p->nthread;
+}
+
+static void _fused_range(FuseState *f, uint64_t begin, uint64_t end) {   // Every module of the stage over [begin, end)
+    int ret = MOD_RET_OK;
+    for(int i = f->stage->first; i < f->stage->first + f->stage->n; i++) {
+        Module *m = &f->sim->pipeline[i];
+        ret |= m->exec_range(m->cfg, f->ps, f->s, begin, end);
+    }
+    if(ret) { __sync_fetch_and_or(&f->ret, ret); }
+}
+
+static void _fused_task(void *arg, int task) {  // One block
+    FuseState *f = (FuseState *)arg;
+    uint64_t begin = (uint64_t)task * f->block;
+    _fused_range(f, begin, (begin + f->block < f->s->nbody) ? begin + f->block : f->s->nbody);
+}
+
+static void _fused_share(void *arg, int t) {    // Every block of thread t's share, the bodies it copied last step
+    FuseState *f = (FuseState *)arg;
+    uint64_t end = _share(f->s->nbody, f->sim->tpool, t + 1);
+    for(uint64_t begin = _share(f->s->nbody, f->sim->tpool, t); begin < end; begin += f->block) {
+        _fused_range(f, begin, (begin + f->block < end) ? begin + f->block : end);
+    }
+}
+
+static int _run_stage(Sim *sim, SimStage *st, Slice *ps, Slice *s, int alone) {
+    int ret = MOD_RET_OK;
+    if(!st->fused) {
+        for(int i = st->first; i < st->first + st->n; i++) {
+            if(sim->pipeline[i].mask) {
+                ret |= _exec_masked(sim, &sim->pipeline[i], ps, s);
+            } else {
+                ret |= sim->pipeline[i].exec(sim->pipeline[i].cfg, ps, s);
+            }
+        }
+        return ret;
+    }
+    FuseState f = { sim, st, ps, s, FUSE_BLOCK_BYTES / sizeof(Particle), MOD_RET_OK };
+    int nblock = (int)((s->nbody + f.block - 1) / f.block);
+    if(alone && sim->tpool != NULL && sim->opt.numa) {
+        threadpool_run_each(sim->tpool, _fused_share, &f);
+    } else if(alone && sim->tpool != NULL) {
+        threadpool_run(sim->tpool, _fused_task, &f, nblock);
+    } else {                                    // tpool isn't reentrant, and the level is already using the cores
+        for(int t = 0; t < nblock; t++) {
+            _fused_task(&f, t);
+        }
+    }
+    return f.ret;
+}
+
+typedef struct {
+    Sim         *sim;
+    int         off;
+    Slice       *ps;
+} LevelState;
+
+static void _level_task(void *arg, int task) {
+    LevelState *l = (LevelState *)arg;
+    Sim *sim = l->sim;
+    sim->rets[task] = _run_stage(sim, &sim->stages[sim->order[l->off + task]], l->ps, &sim->views[task], 0);
+}
+
+static int _run_level(Sim *sim, int l, Slice *ps, Slice *s) {     // Every stage of level l.  Returns the OR of their MOD_RET_*s.
+    int ret = MOD_RET_OK;
+    int off = sim->level_off[l], n = sim->level_off[l + 1] - off;
+    if(!_refresh_species(sim, s)) { return MOD_RET_ABRT; }    // Before the level starts, its stages may share the lists
+    for(int k = 0; k < n; k++) {
+        if(sim->stages[sim->order[off + k]].f.s_write & PARTICLE_FIELD_UFLAGS) { sim->species_stale = 1; }
+    }
+    if(n == 1) {
+        return _run_stage(sim, &sim->stages[sim->order[off]], ps, s, 1);
+    }
+    
+    // Each stage gets its own view of s (for scratch), and accumulators after the first their own acc to add to
+    for(int k = 0; k < n; k++) {
+        Slice *v = &sim->views[k];
+        *v = *s;
+        v->scratch = (k == 0) ? s->scratch : sim->arenas[k];
+        if(!sim->stages[sim->order[off + k]].private_acc) { continue; }
+        if((v->bodies = arena_alloc(v->scratch, sizeof(Particle) * s->nbody)) == NULL) {
+            printf("Memory allocation error.\n");
+            return MOD_RET_ABRT;
+        }
+        memcpy(v->bodies, s->bodies, sizeof(Particle) * s->nbody);
+        for(uint64_t i = 0; i < s->nbody; i++) {
+            v->bodies[i].acc.x = 0;
+            v->bodies[i].acc.y = 0;
+            v->bodies[i].acc.z = 0;
+        }
+    }
+    LevelState ls = { sim, off, ps };
+    if(sim->dagpool != NULL) {
+        threadpool_run(sim->dagpool, _level_task, &ls, n);
+    } else {                                // Same result, one stage at a time
+        for(int k = 0; k < n; k++) {
+            _level_task(&ls, k);
+        }
+    }
+    
+    for(int k = 0; k < n; k++) {            // Merge in pipeline order, so results don't depend on timing
+        ret |= sim->rets[k];
+        if(!sim->stages[sim->order[off + k]].private_acc) { continue; }
+        Particle *b = sim->views[k].bodies;
+        for(uint64_t i = 0; i < s->nbody; i++) {
+            vector_add(&s->bodies[i].acc, &s->bodies[i].acc, &b[i].acc);
+        }
+    }
+    return ret;
+}
+
+static int _run_pipeline(Sim *sim, Slice *ps, Slice *s) {     // One step through every module.  Returns the OR of their MOD_RET_*s.
+    int ret = MOD_RET_OK;
+    for(int l = 0; l < sim->nlevel; l++) {
+#ifdef SYM_MPI
+        // Modules that look past their own bodies need copies of the other ranks' (the ones nearby, or all of them)
+        int reach = MODULE_REACH_SELF;
+        for(int m = sim->level_off[l]; m < sim->level_off[l + 1]; m++) {
+            if(sim->stages[sim->order[m]].reach < reach) { reach = sim->stages[sim->order[m]].reach; }
+        }
+        int ghosts = (sim->opt.domain->size > 1 && reach != MODULE_REACH_SELF);
+        if(ghosts) {
+            if(!domain_ghosts(sim->opt.domain, ps, s, (reach == MODULE_REACH_NEAR && sim->opt.halo > 0) ? sim->opt.halo : -1)) {
+                return MOD_RET_ABRT;
+            }
+            sim->species_stale = 1;
+        }
+        double t = MPI_Wtime();
+        ret |= _run_level(sim, l, ps, s);
+        sim->busy += MPI_Wtime() - t;
+        if(ghosts) {                            // Their owners have the real results
+            domain_drop_ghosts(sim->opt.domain, ps, s);
+            sim->species_stale = 1;
+        }
+#else
+        ret |= _run_level(sim, l, ps, s);
+#endif
+    }
+    return ret;
+}
+
+static void _touch_task(void *arg, int t) {
+    Sim *sim = (Sim *)arg;
+    uint64_t begin = _share(sim->scratch->size, sim->tpool, t);
+    memset(sim->scratch->base + begin, 0, _share(sim->scratch->size, sim->tpool, t + 1) - begin);
+}
+
+static void _reset_scratch(Sim *sim) {      // End of step, module scratch memory goes back
+    size_t size = sim->scratch->size;
+    arena_reset(sim->scratch);
+    if(sim->opt.numa && sim->tpool != NULL && sim->scratch->size != size) {
+        threadpool_run_each(sim->tpool, _touch_task, sim);  // Grown, so spread its pages over the threads' nodes
+    }
+    for(int k = 1; k < sim->width; k++) {
+        arena_reset(sim->arenas[k]);
+    }
+}
+
+
+typedef struct {
+    Sim         *sim;
+    Slice       *dst;
+    Slice       *src;
+    uint32_t    fields;
+} CopyState;
+
+static void _copy_task(void *arg, int t) {
+    CopyState *c = (CopyState *)arg;
+    slice_copy_range(c->dst, c->src, c->fields, _share(c->src->nbody, c->sim->tpool, t), _share(c->src->nbody, c->sim->tpool, t + 1));
+}
+
+// slice_copy_into (for PARTICLE_FIELD_ALL) or slice_copy_fields.  With opt.numa every tpool thread copies its own share
+// of the bodies, so the pages of a new buffer land on the node of the thread that is going to work on them.
+static int _copy_slice(Sim *sim, Slice *dst, Slice *src, uint32_t fields) {
+    if(!sim->opt.numa || sim->tpool == NULL) {
+        return (fields == PARTICLE_FIELD_ALL) ? slice_copy_into(dst, src) : slice_copy_fields(dst, src, fields);
+    }
+    if(fields == PARTICLE_FIELD_ALL) {
+        dst->nbody = 0;
+        if(!slice_reserve(dst, src->nbody, 0)) { return 0; }
+        dst->nbody = src->nbody;
+    } else if(dst->nbody != src->nbody) {
+        return 0;
+    }
+    dst->time = src->time;
+    dst->bound_min = src->bound_min;
+    dst->bound_max = src->bound_max;
+    dst->ndelete = src->ndelete;
+    CopyState c = { sim, dst, src, fields };
+    threadpool_run_each(sim->tpool, _copy_task, &c);
+    return 1;
+}
+
+void sim_default_options(SimOptions *opt, SimModules *mods) {
+    memset(opt, 0, sizeof(SimOptions));
+    opt->modules = mods;
+    opt->timesteps = -1;
+}
+
+// Set up a sim running the pipeline described by argv (one "name[module options]{driver options}" per module,
+// like sym's -m).  It has nothing to simulate until sim_open or sim_set_slice.  Returns NULL on failure.
+Sim *sim_create(SimOptions *opt, int argc, char *argv[]) {
+    Sim *sim = calloc(1, sizeof(Sim));
+    char **margv = calloc(argc > 0 ? argc : 1, sizeof(char *));
+    if(sim == NULL || margv == NULL) {
+        printf("Memory allocation error.\n");
+        free(sim);
+        free(margv);
+        return NULL;
+    }
+    sim->opt = *opt;
+    sim->writer = opt->writer;
+    sim->tpool = opt->tpool;
+    sim->species_stale = 1;
+    int ok = 1;
+    for(int i = 0; i < argc && ok; i++) {   // The module strings get cut up, so work on a copy
+        if((margv[i] = strdup(argv[i])) == NULL) {
+            printf("Memory allocation error.\n");
+            ok = 0;
+        }
+    }
+    ok = ok && _init_pipeline(sim, argc, margv);
+    for(int i = 0; i < argc; i++) {
+        free(margv[i]);
+    }
+    free(margv);
+
+    // Slices and module scratch memory are recycled, so the main loop doesn't allocate once it's warmed up
+    if(ok) {
+        sim->pool = slicepool_create(opt->huge);
+        sim->scratch = arena_create(0, opt->huge);
+        ok = (sim->pool != NULL && sim->scratch != NULL);
+    }
+    if(ok && opt->lod > 0) {
+        ok = ((sim->lod_pool = slicepool_create(0)) != NULL);
+    }
+    if(ok && opt->nanalysis > 0) {          // Once the pool is there, it's where they give the slices back
+        char **aargv = calloc(opt->nanalysis, sizeof(char *));
+        for(int i = 0; aargv != NULL && i < opt->nanalysis && ok; i++) {
+            ok = ((aargv[i] = strdup(opt->analysis[i])) != NULL);
+        }
+        if(aargv == NULL || !ok) { printf("Memory allocation error.\n"); }
+        ok = (aargv != NULL && ok && _init_analyses(sim, opt->nanalysis, aargv));
+        for(int i = 0; aargv != NULL && i < opt->nanalysis; i++) {
+            free(aargv[i]);
+        }
+        free(aargv);
+    }
+    if(!ok) {
+        sim_destroy(sim);
+        return NULL;
+    }
+    sim->done = 1;                          // Until there's a slice
+    return sim;
+}
+
+static int _sim_begin(Sim *sim) {   // pslice is the starting state, set up the first slice to work on
+    sim->slice = slicepool_get(sim->pool, sim->pslice->nbody);
+    if(sim->slice == NULL || !_copy_slice(sim, sim->slice, sim->pslice, PARTICLE_FIELD_ALL)) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    sim->slice->scratch = sim->scratch;
+    ++sim->slice->time;
+    sim->species_stale = 1;
+    sim->step = 0;
+    sim->done = (sim->opt.timesteps == 0) ? 1 : 0;
+    sim->written = 1;                       // It's the starting state, that came from somewhere else
+    return 1;
+}
+
+static int _open_lod(Sim *sim, const char *out_file) {   // The level of detail companion of out_file.  Returns 0 on failure.
+    if((sim->lod_path = universe_lod_path(out_file)) == NULL) {
+        return 0;
+    }
+    if(sim->opt.verbose) { printf("Level of detail output: %s (%g of the bodies)\n", sim->lod_path, sim->opt.lod); }
+#ifdef SYM_MPI
+    return (sim->lod_dfile = domain_file_open(sim->opt.domain, sim->lod_path)) != NULL;
+#else
+    if(access(sim->lod_path, W_OK) == 0) {
+        sim->lod = universe_open(sim->lod_path);
+    } else {
+        sim->lod = sim->opt.columnar ? universe_create_columnar(sim->lod_path) : universe_create(sim->lod_path);
+    }
+    return sim->lod != NULL;
+#endif
+}
+
+// Start from the last slice of in_file and append every step to out_file (they can be the same file, to resume).
+// Returns 0 on failure.
+int sim_open(Sim *sim, const char *in_file, const char *out_file) {
+    int resume = (strcmp(out_file, in_file) == 0);
+    int verbose = sim->opt.verbose;
+#ifdef SYM_MPI
+    // Every rank reads an even share of the last slice, then they trade bodies until each holds the ones in its box
+    if(verbose) { printf("Reading initial configuration from: %s\n", in_file); }
+    if((sim->pslice = slicepool_get(sim->pool, 0)) == NULL) {
+        return 0;
+    }
+    if(!domain_read_last_slice(sim->opt.domain, in_file, sim->pslice) || !domain_balance(sim->opt.domain, sim->pslice, 1.0)) {
+        return 0;
+    }
+    if(verbose) { printf("%s file for output: %s\n", (access(out_file, W_OK) == 0) ? "Opening existing" : "Creating new", out_file); }
+    if((sim->dfile = domain_file_open(sim->opt.domain, out_file)) == NULL) {
+        return 0;
+    }
+    if(sim->opt.lod > 0 && !_open_lod(sim, out_file)) {
+        return 0;
+    }
+#else
+    if(!resume) {                           // Read the input first, so a bad one doesn't leave an empty output behind
+        if(verbose) { printf("Reading initial configuration from: %s\n", in_file); }
+        if((sim->pslice = universe_read_last_slice(in_file)) == NULL) {
+            return 0;
+        }
+    }
+    
+    if(universe_is_stream(out_file)) {      // Piped on to something else, so nothing to resume and no place for a companion
+        if(verbose) { printf("Streaming output to: %s\n", out_file); }
+        if(resume || sim->opt.lod > 0) {
+            printf("Can't %s a stream, %s.\n", resume ? "resume from" : "write a level of detail companion of", out_file);
+            return 0;
+        }
+        sim->universe = sim->opt.columnar ? universe_create_columnar(out_file) : universe_create_stream(out_file);
+    } else if(access(out_file, W_OK) == 0) {
+        if(verbose) { printf("Opening existing file for output: %s\n", out_file); }
+        sim->universe = universe_open(out_file);
+    } else {
+        if(verbose) { printf("Creating new file for output: %s\n", out_file); }
+        sim->universe = sim->opt.columnar ? universe_create_columnar(out_file) : universe_create(out_file);
+    }
+    if(sim->universe == NULL || (sim->opt.lod > 0 && !_open_lod(sim, out_file))) {
+        return 0;
+    }
+    if(resume) {
+        if(verbose) { printf("Output and Input files are the same, resuming from last slice.\n"); }
+        if((sim->pslice = universe_get_last_slice(sim->universe)) == NULL) {
+            return 0;
+        }
+    }
+    if(sim->opt.numa) {                     // It was read in by this thread, so its pages are all on this thread's node
+        Slice *s = slicepool_get(sim->pool, sim->pslice->nbody);
+        if(s == NULL || !_copy_slice(sim, s, sim->pslice, PARTICLE_FIELD_ALL)) {
+            printf("Memory allocation error.\n");
+            return 0;
+        }
+        slice_free(sim->pslice);
+        sim->pslice = s;
+    }
+#endif
+    return _sim_begin(sim);
+}
+
+// (Re)start from a copy of s, in memory.  Nothing is written unless the sim also has a file from sim_open, so a sim
+// can be reused for any number of short runs.  With MPI, s is this rank's share of the bodies.  Returns 0 on failure.
+int sim_set_slice(Sim *sim, Slice *s) {
+    _analysis_wait(sim);
+    if(sim->writer != NULL && sim->pslice != NULL && !writer_wait(sim->writer, sim->pslice)) {
+        return 0;                           // Don't let the writer get the old run's slices mixed up with the new one
+    }
+    if(sim->pslice != NULL) { slicepool_put(sim->pool, sim->pslice); }
+    if(sim->slice != NULL) { slicepool_put(sim->pool, sim->slice); }
+    sim->slice = NULL;
+    sim->done = 1;
+    if((sim->pslice = slicepool_get(sim->pool, s->nbody)) == NULL || !_copy_slice(sim, sim->pslice, s, PARTICLE_FIELD_ALL)) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    sim->pslice->scratch = NULL;
+#ifdef SYM_MPI
+    if(!domain_balance(sim->opt.domain, sim->pslice, 1.0)) {
+        return 0;
+    }
+#endif
+    return _sim_begin(sim);
+}
+
+Slice *sim_slice(Sim *sim) {    // The last finished slice (the starting one before any steps).  Read only, and only until the next step.
+    return sim->pslice;
+}
+
+static int _write_due(Sim *sim, Slice *s) {   // Does the output get s (the slice of step sim->step)?
+    if(sim->opt.write_every <= 1 && sim->opt.write_time == 0) { return 1; }
+    if(sim->opt.write_every > 1 && (sim->step + 1) % sim->opt.write_every == 0) { return 1; }
+    return sim->opt.write_time > 0 && s->time % sim->opt.write_time == 0;
+}
+
+static int _write_slice(Sim *sim, Slice *s) {  // Append s to the output, if there is one.  Returns 0 on failure.
+#ifdef SYM_MPI
+    if(sim->dfile != NULL && !domain_file_append(sim->dfile, s)) {
+        return 0;
+    }
+#else
+    if(sim->universe == NULL) {                     // In memory only
+    } else if(sim->writer != NULL) {
+        if(!writer_push_to(sim->writer, sim->universe, sim->pool, s)) {  // Blocks if the writer is too far behind
+            return 0;
+        }
+    } else if(!universe_append_slice(sim->universe, s)) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+static int _write_lod(Sim *sim, Slice *s) {     // A sample of s to the level of detail output, if any.  Returns 0 on failure.
+#ifdef SYM_MPI
+    if(sim->lod_dfile == NULL) { return 1; }
+#else
+    if(sim->lod == NULL) { return 1; }
+#endif
+    uint64_t stride = (sim->opt.lod < 1) ? (uint64_t)(1 / sim->opt.lod + 0.5) : 1;
+    Slice *l = slicepool_get(sim->lod_pool, s->nbody / stride + 1);
+    if(l == NULL) {
+        return 0;
+    }
+    l->time = s->time;
+    l->bound_min = s->bound_min;
+    l->bound_max = s->bound_max;
+    l->nbody = slice_sample(s, stride, l->bodies);
+#ifdef SYM_MPI
+    int ok = domain_file_append(sim->lod_dfile, l);
+    slicepool_put(sim->lod_pool, l);
+    return ok;
+#else
+    if(sim->writer == NULL) {
+        int ok = universe_append_slice(sim->lod, l);
+        slicepool_put(sim->lod_pool, l);
+        return ok;
+    }
+    if(!writer_push_to(sim->writer, sim->lod, sim->lod_pool, l)) {
+        slicepool_put(sim->lod_pool, l);
+        return 0;
+    }
+    if(sim->lod_last != NULL) { slicepool_put(sim->lod_pool, sim->lod_last); }
+    sim->lod_last = l;                              // Keep hold of it until the next one, see sim_finish
+    return 1;
+#endif
+}
+
+int sim_step(Sim *sim) {      // One timestep: run the pipeline, pack, write, and set up the next slice.  Returns 0 on failure.
+    Slice *pslice = sim->pslice, *slice = sim->slice;
+    if(slice == NULL) {
+        printf("Nothing to simulate, see sim_open and sim_set_slice.\n");
+        return 0;
+    }
+    int ret = _run_pipeline(sim, pslice, slice);
+#ifdef SYM_MPI
+    MPI_Allreduce(MPI_IN_PLACE, &ret, 1, MPI_INT, MPI_BOR, sim->opt.domain->comm);  // Ranks stop (or pack) together
+#endif
+    
+    if(ret & MOD_RET_ABRT) { return 0; }            // Module requested abort without append
+    if(ret & MOD_RET_EXIT) { sim->done = 1; }       // Module requested exit
+    int moved = 0;                                  // The bodies in slice aren't the ones in pslice any more
+    if(ret & MOD_RET_PACK) {                        // Module thinks we need to repack
+        slice->ndelete = slice_count_deleted(slice);
+    }
+    if(slice->ndelete > 0 && slice->ndelete >= sim->opt.pack_threshold * slice->nbody) {
+        if(!slice_pack(slice)) {
+            return 0;                               // slice_pack failed
+        }
+        moved = 1;
+        sim->species_stale = 1;
+    }
+    else { slice_clear_create(slice); }             // This is redundant if we run slice_pack.  Deleted bodies are skipped when writing.
+                                                    // ???: Could make clear_create based on ret value.
+    
+#ifdef SYM_MPI
+    int64_t nmoved = domain_migrate(sim->opt.domain, slice);  // Bodies that crossed into another rank's box go to it
+    if(nmoved < 0) { return 0; }
+    if(sim->opt.rebalance > 0 && sim->opt.domain->size > 1) {      // Recut the boxes if some rank is doing much more than its share
+        double load[2] = { sim->busy, sim->busy };
+        MPI_Allreduce(MPI_IN_PLACE, &load[0], 1, MPI_DOUBLE, MPI_MAX, sim->opt.domain->comm);
+        MPI_Allreduce(MPI_IN_PLACE, &load[1], 1, MPI_DOUBLE, MPI_SUM, sim->opt.domain->comm);
+        if(load[0] > (1 + sim->opt.rebalance) * load[1] / sim->opt.domain->size) {
+            if(!domain_balance(sim->opt.domain, slice, (slice->nbody > 0) ? sim->busy / slice->nbody : 0)) { return 0; }
+            sim->busy = 0;
+            nmoved = 1;
+        }
+    }
+    if(nmoved > 0) {
+        moved = 1;
+        sim->species_stale = 1;
+    }
+#endif
+    int written = 0, last = sim->done || (sim->opt.timesteps >= 0 && sim->step + 1 >= sim->opt.timesteps);
+    if(last || _write_due(sim, slice)) {
+        if(!_write_slice(sim, slice)) { return 0; }
+        written = 1;
+    }
+    if(!_write_lod(sim, slice)) { return 0; }
+    _analyse(sim, slice);
+    if(sim->opt.output != NULL) { sim->opt.output(sim->opt.output_arg, slice); }
+    _reset_scratch(sim);
+    
+    // Double buffer: if the bodies didn't move around, the old ps only differs from slice in the
+    // fields the pipeline writes, so reuse it and only carry those over (unless it's still waiting to be written).
+    Slice *next = NULL;
+    if(sim->carry != PARTICLE_FIELD_ALL && !moved && slice->nbody == pslice->nbody && !slice_shared(pslice)) {
+        next = pslice;
+        _copy_slice(sim, next, slice, sim->carry);
+    } else {
+        slicepool_put(sim->pool, pslice);
+        sim->pslice = NULL;
+        next = slicepool_get(sim->pool, slice->nbody);
+        if(next == NULL || !_copy_slice(sim, next, slice, PARTICLE_FIELD_ALL)) {
+            printf("Memory allocation error.\n");
+            if(next != NULL) { slicepool_put(sim->pool, next); }
+            sim->written = written;
+            sim->pslice = slice;
+            sim->slice = NULL;
+            return 0;
+        }
+    }
+    sim->written = written;
+    sim->pslice = slice;
+    sim->pslice->scratch = NULL;
+    sim->slice = next;
+    sim->slice->scratch = sim->scratch;
+    ++sim->slice->time;
+    ++sim->step;
+    if(sim->opt.timesteps >= 0 && sim->step >= sim->opt.timesteps) {
+        sim->done = 1;
+    }
+    return 1;
+}
+
+int sim_run(Sim *sim) {     // Step until done.  Returns 0 on failure.
+    while(!sim->done) {
+        if(!sim_step(sim)) { return 0; }
+    }
+    return 1;
+}
+
+// Write the last finished slice if the write cadence skipped it (e.g. stopped early), wait for the sim's slices to reach
+// disk, then close its file.  Returns 0 if writing failed.
+int sim_finish(Sim *sim) {
+    int ok = 1;
+    _analysis_wait(sim);                    // Before waiting on the writer, which goes by who still holds the slices
+    if(!sim->written && sim->pslice != NULL) {
+        ok = _write_slice(sim, sim->pslice);
+        sim->written = 1;
+    }
+    if(sim->writer != NULL && sim->pslice != NULL) {
+        ok = writer_wait(sim->writer, sim->pslice) && ok;   // The last slice pushed, the writer goes in order
+    }
+    if(sim->lod_last != NULL) {
+        if(sim->writer != NULL) { ok = writer_wait(sim->writer, sim->lod_last) && ok; }
+        slicepool_put(sim->lod_pool, sim->lod_last);
+        sim->lod_last = NULL;
+    }
+    if(sim->universe != NULL) {
+        universe_close(sim->universe);
+        universe_free(sim->universe);
+        sim->universe = NULL;
+    }
+    if(sim->lod != NULL) {
+        universe_close(sim->lod);
+        universe_free(sim->lod);
+        sim->lod = NULL;
+    }
+#ifdef SYM_MPI
+    if(sim->dfile != NULL && !domain_file_close(sim->dfile)) {   // Collective
+        printf("Failed to close output!\n");
+        ok = 0;
+    }
+    sim->dfile = NULL;
+    if(sim->lod_dfile != NULL && !domain_file_close(sim->lod_dfile)) {
+        printf("Failed to close level of detail output!\n");
+        ok = 0;
+    }
+    sim->lod_dfile = NULL;
+#endif
+    free(sim->lod_path);
+    sim->lod_path = NULL;
+    return ok;
+}
+
+void sim_destroy(Sim *sim) {
+    if(sim == NULL) { return; }
+    sim_finish(sim);
+    _free_analyses(sim);
+    if(sim->pslice != NULL) { slicepool_put(sim->pool, sim->pslice); }
+    if(sim->slice != NULL) { slicepool_put(sim->pool, sim->slice); }
+    slicepool_free(sim->pool);
+    slicepool_free(sim->lod_pool);
+    arena_free(sim->scratch);
+    _free_stages(sim);
+    _free_species(sim);
+    _free_pipeline(sim);
+    free(sim);
+}
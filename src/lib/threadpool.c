@@ -0,0 +1,296 @@
+//
+//  threadpool.c
+//  SymUniverse - A simple persistent pthread pool for data-parallel loops.
+//
+//
+
+#ifdef LINUX
+#define _GNU_SOURCE                 // CPU affinity
+#include <sched.h>
+#include <dirent.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "threadpool.h"
+#include "SymUniverseConfig.h"
+
+#define _NODE_PATH "/sys/devices/system/node"
+#define _MAX_CPUS 1024             // CPU_SETSIZE
+
+static ThreadTopology _topology;
+static pthread_once_t _topology_once = PTHREAD_ONCE_INIT;
+
+#ifdef LINUX
+static int _read_cpulist(const char *path, cpu_set_t *set) {   // e.g. "0-7,16-23".  Returns 0 if it can't be read.
+    FILE *f = fopen(path, "r");
+    if(f == NULL) { return 0; }
+    CPU_ZERO(set);
+    int lo, hi, n;
+    char sep;
+    while((n = fscanf(f, "%d%c", &lo, &sep)) >= 1) {
+        hi = lo;
+        if(n == 2 && sep == '-') {
+            if(fscanf(f, "%d%c", &hi, &sep) < 1) { break; }
+        }
+        for(int c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+            CPU_SET(c, set);
+        }
+        if(n == 1 || sep != ',') { break; }
+    }
+    fclose(f);
+    return 1;
+}
+
+static int _cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+#endif
+
+static void _topology_add(int node, int *cpus, int n) {   // Append a node, dropping it if it has no CPUs we may use
+    ThreadTopology *t = &_topology;
+    if(n == 0) { return; }
+    int *all = realloc(t->cpus, sizeof(int) * (t->ncpu + n));
+    if(all != NULL) { t->cpus = all; }
+    int *off = realloc(t->node_off, sizeof(int) * (t->nnode + 2));
+    if(off != NULL) { t->node_off = off; }
+    int *id = realloc(t->node_id, sizeof(int) * (t->nnode + 1));
+    if(id != NULL) { t->node_id = id; }
+    if(all == NULL || off == NULL || id == NULL) { return; }
+    memcpy(&t->cpus[t->ncpu], cpus, sizeof(int) * n);
+    t->node_off[t->nnode] = t->ncpu;
+    t->node_id[t->nnode] = node;
+    t->ncpu += n;
+    t->node_off[++t->nnode] = t->ncpu;
+}
+
+static void _topology_read(void) {
+    int cpus[_MAX_CPUS], n = 0;
+#ifdef LINUX
+    cpu_set_t allowed, node_set;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        for(int c = 0; c < sysconf(_SC_NPROCESSORS_ONLN) && c < CPU_SETSIZE; c++) { CPU_SET(c, &allowed); }
+    }
+    int nodes[_MAX_CPUS], nnode = 0;
+    DIR *d = opendir(_NODE_PATH);
+    struct dirent *dir;
+    while(d != NULL && (dir = readdir(d)) != NULL && nnode < _MAX_CPUS) {
+        int node;
+        char tail;
+        if(sscanf(dir->d_name, "node%d%c", &node, &tail) == 1) { nodes[nnode++] = node; }
+    }
+    if(d != NULL) { closedir(d); }
+    qsort(nodes, nnode, sizeof(int), _cmp_int);
+    for(int k = 0; k < nnode; k++) {
+        char path[64];
+        snprintf(path, sizeof(path), _NODE_PATH "/node%d/cpulist", nodes[k]);
+        if(!_read_cpulist(path, &node_set)) { continue; }
+        n = 0;
+        for(int c = 0; c < CPU_SETSIZE && n < _MAX_CPUS; c++) {
+            if(CPU_ISSET(c, &node_set) && CPU_ISSET(c, &allowed)) {
+                cpus[n++] = c;
+                CPU_CLR(c, &allowed);
+            }
+        }
+        _topology_add(nodes[k], cpus, n);
+    }
+    n = 0;
+    for(int c = 0; c < CPU_SETSIZE && n < _MAX_CPUS; c++) {     // No sysfs (or CPUs it didn't mention): one more node
+        if(CPU_ISSET(c, &allowed)) { cpus[n++] = c; }
+    }
+    _topology_add((_topology.nnode > 0) ? -1 : 0, cpus, n);
+#else
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for(n = 0; n < ncpu && n < _MAX_CPUS; n++) { cpus[n] = n; }
+    _topology_add(0, cpus, n);
+#endif
+}
+
+// The CPUs we may run on, by NUMA node (from sysfs).  Read the first time it's asked for, and shared, so don't free it.
+ThreadTopology *threadpool_topology(void) {
+    pthread_once(&_topology_once, _topology_read);
+    return &_topology;
+}
+
+// The CPU to pin the thread'th thread to for THREADPOOL_PIN_*, or -1 to leave it alone.  Threads beyond the
+// number of CPUs wrap around.
+int threadpool_pin_cpu(ThreadTopology *t, int pin, int thread) {
+    if(pin == THREADPOOL_PIN_NONE || t->ncpu == 0) { return -1; }
+    if(pin == THREADPOOL_PIN_COMPACT) {
+        return t->cpus[thread % t->ncpu];
+    }
+    int k = thread % t->nnode, size = t->node_off[k + 1] - t->node_off[k];
+    return t->cpus[t->node_off[k] + (thread / t->nnode) % size];
+}
+
+int threadpool_pin(int cpu) {   // Pin the calling thread to cpu.  Returns 0 if that's not possible.
+#ifdef LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return 0;                   // Only a hint elsewhere
+#endif
+}
+
+// The k'th thread count worth timing for a module allowed nthread threads (see sym.h tunables): 1, 2, 4, ... and
+// nthread itself.  0 once there are no more.
+int threadpool_tune_count(int nthread, int k) {
+    int tc = 1;
+    while(k-- > 0) {
+        if(tc >= nthread) { return 0; }
+        tc = (tc * 2 < nthread) ? tc * 2 : nthread;
+    }
+    return tc;
+}
+
+static void _threadpool_drain(ThreadPool *p) {     // Claim and run tasks until there are none left
+    int t;
+    while((t = __sync_fetch_and_add(&p->next, 1)) < p->ntask) {
+        p->fn(p->arg, t);
+    }
+}
+
+static void *_threadpool_worker(void *arg) {
+    ThreadPool *p = (ThreadPool *)arg;
+    uint64_t seen = 0;
+    int id = (p->nthread - p->nworker) + __sync_fetch_and_add(&p->nstarted, 1);    // After the calling thread, if it works
+    if(p->cpus[id] >= 0) { threadpool_pin(p->cpus[id]); }
+
+    pthread_mutex_lock(&p->lock);
+    while(1) {
+        while(p->generation == seen && !p->shutdown) {
+            pthread_cond_wait(&p->start, &p->lock);
+        }
+        if(p->shutdown) { break; }
+        seen = p->generation;
+        pthread_mutex_unlock(&p->lock);
+
+        if(p->each) {
+            p->fn(p->arg, id);
+        } else {
+            _threadpool_drain(p);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if(--p->nactive == 0) {
+            pthread_cond_signal(&p->done);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+ThreadPool *threadpool_create(int nthread) {
+    return threadpool_create_pinned(nthread, THREADPOOL_PIN_NONE);
+}
+
+// A pool of nthread threads.  Pinned ones are all started by the pool: pinning the calling thread would pin every
+// thread it starts later too.
+ThreadPool *threadpool_create_pinned(int nthread, int pin) {
+    if(nthread < 1) { nthread = 1; }
+    ThreadPool *p = calloc(1, sizeof(ThreadPool));
+    if(p == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    p->nthread = nthread;
+    p->nworker = (pin == THREADPOOL_PIN_NONE) ? nthread - 1 : nthread;
+    p->threads = malloc(sizeof(pthread_t) * nthread);
+    p->cpus = malloc(sizeof(int) * nthread);
+    if(p->threads == NULL || p->cpus == NULL) {
+        printf("Memory allocation error.\n");
+        free(p->threads);
+        free(p->cpus);
+        free(p);
+        return NULL;
+    }
+    ThreadTopology *t = threadpool_topology();
+    for(int i = 0; i < nthread; i++) {
+        p->cpus[i] = threadpool_pin_cpu(t, pin, i);
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for(int i = 0; i < p->nworker; i++) {
+        if(pthread_create(&p->threads[i], NULL, _threadpool_worker, (void *)p)) {
+            printf("Failed to create pthread.\n");
+            p->nworker = i;         // Only join what we actually started
+            threadpool_free(p);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+static void _threadpool_start(ThreadPool *p, ThreadPoolTask fn, void *arg, int ntask, int each) {   // Wake the workers
+    pthread_mutex_lock(&p->lock);
+    p->fn = fn;
+    p->arg = arg;
+    p->ntask = ntask;
+    p->next = 0;
+    p->each = each;
+    p->nactive = p->nworker;
+    ++p->generation;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void _threadpool_wait(ThreadPool *p) {
+    pthread_mutex_lock(&p->lock);
+    while(p->nactive > 0) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void threadpool_run(ThreadPool *p, ThreadPoolTask fn, void *arg, int ntask) {
+    if(ntask <= 0) { return; }
+    if(p->nworker == 0 || (ntask == 1 && p->nworker < p->nthread)) {  // Nothing to gain from waking the workers
+        for(int t = 0; t < ntask; t++) {
+            fn(arg, t);
+        }
+        return;
+    }
+    _threadpool_start(p, fn, arg, ntask, 0);
+    if(p->nworker < p->nthread) {
+        _threadpool_drain(p);               // The calling thread works too
+    }
+    _threadpool_wait(p);
+}
+
+// Call fn(arg, t) exactly once on each thread t in [0, nthread).  A pinned thread always gets the same t, so work split
+// up by t stays on the same CPU (and NUMA node) from one loop to the next.
+void threadpool_run_each(ThreadPool *p, ThreadPoolTask fn, void *arg) {
+    if(p->nworker == 0) {
+        fn(arg, 0);
+        return;
+    }
+    _threadpool_start(p, fn, arg, p->nthread, 1);
+    if(p->nworker < p->nthread) {
+        fn(arg, 0);                         // The calling thread is thread 0
+    }
+    _threadpool_wait(p);
+}
+
+void threadpool_free(ThreadPool *p) {
+    if(p == NULL) { return; }
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+    for(int i = 0; i < p->nworker; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    free(p->threads);
+    free(p->cpus);
+    free(p);
+}
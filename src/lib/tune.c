@@ -0,0 +1,311 @@
+//
+//  tune.c
+//  SymUniverse - Autotuning the pipeline for the slice it's about to run (see sim.h, sym --autotune)
+//
+//  Modules with tunables() list candidate configurations: thread counts, or another module doing the same job a
+//  different way.  One module at a time, in pipeline order, each candidate runs a few steps of the real starting slice.
+//  The fastest whose result agrees with the module's reference candidate wins.  Choices are cached per (module, N,
+//  threads), so later runs of about the same size skip the calibration.
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include "sim.h"
+
+#define _CANDIDATE_SIZE 256     // Longest candidate a module can list
+
+void sim_default_tune(SimTune *tune) {
+    memset(tune, 0, sizeof(SimTune));
+    tune->steps = SIM_TUNE_STEPS;
+    tune->accuracy = SIM_TUNE_ACCURACY;
+    tune->threads = 1;
+}
+
+void sim_tune_free(SimTune *tune) {
+    for(int i = 0; i < tune->argc; i++) {
+        free(tune->argv[i]);
+    }
+    free(tune->argv);
+    tune->argv = NULL;
+    tune->argc = 0;
+}
+
+static double _now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int _quiet(void) {   // Hide what modules print while calibrating.  Returns what _loud needs to undo it.
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if(null >= 0) {
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    return saved;
+}
+
+static void _loud(int saved) {
+    if(saved < 0) { return; }
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+static uint64_t _bucket(uint64_t n) {   // Sizes share a cache entry up to the next power of two
+    uint64_t b = 1;
+    while(b < n) { b <<= 1; }
+    return b;
+}
+
+static int _has_option(const char *opts, const char *opt) {  // Is opt's key (up to any = or ,) set in opts?
+    size_t len = strcspn(opt, "=,]{");
+    for(const char *o = opts; o != NULL; o = strchr(o, ',')) {
+        if(*o == ',') { ++o; }
+        if(strncmp(o, opt, len) == 0 && (o[len] == '=' || o[len] == ',' || o[len] == '\0')) { return 1; }
+    }
+    return 0;
+}
+
+// The module string for candidate cand of spec ("name[options]{driver}").  A candidate with options of its own
+// ("othermodule[options]") replaces spec's module, otherwise its options replace or add to spec's.  NULL on allocation
+// failure.
+static char *_candidate(const char *spec, const char *cand) {
+    const char *driver = strchr(spec, '{');
+    if(driver == NULL) { driver = spec + strlen(spec); }
+    const char *open = memchr(spec, '[', driver - spec);
+    const char *close = (open != NULL) ? memchr(open, ']', driver - open) : NULL;
+    const char *opts = (open != NULL) ? open + 1 : driver;
+    int nname = (open != NULL) ? (int)(open - spec) : (int)(driver - spec);
+    int nopts = (open != NULL) ? (int)(((close != NULL) ? close : driver) - opts) : 0;
+    char *m = malloc(strlen(spec) + strlen(cand) + 4), *c = m;
+    if(m == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    if(strchr(cand, '[') != NULL) {
+        sprintf(m, "%s%s", cand, driver);
+        return m;
+    }
+    c += sprintf(c, "%.*s[", nname, spec);
+    char *first = c;
+    for(const char *o = opts; o < opts + nopts; o += strcspn(o, ",") + 1) {    // The ones cand doesn't set
+        int len = (int)strcspn(o, ",");
+        if(o + len > opts + nopts) { len = (int)(opts + nopts - o); }
+        if(len == 0 || _has_option(cand, o)) { continue; }
+        c += sprintf(c, "%s%.*s", (c > first) ? "," : "", len, o);
+    }
+    if(cand[0] != '\0') { c += sprintf(c, "%s%s", (c > first) ? "," : "", cand); }
+    if(c == first) {                        // No options at all
+        --c;
+    } else {
+        *c++ = ']';
+    }
+    strcpy(c, driver);
+    return m;
+}
+
+// Positions relative to ref's extent, velocities relative to its fastest body, whichever is further off.  INFINITY
+// if they don't even have the same bodies.
+static double _error(Slice *ref, Slice *s) {
+    if(ref->nbody != s->nbody) { return INFINITY; }
+    Vector min = {INFINITY, INFINITY, INFINITY}, max = {-INFINITY, -INFINITY, -INFINITY};
+    double vmax2 = 0;
+    for(uint64_t i = 0; i < ref->nbody; i++) {
+        Particle *p = &ref->bodies[i];
+        if(p->flags & PARTICLE_FLAG_DELETE) { continue; }
+        min.x = fmin(min.x, p->pos.x); max.x = fmax(max.x, p->pos.x);
+        min.y = fmin(min.y, p->pos.y); max.y = fmax(max.y, p->pos.y);
+        min.z = fmin(min.z, p->pos.z); max.z = fmax(max.z, p->pos.z);
+        vmax2 = fmax(vmax2, vector_dot(&p->vel, &p->vel));
+    }
+    double extent = fmax(max.x - min.x, fmax(max.y - min.y, max.z - min.z));
+    double vmax = sqrt(vmax2);
+    double err = 0;
+    for(uint64_t i = 0; i < ref->nbody; i++) {
+        Particle *p = &ref->bodies[i], *q = &s->bodies[i];
+        if((p->flags ^ q->flags) & PARTICLE_FLAG_DELETE) { return INFINITY; }
+        if(p->flags & PARTICLE_FLAG_DELETE) { continue; }
+        Vector d;
+        vector_sub(&d, &q->pos, &p->pos);
+        err = fmax(err, (extent > 0) ? sqrt(vector_dot(&d, &d)) / extent : sqrt(vector_dot(&d, &d)));
+        vector_sub(&d, &q->vel, &p->vel);
+        err = fmax(err, (vmax > 0) ? sqrt(vector_dot(&d, &d)) / vmax : sqrt(vector_dot(&d, &d)));
+    }
+    return err;
+}
+
+// Run the pipeline for 1 + tune->steps steps from s.  Sets *secs to the time per step, not counting the first (it
+// pays for warming up the slice pool and scratch), and *result to a copy of the last slice.  Returns 0 if the pipeline
+// can't be set up or fails.
+static int _calibrate(SimTune *tune, SimOptions *opt, int argc, char *argv[], Slice *s, double *secs, Slice **result) {
+    SimOptions o = *opt;
+    o.timesteps = tune->steps + 1;
+    o.writer = NULL;
+    o.output = NULL;
+    o.nanalysis = 0;
+    o.verbose = 0;
+    *result = NULL;
+    int saved = _quiet();
+    Sim *sim = sim_create(&o, argc, argv);
+    double t0 = _now();
+    int ok = (sim != NULL && sim_set_slice(sim, s) && sim_step(sim));
+    double t1 = _now();
+    int n = 0;
+    while(ok && !sim->done) {
+        ok = sim_step(sim);
+        ++n;
+    }
+    *secs = (n > 0) ? (_now() - t1) / n : t1 - t0;    // A module may have ended it after the first
+    if(ok && (*result = slice_copy(sim_slice(sim))) == NULL) { ok = 0; }
+    sim_destroy(sim);
+    _loud(saved);
+    return ok;
+}
+
+static char *_cached(SimTune *tune, const char *spec, uint64_t n) {   // The cached choice for spec, or NULL
+    FILE *f = (tune->cache != NULL) ? fopen(tune->cache, "r") : NULL;
+    if(f == NULL) { return NULL; }
+    char line[3 * _CANDIDATE_SIZE], mod[_CANDIDATE_SIZE], choice[2 * _CANDIDATE_SIZE], *found = NULL;
+    unsigned long long cn;
+    int threads;
+    while(fgets(line, sizeof(line), f) != NULL) {   // The last entry wins
+        if(line[0] == '#') { continue; }
+        if(sscanf(line, "%255s %llu %d %511s", mod, &cn, &threads, choice) == 4 && strcmp(mod, spec) == 0 &&
+           cn == _bucket(n) && threads == tune->threads) {
+            free(found);
+            found = strdup(choice);
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static void _cache(SimTune *tune, const char *spec, uint64_t n, const char *choice) {
+    if(tune->cache == NULL) { return; }
+    int fresh = (access(tune->cache, F_OK) != 0);
+    FILE *f = fopen(tune->cache, "a");
+    if(f == NULL) {
+        printf("Could not write the autotune cache, %s.\n", tune->cache);
+        return;
+    }
+    if(fresh) { fprintf(f, "# sym --autotune choices: <module> <bodies, rounded up to a power of two> <threads> <choice>\n"); }
+    fprintf(f, "%s %llu %d %s\n", spec, (unsigned long long)_bucket(n), tune->threads, choice);
+    fclose(f);
+}
+
+// Time every candidate of pipeline module i, m, with the others as tuned so far, and leave the winner in tune->argv[i].
+// spec is how it was given.  Returns 0 on failure.
+static int _tune_module(SimTune *tune, SimOptions *opt, int i, Module *m, const char *spec, Slice *s) {
+    char cand[_CANDIDATE_SIZE];
+    char *given = tune->argv[i], *best = NULL;
+    double best_secs = INFINITY;
+    Slice *ref = NULL;
+    int ok = 1;
+    if(opt->verbose) {
+        printf("Autotuning %s for %llu bodies on %d thread%s:\n", spec, (unsigned long long)s->nbody, tune->threads,
+               (tune->threads == 1) ? "" : "s");
+    }
+    for(int k = 0; ok && m->tunables(m->cfg, s->nbody, tune->threads, k, cand, sizeof(cand)); k++) {
+        char *c = _candidate(spec, cand);
+        if(c == NULL) {
+            ok = 0;
+            break;
+        }
+        double secs;
+        Slice *result;
+        tune->argv[i] = c;
+        int ran = _calibrate(tune, opt, tune->argc, tune->argv, s, &secs, &result);
+        tune->argv[i] = given;
+        if(!ran) {
+            if(opt->verbose) { printf("\t%-32s failed\n", c); }
+            if(k == 0) {                    // Nothing to hold the others to
+                printf("The reference configuration of %s, %s, failed.\n", spec, c);
+                ok = 0;
+            }
+            free(c);
+            continue;
+        }
+        double err = (ref != NULL) ? _error(ref, result) : 0;
+        if(opt->verbose) {
+            printf("\t%-32s %10.6f s/step", c, secs);
+            if(k == 0) {
+                printf("  (reference)\n");
+            } else {
+                printf("  error %.2g%s\n", err, (err <= tune->accuracy) ? "" : ", too inaccurate");
+            }
+        }
+        if(err <= tune->accuracy && secs < best_secs) {
+            free(best);
+            best = c;
+            best_secs = secs;
+        } else {
+            free(c);
+        }
+        if(ref == NULL) {
+            ref = result;
+        } else {
+            slice_free(result);
+        }
+    }
+    if(ref != NULL) { slice_free(ref); }
+    if(!ok) {
+        free(best);
+        return 0;
+    }
+    if(best != NULL) {
+        free(given);
+        tune->argv[i] = best;
+    }
+    if(opt->verbose) { printf("\t-> %s\n", tune->argv[i]); }
+    _cache(tune, spec, s->nbody, tune->argv[i]);
+    return 1;
+}
+
+// Pick the fastest configuration of every tunable module in the pipeline argv (see sim_create) for starting from s,
+// within tune->accuracy of what each module's reference configuration gives.  The result is tune->argv.  Returns 0 on
+// failure.
+int sim_autotune(SimTune *tune, SimOptions *opt, int argc, char *argv[], Slice *s) {
+    sim_tune_free(tune);
+    if((tune->argv = calloc(argc > 0 ? argc : 1, sizeof(char *))) == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    tune->argc = argc;
+    for(int i = 0; i < argc; i++) {
+        if((tune->argv[i] = strdup(argv[i])) == NULL) {
+            printf("Memory allocation error.\n");
+            return 0;
+        }
+    }
+    SimOptions o = *opt;
+    o.timesteps = 0;
+    o.writer = NULL;
+    o.nanalysis = 0;
+    o.verbose = 0;
+    Sim *sim = sim_create(&o, argc, argv);     // Just for the modules' configurations, to ask them for candidates
+    if(sim == NULL) { return 0; }
+    int ok = 1;
+    for(int i = 0; i < argc && ok; i++) {
+        Module *m = &sim->pipeline[i];
+        if(m->tunables == NULL) { continue; }
+        char *choice = _cached(tune, argv[i], s->nbody);
+        if(choice != NULL) {
+            if(opt->verbose) { printf("Autotune: %s -> %s (cached)\n", argv[i], choice); }
+            free(tune->argv[i]);
+            tune->argv[i] = choice;
+            continue;
+        }
+        ok = _tune_module(tune, opt, i, m, argv[i], s);
+    }
+    sim_destroy(sim);
+    return ok;
+}
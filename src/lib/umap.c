@@ -0,0 +1,255 @@
+//
+//  umap.c
+//  SymUniverse - Zero-copy, read-only access to a universe file through mmap (see umap.h).
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "umap.h"
+
+#define _SLICE_HEADER_SIZE (2 * (sizeof(uint64_t) + sizeof(Vector)))    // As in universe.c
+
+static int _fits(UniverseMap *m, long pos, uint64_t n, size_t size) {     // Are there n things of size at pos?
+    return pos >= 0 && (size_t)pos <= m->size && n <= (m->size - pos) / size;
+}
+
+// Bytes the slice of nbody bodies at pos takes up, headers and all.  0 if it doesn't all fit in the file.
+static uint64_t _slice_size(UniverseMap *m, long pos, uint64_t nbody) {
+    if(m->version < UNIVERSE_VERSION_COLUMNAR) {
+        return _fits(m, pos + _SLICE_HEADER_SIZE, nbody, sizeof(Particle)) ? _SLICE_HEADER_SIZE + nbody * sizeof(Particle) : 0;
+    }
+    UniverseColumns c;
+    pos += _SLICE_HEADER_SIZE;
+    if(!_fits(m, pos, 1, sizeof(UniverseColumns))) { return 0; }
+    memcpy(&c, m->base + pos, sizeof(UniverseColumns));
+    if(nbody > UINT64_MAX / sizeof(Particle)) { return 0; }
+    uint64_t size = universe_columns_size(nbody, c.constant, PARTICLE_FIELD_ALL);
+    return _fits(m, pos + sizeof(UniverseColumns), size, 1) ? _SLICE_HEADER_SIZE + sizeof(UniverseColumns) + size : 0;
+}
+
+static long *_index_alloc(UniverseMap *m, uint64_t n) {
+    if((m->slice_idx = malloc(sizeof(long) * (n > 0 ? n : 1))) == NULL) {
+        printf("Memory allocation error.\n");
+    }
+    return m->slice_idx;
+}
+
+// Fill in slice_idx the way universe_open would: from the index at the end (version 1), the index blocks (version 2)
+// or by walking the slice headers (streams, leaving out a slice that's cut short).  Returns 0 on failure.
+static int _index(UniverseMap *m, long pos, uint64_t nslice, long first_block) {
+    if(nslice == UNIVERSE_STREAM) {
+        uint64_t cap = 16, nbody;
+        m->nslice = 0;
+        if(_index_alloc(m, cap) == NULL) { return 0; }
+        while(_fits(m, pos, 1, _SLICE_HEADER_SIZE)) {
+            memcpy(&nbody, m->base + pos + sizeof(uint64_t), sizeof(nbody));
+            uint64_t size = _slice_size(m, pos, nbody);
+            if(size == 0) { break; }
+            if(m->nslice == cap) {
+                long *idx = realloc(m->slice_idx, sizeof(long) * (cap *= 2));
+                if(idx == NULL) {
+                    printf("Memory allocation error.\n");
+                    return 0;
+                }
+                m->slice_idx = idx;
+            }
+            m->slice_idx[m->nslice++] = pos;
+            pos += size;
+        }
+        return 1;
+    }
+    m->nslice = nslice;
+    if(!_fits(m, pos, nslice, sizeof(long))) {
+        printf("The index of %s is cut short.\n", m->path);
+        return 0;
+    } else if(_index_alloc(m, nslice) == NULL) {
+        return 0;
+    } else if(m->version < 2) {
+        memcpy(m->slice_idx, m->base + m->size - sizeof(long) * nslice, sizeof(long) * nslice);
+        return 1;
+    }
+    UniverseIndexBlock b;
+    for(uint64_t n = 0; n < nslice; n += UNIVERSE_BLOCK_SLICES) {
+        long at = (n == 0) ? first_block : b.next;
+        if(at <= 0 || !_fits(m, at, 1, sizeof(UniverseIndexBlock))) {
+            printf("The index of %s is cut short.\n", m->path);
+            return 0;
+        }
+        memcpy(&b, m->base + at, sizeof(UniverseIndexBlock));
+        uint64_t k = nslice - n;
+        memcpy(&m->slice_idx[n], b.slice_pos, sizeof(long) * ((k < UNIVERSE_BLOCK_SLICES) ? k : UNIVERSE_BLOCK_SLICES));
+    }
+    return 1;
+}
+
+// Map a universe file (any version, or a stream landed in a file).  advice is UMAP_SEQUENTIAL or UMAP_RANDOM, how its
+// slices are going to be read.  path has to outlive the map.  NULL on failure.
+UniverseMap *umap_open(const char *path, int advice) {
+    UniverseMap *m = calloc(1, sizeof(UniverseMap));
+    if(m == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    m->path = path;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        printf("Could not open universe file, %s, because: %s\n", path, strerror(errno));
+        if(fd >= 0) { close(fd); }
+        free(m);
+        return NULL;
+    } else if((size_t)st.st_size < sizeof(UniverseHeader)) {
+        printf("%s does not appear to be a valid Universe Data File!\n", path);
+        close(fd);
+        free(m);
+        return NULL;
+    }
+    m->size = st.st_size;
+    void *base = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        printf("Could not map %s, because: %s\n", path, strerror(errno));
+        free(m);
+        return NULL;
+    }
+    m->base = base;
+
+    UniverseHeader header;
+    long first_block = 0, pos = sizeof(UniverseHeader);
+    memcpy(&header, m->base, sizeof(UniverseHeader));
+    if(strncmp(header.string, UNIVERSE_STRING, sizeof(header.string)) != 0) {
+        printf("%s does not appear to be a valid Universe Data File!\n", path);
+        umap_close(m);
+        return NULL;
+    } else if(header.version < 1 || header.version > UNIVERSE_VERSION_COLUMNAR) {
+        printf("Universe Data File version mismatch.  File is %d, we can read up to %d.\n", header.version, UNIVERSE_VERSION_COLUMNAR);
+        umap_close(m);
+        return NULL;
+    }
+    m->version = header.version;
+    if(m->version >= 2) {
+        if(!_fits(m, pos, 1, sizeof(long))) {
+            printf("%s does not appear to be a valid Universe Data File!\n", path);
+            umap_close(m);
+            return NULL;
+        }
+        memcpy(&first_block, m->base + pos, sizeof(long));
+        pos += sizeof(long);
+    }
+    if(!_index(m, pos, header.nslice, first_block)) {
+        umap_close(m);
+        return NULL;
+    }
+    umap_advise(m, advice);
+    return m;
+}
+
+static int _header(UniverseMap *m, uint64_t slice, Slice *s) {     // s's time, nbody and bounds.  0 if there's no such slice.
+    if(slice >= m->nslice || !_fits(m, m->slice_idx[slice], 1, _SLICE_HEADER_SIZE)) {
+        printf("%s has no slice %llu.\n", m->path, (unsigned long long)slice);
+        return 0;
+    }
+    memcpy(&s->time, m->base + m->slice_idx[slice], _SLICE_HEADER_SIZE);
+    if(_slice_size(m, m->slice_idx[slice], s->nbody) == 0) {
+        printf("Slice %llu of %s is cut short.\n", (unsigned long long)slice, m->path);
+        return 0;
+    }
+    s->scratch = NULL;
+    s->refs = 1;
+    s->ndelete = 0;
+    return 1;
+}
+
+// Point view at slice number slice.  Its bodies are the ones in the file: read only, valid until umap_close, and not to
+// be slice_free'd.  Safe to call from any number of threads at once.  Returns 0 if there is no such slice, or if the file
+// is version 3 (its bodies aren't stored whole, see umap_column and umap_read).
+int umap_slice(UniverseMap *m, uint64_t slice, Slice *view) {
+    if(m->version >= UNIVERSE_VERSION_COLUMNAR) {
+        printf("%s is stored a column at a time, its slices can't be viewed whole.\n", m->path);
+        return 0;
+    } else if(!_header(m, slice, view)) {
+        return 0;
+    }
+    view->bodies = (Particle *)(m->base + m->slice_idx[slice] + _SLICE_HEADER_SIZE);
+    view->capacity = view->nbody;
+    return 1;
+}
+
+// Where one PARTICLE_FIELD_* of slice's bodies is in the file, body i's being at column + i * *stride.  *stride is
+// 0 where every body has the same value (so the column has just the one), and sizeof(Particle) in files that keep whole
+// bodies.  Nothing else in the file has to be read.  If s isn't NULL, it gets the slice's header (not its bodies).
+// Thread safe.  NULL if there is no such slice.
+const void *umap_column(UniverseMap *m, uint64_t slice, uint32_t field, size_t *stride, Slice *s) {
+    Slice h;
+    if(s == NULL) { s = &h; }
+    int k = 0;
+    while(k < PARTICLE_NFIELD && particle_field(k)->field != field) { ++k; }
+    if(k == PARTICLE_NFIELD) {
+        printf("Particles have no field 0x%x.\n", field);
+        return NULL;
+    } else if(!_header(m, slice, s)) {
+        return NULL;
+    }
+    long pos = m->slice_idx[slice] + _SLICE_HEADER_SIZE;
+    if(m->version < UNIVERSE_VERSION_COLUMNAR) {
+        *stride = sizeof(Particle);
+        return m->base + pos + particle_field(k)->offset;
+    }
+    UniverseColumns c;
+    memcpy(&c, m->base + pos, sizeof(UniverseColumns));
+    *stride = (c.constant & field) ? 0 : particle_field(k)->size;
+    return m->base + pos + sizeof(UniverseColumns) + universe_columns_size(s->nbody, c.constant, field - 1);
+}
+
+// Copy just the given PARTICLE_FIELD_*s of slice into dst (growing it as needed), the other fields are 0.  For files of
+// any version, and only the columns asked for are touched in version 3 ones.  Thread safe.  Returns 0 on failure.
+int umap_read(UniverseMap *m, uint64_t slice, uint32_t fields, Slice *dst) {
+    Slice h;
+    if(!_header(m, slice, &h) || (dst->capacity < h.nbody && !slice_reserve(dst, h.nbody, 0))) {
+        return 0;
+    }
+    dst->time = h.time;
+    dst->nbody = h.nbody;
+    dst->bound_min = h.bound_min;
+    dst->bound_max = h.bound_max;
+    dst->ndelete = 0;
+    if(fields != PARTICLE_FIELD_ALL) { memset(dst->bodies, 0, sizeof(Particle) * h.nbody); }
+    for(int k = 0; k < PARTICLE_NFIELD; k++) {
+        const ParticleField *pf = particle_field(k);
+        size_t stride;
+        if(!(fields & pf->field)) { continue; }
+        const char *column = umap_column(m, slice, pf->field, &stride, NULL);
+        for(uint64_t i = 0; i < h.nbody; i++) { memcpy((char *)&dst->bodies[i] + pf->offset, column + i * stride, pf->size); }
+    }
+    return 1;
+}
+
+void umap_advise(UniverseMap *m, int advice) {      // Change how the slices are going to be read (a hint, it can't fail)
+    madvise((void *)m->base, m->size, (advice == UMAP_RANDOM) ? MADV_RANDOM : MADV_SEQUENTIAL);
+}
+
+void umap_prefetch(UniverseMap *m, uint64_t slice) {   // Start reading slice in, e.g. the next one while this one's used
+    if(slice >= m->nslice || !_fits(m, m->slice_idx[slice], 1, _SLICE_HEADER_SIZE)) { return; }
+    uint64_t nbody;
+    long page = sysconf(_SC_PAGESIZE);
+    long pos = m->slice_idx[slice];
+    memcpy(&nbody, m->base + pos + sizeof(uint64_t), sizeof(nbody));
+    uint64_t size = _slice_size(m, pos, nbody);
+    if(size == 0) { return; }
+    long start = pos - pos % page;
+    madvise((void *)(m->base + start), pos + size - start, MADV_WILLNEED);
+}
+
+void umap_close(UniverseMap *m) {   // Views of it are gone with it
+    if(m == NULL) { return; }
+    munmap((void *)m->base, m->size);
+    free(m->slice_idx);
+    free(m);
+}
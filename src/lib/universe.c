@@ -13,9 +13,31 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/stat.h>
+#ifdef LINUX
+#include <sys/mman.h>
+#endif
 #include "universe.h"
 #include "SymUniverseConfig.h"
 
+#define _HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define _SLICE_HEADER_SIZE (2 * (sizeof(uint64_t) + sizeof(Vector)))    // time, nbody and the two boundary vectors
+
+#define _COLUMN_CHUNK 4096                  // Values gathered or scattered at a time when writing or reading columns
+
+static int _stdout_fd = -1;                 // Where stdout went, once universe_claim_stdout has taken it
+
+static const ParticleField _particle_layout[PARTICLE_NFIELD] = {     // In Particle (and version 3 column) order
+    { PARTICLE_FIELD_FLAGS,     sizeof(uint32_t),   offsetof(Particle, flags) },
+    { PARTICLE_FIELD_UFLAGS,    sizeof(uint32_t),   offsetof(Particle, uflags) },
+    { PARTICLE_FIELD_MASS,      sizeof(double),     offsetof(Particle, mass) },
+    { PARTICLE_FIELD_CHARGE,    sizeof(double),     offsetof(Particle, charge) },
+    { PARTICLE_FIELD_RADIUS,    sizeof(double),     offsetof(Particle, radius) },
+    { PARTICLE_FIELD_POS,       sizeof(Vector),     offsetof(Particle, pos) },
+    { PARTICLE_FIELD_VEL,       sizeof(Vector),     offsetof(Particle, vel) },
+    { PARTICLE_FIELD_ACC,       sizeof(Vector),     offsetof(Particle, acc) },
+};
+
 void vector_add(Vector *dst, Vector *a, Vector *b) {
     dst->x = a->x + b->x;
     dst->y = a->y + b->y;
@@ -43,66 +65,528 @@ int vector_equal(Vector *a, Vector *b) {
     return 0;
 }
 
+void *universe_malloc(size_t size, int huge) {     // UNIVERSE_ALIGN aligned, release with free()
+    void *p;
+    size_t align = UNIVERSE_ALIGN;
+    if(size == 0) { size = UNIVERSE_ALIGN; }
+#ifdef LINUX
+    if(huge && size >= _HUGE_PAGE_SIZE) {           // Transparent huge pages need 2MB aligned, 2MB multiple regions
+        align = _HUGE_PAGE_SIZE;
+        size = (size + _HUGE_PAGE_SIZE - 1) / _HUGE_PAGE_SIZE * _HUGE_PAGE_SIZE;
+    }
+#endif
+    if(posix_memalign(&p, align, size)) {
+        return NULL;
+    }
+#ifdef LINUX
+    if(align == _HUGE_PAGE_SIZE) {
+        madvise(p, size, MADV_HUGEPAGE);            // Only a hint, failure is harmless
+    }
+#endif
+    return p;
+}
+
+Arena *arena_create(size_t size, int huge) {
+    Arena *a = calloc(1, sizeof(Arena));
+    if(a == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    a->huge = huge;
+    if(size > 0 && (a->base = universe_malloc(size, huge)) == NULL) {
+        printf("Memory allocation error.\n");
+        free(a);
+        return NULL;
+    }
+    a->size = (a->base == NULL) ? 0 : size;
+    return a;
+}
+
+void *arena_alloc(Arena *a, size_t size) {  // UNIVERSE_ALIGN aligned.  Don't free it, it goes away at arena_reset.
+    size = (size + UNIVERSE_ALIGN - 1) / UNIVERSE_ALIGN * UNIVERSE_ALIGN;
+    a->want += size;
+    if(a->used + size <= a->size) {
+        void *p = a->base + a->used;
+        a->used += size;
+        return p;
+    }
+    // Doesn't fit.  Serve it from the heap this time, the block is grown at the next reset.
+    void **overflow = realloc(a->overflow, sizeof(void *) * (a->noverflow + 1));
+    if(overflow == NULL) { return NULL; }
+    a->overflow = overflow;
+    if((a->overflow[a->noverflow] = universe_malloc(size, a->huge)) == NULL) { return NULL; }
+    return a->overflow[a->noverflow++];
+}
+
+void arena_reset(Arena *a) {                // Release everything.  In the steady state this does not touch the allocator.
+    for(int i = 0; i < a->noverflow; i++) {
+        free(a->overflow[i]);
+    }
+    free(a->overflow);
+    a->overflow = NULL;
+    a->noverflow = 0;
+    if(a->want > a->size) {
+        free(a->base);
+        a->base = universe_malloc(a->want, a->huge);
+        a->size = (a->base == NULL) ? 0 : a->want;
+    }
+    a->used = 0;
+    a->want = 0;
+}
+
+void arena_free(Arena *a) {
+    if(a == NULL) { return; }
+    arena_reset(a);
+    free(a->base);
+    free(a);
+}
+
+SlicePool *slicepool_create(int huge) {
+    SlicePool *p = calloc(1, sizeof(SlicePool));
+    if(p == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    p->huge = huge;
+    return p;
+}
+
+Slice *slicepool_get(SlicePool *p, uint64_t nbody) {   // A slice with room for nbody bodies.  Contents are undefined.
+    Slice *s = NULL;
+    pthread_mutex_lock(&p->lock);
+    for(int i = p->nfree - 1; i >= 0; i--) {            // Most recently returned first, it's probably still in cache
+        if(p->free[i]->capacity >= nbody) {
+            s = p->free[i];
+            p->free[i] = p->free[--p->nfree];
+            break;
+        }
+    }
+    if(s == NULL && p->nfree > 0) {
+        s = p->free[--p->nfree];
+    }
+    pthread_mutex_unlock(&p->lock);
+    if(s == NULL && (s = calloc(1, sizeof(Slice))) == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    s->refs = 1;
+    if(!slice_reserve(s, nbody, p->huge)) {
+        slicepool_put(p, s);
+        return NULL;
+    }
+    s->nbody = 0;
+    s->ndelete = 0;
+    s->scratch = NULL;
+    return s;
+}
+
+void slicepool_put(SlicePool *p, Slice *s) {            // Drop a reference, the slice is recycled once nobody holds it
+    if(__sync_sub_and_fetch(&s->refs, 1) > 0) { return; }
+    pthread_mutex_lock(&p->lock);
+    if(p->nfree == p->size) {
+        int size = p->size ? p->size * 2 : 4;
+        Slice **free_list = realloc(p->free, sizeof(Slice *) * size);
+        if(free_list == NULL) {                         // Can't keep it, so let it go
+            pthread_mutex_unlock(&p->lock);
+            slice_free(s);
+            return;
+        }
+        p->free = free_list;
+        p->size = size;
+    }
+    p->free[p->nfree++] = s;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void slicepool_free(SlicePool *p) {
+    if(p == NULL) { return; }
+    for(int i = 0; i < p->nfree; i++) {
+        slice_free(p->free[i]);
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p->free);
+    free(p);
+}
+
+void slice_hold(Slice *s) {         // Take another reference on a slice (released with slicepool_put)
+    __sync_add_and_fetch(&s->refs, 1);
+}
+
+int slice_shared(Slice *s) {        // Does anyone besides the caller still hold s?
+    return __sync_add_and_fetch(&s->refs, 0) > 1;
+}
+
 int slice_free(Slice *s) {
     free(s->bodies);
     free(s);
     return 0;
 }
 
+int slice_reserve(Slice *s, uint64_t nbody, int huge) {     // Make room for nbody bodies, keeping the current ones
+    if(s->capacity >= nbody && s->bodies != NULL) { return 1; }
+    Particle *bodies = universe_malloc(sizeof(Particle) * nbody, huge);
+    if(bodies == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    if(s->bodies != NULL && s->nbody > 0) {
+        memcpy(bodies, s->bodies, sizeof(Particle) * ((s->nbody < nbody) ? s->nbody : nbody));
+    }
+    free(s->bodies);
+    s->bodies = bodies;
+    s->capacity = nbody;
+    return 1;
+}
+
 Slice *slice_copy(Slice *s) {
     Slice *new = malloc(sizeof(Slice));
     if(new == NULL) {
         return NULL;
     }
     memcpy(new, s, sizeof(Slice));
-    new->bodies = malloc(sizeof(Particle) * new->nbody);
+    new->bodies = universe_malloc(sizeof(Particle) * new->nbody, 0);
     if(new->bodies == NULL) {
         free(new);
         return NULL;
     }
+    new->capacity = new->nbody;
+    new->refs = 1;
     memcpy(new->bodies, s->bodies, sizeof(Particle) * new->nbody);
     return new;
 }
 
-int slice_pack(Slice *s) {  // Repack particles (e.g. if some have been marked to delete)
-    Particle *new = malloc(sizeof(Particle) * s->nbody);
-    if(new == NULL) {
-        printf("Memory allocation error.\n");
-        return 0;
+int slice_copy_into(Slice *dst, Slice *src) {   // Like slice_copy, but reuses dst's buffer (and keeps its scratch)
+    dst->nbody = 0;                             // Nothing worth keeping if we have to grow
+    if(!slice_reserve(dst, src->nbody, 0)) { return 0; }
+    dst->time = src->time;
+    dst->nbody = src->nbody;
+    dst->bound_min = src->bound_min;
+    dst->bound_max = src->bound_max;
+    dst->ndelete = src->ndelete;
+    memcpy(dst->bodies, src->bodies, sizeof(Particle) * src->nbody);
+    return 1;
+}
+
+void particle_copy_fields(Particle *dst, Particle *src, uint32_t fields) {    // Copy only the given PARTICLE_FIELD_*s of one particle
+    if((fields & PARTICLE_FIELD_ALL) == PARTICLE_FIELD_ALL) {
+        memcpy(dst, src, sizeof(Particle));
+        return;
     }
-    uint64_t nnew = 0;
-    
-    for(int i = 0; i < s->nbody; i++) {
-        s->bodies[i].flags &= ~PARTICLE_FLAG_CREATE;   // Remove CREATE flag.  It's actually faster to do this every time than check and remove.
-        if(s->bodies[i].flags & PARTICLE_FLAG_DELETE) { continue; }
-        memcpy(&new[nnew], &s->bodies[i], sizeof(Particle));
-        nnew++;
+    for(int f = 0; f < PARTICLE_NFIELD; f++) {
+        if(fields & _particle_layout[f].field) {
+            memcpy((char *)dst + _particle_layout[f].offset, (char *)src + _particle_layout[f].offset, _particle_layout[f].size);
+        }
     }
-    realloc(new, sizeof(Particle) * nnew);
-    if(new == NULL) {
-        printf("Memory allocation error\n");
-        return 0;
+}
+
+const ParticleField *particle_field(int k) {  // Field k (PARTICLE_FIELD_* 1 << k) of a Particle, NULL past the last one
+    return (k >= 0 && k < PARTICLE_NFIELD) ? &_particle_layout[k] : NULL;
+}
+
+int slice_copy_fields(Slice *dst, Slice *src, uint32_t fields) {  // Copy the header and only the given PARTICLE_FIELD_*s.  dst must already hold as many bodies as src.
+    if(dst->nbody != src->nbody) { return 0; }
+    if((fields & PARTICLE_FIELD_ALL) == PARTICLE_FIELD_ALL) { return slice_copy_into(dst, src); }
+    dst->time = src->time;
+    dst->bound_min = src->bound_min;
+    dst->bound_max = src->bound_max;
+    dst->ndelete = src->ndelete;
+    slice_copy_range(dst, src, fields, 0, src->nbody);
+    return 1;
+}
+
+void slice_copy_range(Slice *dst, Slice *src, uint32_t fields, uint64_t begin, uint64_t end) {    // Just the given fields of bodies [begin, end)
+    const ParticleField *layout = _particle_layout;
+    if(begin >= end) { return; }
+    if((fields & PARTICLE_FIELD_ALL) == PARTICLE_FIELD_ALL) {
+        memcpy(&dst->bodies[begin], &src->bodies[begin], sizeof(Particle) * (end - begin));
+        return;
+    }
+    size_t off[PARTICLE_NFIELD], len[PARTICLE_NFIELD];      // Merge adjacent fields into runs, so e.g. pos+vel is a single 48 byte copy
+    int nrun = 0;
+    for(int f = 0; f < PARTICLE_NFIELD; f++) {
+        if(!(fields & layout[f].field)) { continue; }
+        if(nrun > 0 && off[nrun - 1] + len[nrun - 1] == layout[f].offset) {
+            len[nrun - 1] += layout[f].size;
+        } else {
+            off[nrun] = layout[f].offset;
+            len[nrun] = layout[f].size;
+            ++nrun;
+        }
+    }
+    for(int r = 0; r < nrun; r++) {       // One pass per run with a fixed stride and word count vectorizes much better than memcpy per body
+        uint32_t *d = (uint32_t *)((char *)&dst->bodies[begin] + off[r]);
+        const uint32_t *p = (const uint32_t *)((const char *)&src->bodies[begin] + off[r]);
+        size_t nword = len[r] / sizeof(uint32_t), stride = sizeof(Particle) / sizeof(uint32_t);
+        for(uint64_t i = begin; i < end; i++, d += stride, p += stride) {
+            for(size_t w = 0; w < nword; w++) {
+                d[w] = p[w];
+            }
+        }
+    }
+}
+
+void *slice_scratch(Slice *s, size_t size) {    // Scratch memory for modules.  Valid until the end of the step, don't free it.
+    if(s->scratch == NULL) { return NULL; }
+    return arena_alloc(s->scratch, size);
+}
+
+int slice_pack(Slice *s) {  // Repack particles in place (e.g. if some have been marked to delete).  Order is kept.
+    uint64_t nnew = 0, i = 0;
+    while(i < s->nbody) {
+        if(s->bodies[i].flags & PARTICLE_FLAG_DELETE) { ++i; continue; }
+        uint64_t j = i;                                 // Move whole runs of survivors at once
+        while(j < s->nbody && !(s->bodies[j].flags & PARTICLE_FLAG_DELETE)) {
+            s->bodies[j].flags &= ~PARTICLE_FLAG_CREATE;    // Remove CREATE flag.  It's actually faster to do this every time than check and remove.
+            ++j;
+        }
+        if(nnew != i) {
+            memmove(&s->bodies[nnew], &s->bodies[i], sizeof(Particle) * (j - i));
+        }
+        nnew += j - i;
+        i = j;
     }
     s->nbody = nnew;
-    free(s->bodies);
-    s->bodies = new;
+    s->ndelete = 0;
     return 1;
 }
 
+uint64_t slice_count_deleted(Slice *s) {
+    uint64_t n = 0;
+    for(uint64_t i = 0; i < s->nbody; i++) {
+        n += (s->bodies[i].flags & PARTICLE_FLAG_DELETE) ? 1 : 0;
+    }
+    return n;
+}
+
+// A stratified sample of s by index: the middle one of every stride live bodies, copied to dst (which needs room for
+// s->nbody / stride + 1).  Returns how many.
+uint64_t slice_sample(Slice *s, uint64_t stride, Particle *dst) {
+    uint64_t n = 0, k = 0;
+    for(uint64_t i = 0; i < s->nbody; i++) {
+        if(s->bodies[i].flags & PARTICLE_FLAG_DELETE) { continue; }
+        if(k++ % stride == stride / 2) { dst[n++] = s->bodies[i]; }
+    }
+    return n;
+}
+
 void slice_clear_create(Slice *s) {
     for(int i = 0; i < s->nbody; i++) {
         s->bodies[i].flags &= ~PARTICLE_FLAG_CREATE;   // Remove CREATE flag.  It's actually faster to do this every time than check and remove.
     }
 }
 
+int slice_append_particles(Slice *s, Particle *p, uint64_t n) {    // Append n bodies.  Capacity grows geometrically, so appends are amortized O(1).
+    if(s->nbody + n > s->capacity) {
+        uint64_t capacity = (s->capacity < 16) ? 16 : s->capacity;
+        while(capacity < s->nbody + n) { capacity *= 2; }
+        if(!slice_reserve(s, capacity, 0)) { return 0; }
+    }
+    memcpy(&s->bodies[s->nbody], p, sizeof(Particle) * n);
+    s->nbody += n;
+    return 1;
+}
+
 int slice_append_particle(Slice *s, Particle *p) {
-    ++s->nbody;
-    s->bodies = realloc(s->bodies, sizeof(Particle) * s->nbody);
-    memcpy(&s->bodies[s->nbody-1], p, sizeof(Particle));
-    return 0;
+    return slice_append_particles(s, p, 1);
 }
 
-Universe *universe_create(const char *path) {
+// Where sym -l writes the level of detail companion of the universe file at path: out.univ -> out.lod.univ (anything
+// else just gets .lod.univ added).  Free it when done.  NULL on allocation failure.
+char *universe_lod_path(const char *path) {
+    size_t len = strlen(path);
+    char *lod = malloc(len + 10);
+    if(lod == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    if(len > 5 && strcmp(&path[len - 5], ".univ") == 0) { len -= 5; }
+    sprintf(lod, "%.*s.lod.univ", (int)len, path);
+    return lod;
+}
+
+static long _header_size(uint32_t version) {
+    return sizeof(UniverseHeader) + ((version >= 2) ? sizeof(long) : 0);
+}
+
+// Read and check the header at the start of u's file, setting u->version.  *first_block gets version 2's (0 for
+// version 1).  Returns 0 if it isn't a universe this version of SymUniverse can read.
+static int _read_header(Universe *u, UniverseHeader *header, long *first_block) {
+    *first_block = 0;
+    if(fread(header, sizeof(UniverseHeader), 1, u->fstream) != 1 ||
+       strncmp(header->string, UNIVERSE_STRING, sizeof(header->string)) != 0) {
+        printf("%s does not appear to be a valid Universe Data File!\n", u->path);
+        return 0;
+    } else if(header->version < 1 || header->version > UNIVERSE_VERSION_COLUMNAR) {
+        printf("Universe Data File version mismatch.  File is %d, we can read up to %d.\n", header->version, UNIVERSE_VERSION_COLUMNAR);
+        return 0;
+    } else if(header->version >= 2 && fread(first_block, sizeof(long), 1, u->fstream) != 1) {
+        printf("%s does not appear to be a valid Universe Data File!\n", u->path);
+        return 0;
+    }
+    u->version = header->version;
+    return 1;
+}
+
+// Load a version 2 index by following its blocks from first_block.  Returns 0 on failure.
+static int _read_blocks(Universe *u, long first_block) {
+    UniverseIndexBlock b;
+    u->block = 0;
+    if((u->slice_idx = malloc(sizeof(long) * (u->nslice > 0 ? u->nslice : 1))) == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    for(uint64_t n = 0; n < u->nslice; n += UNIVERSE_BLOCK_SLICES) {
+        long pos = (n == 0) ? first_block : b.next;
+        if(pos <= 0 || fseek(u->fstream, pos, SEEK_SET) != 0 || fread(&b, sizeof(UniverseIndexBlock), 1, u->fstream) != 1) {
+            printf("The index of %s is cut short.\n", u->path);
+            free(u->slice_idx);
+            return 0;
+        }
+        uint64_t k = u->nslice - n;
+        memcpy(&u->slice_idx[n], b.slice_pos, sizeof(long) * ((k < UNIVERSE_BLOCK_SLICES) ? k : UNIVERSE_BLOCK_SLICES));
+        u->block = pos;
+    }
+    return 1;
+}
+
+// Bytes the given columns of a version 3 slice take up.  With fields = f - 1, that's where column f starts.
+uint64_t universe_columns_size(uint64_t nbody, uint32_t constant, uint32_t fields) {
+    uint64_t size = 0;
+    if(nbody == 0) { return 0; }
+    for(int k = 0; k < PARTICLE_NFIELD; k++) {
+        if(fields & _particle_layout[k].field) {
+            size += _particle_layout[k].size * ((constant & _particle_layout[k].field) ? 1 : nbody);
+        }
+    }
+    return size;
+}
+
+static int _skip(FILE *f, long n) {     // Skip n bytes, even where f can't seek.  Returns 0 if there aren't that many.
+    char buf[4096];
+    if(fseek(f, n, SEEK_CUR) == 0) { return 1; }
+    while(n > 0) {
+        size_t k = fread(buf, 1, (n < (long)sizeof(buf)) ? n : sizeof(buf), f);
+        if(k == 0) { return 0; }
+        n -= k;
+    }
+    return 1;
+}
+
+// Read the columns of a version 3 slice at the current position into s's bodies: the ones in fields, skipping the
+// others (which are left as they are).  Returns 0 on failure.
+static int _read_columns(FILE *f, Slice *s, uint32_t constant, uint32_t fields) {
+    char *buf = malloc(sizeof(Vector) * _COLUMN_CHUNK);
+    int ok = (buf != NULL);
+    if(buf == NULL) { printf("Memory allocation error.\n"); }
+    for(int k = 0; ok && s->nbody > 0 && k < PARTICLE_NFIELD; k++) {
+        const ParticleField *pf = &_particle_layout[k];
+        uint64_t n = (constant & pf->field) ? 1 : s->nbody;
+        if(!(fields & pf->field)) {
+            ok = _skip(f, pf->size * n);
+        } else if(n == 1) {                     // The same for every body
+            ok = (fread(buf, pf->size, 1, f) == 1);
+            for(uint64_t i = 0; ok && i < s->nbody; i++) { memcpy((char *)&s->bodies[i] + pf->offset, buf, pf->size); }
+        } else {
+            for(uint64_t i = 0; ok && i < n; i += _COLUMN_CHUNK) {
+                uint64_t m = (n - i < _COLUMN_CHUNK) ? n - i : _COLUMN_CHUNK;
+                ok = (fread(buf, pf->size, m, f) == m);
+                for(uint64_t j = 0; ok && j < m; j++) { memcpy((char *)&s->bodies[i + j] + pf->offset, buf + pf->size * j, pf->size); }
+            }
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+// The slice at the current position, free it with slice_free.  Only the given PARTICLE_FIELD_*s are read from version 3
+// slices, the others are 0.  NULL on failure, or (setting at_end) if the data ends cleanly right there.
+static Slice *_read_slice(Universe *u, uint32_t fields) {
+    Slice *s = malloc(sizeof(Slice));
+    if(s == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    size_t n = fread(&s->time, 1, _SLICE_HEADER_SIZE, u->fstream);
+    if(n != _SLICE_HEADER_SIZE) {
+        if(n == 0 && feof(u->fstream)) {
+            u->at_end = 1;
+        } else {
+            printf("Could not read a slice of %s, it's cut short.\n", u->path);
+        }
+        free(s);
+        return NULL;
+    }
+    s->capacity = s->nbody;
+    s->scratch = NULL;
+    s->refs = 1;
+    s->ndelete = 0;
+    
+    UniverseColumns c;
+    if(u->version >= UNIVERSE_VERSION_COLUMNAR && fread(&c, sizeof(UniverseColumns), 1, u->fstream) != 1) {
+        printf("Could not read slice %llu of %s, it's cut short.\n", (unsigned long long)s->time, u->path);
+        free(s);
+        return NULL;
+    }
+    s->bodies = universe_malloc(sizeof(Particle)*s->nbody, 0);
+    if(s->bodies == NULL) {
+        printf("Memory allocation error.\n");
+        free(s);
+        return NULL;
+    }
+    if(u->version >= UNIVERSE_VERSION_COLUMNAR) {
+        if(fields != PARTICLE_FIELD_ALL) { memset(s->bodies, 0, sizeof(Particle) * s->nbody); }
+        n = _read_columns(u->fstream, s, c.constant, fields) ? s->nbody : 0;
+    } else {
+        n = fread(s->bodies, sizeof(Particle), s->nbody, u->fstream);
+    }
+    if(n != s->nbody) {
+        printf("Could not read slice %llu of %s, it's cut short.\n", (unsigned long long)s->time, u->path);
+        slice_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+// Find the slices of a stream that was written to a file, by walking their headers.  A slice cut short at the end
+// (its writer is still at it, or died) is left out.  slice_idx[nslice] is where the whole ones end.  Returns 0 on failure.
+static int _index_stream(Universe *u) {
+    struct stat st;
+    Slice h;
+    long pos = _header_size(u->version);
+    uint64_t size = 16;
+    u->is_stream = 1;
+    u->nslice = 0;
+    if(fstat(fileno(u->fstream), &st) != 0 || (u->slice_idx = malloc(sizeof(long) * size)) == NULL) {
+        printf("Could not index %s.\n", u->path);
+        return 0;
+    }
+    while(fseek(u->fstream, pos, SEEK_SET) == 0 && fread(&h.time, _SLICE_HEADER_SIZE, 1, u->fstream) == 1) {
+        long end = pos + _SLICE_HEADER_SIZE + h.nbody * sizeof(Particle);
+        if(u->version >= UNIVERSE_VERSION_COLUMNAR) {
+            UniverseColumns c;
+            if(fread(&c, sizeof(UniverseColumns), 1, u->fstream) != 1) { break; }
+            end = pos + _SLICE_HEADER_SIZE + sizeof(UniverseColumns) + universe_columns_size(h.nbody, c.constant, PARTICLE_FIELD_ALL);
+        }
+        if(end > st.st_size) { break; }
+        if(u->nslice + 2 > size) {
+            size *= 2;
+            long *idx = realloc(u->slice_idx, sizeof(long) * size);
+            if(idx == NULL) {
+                printf("Memory allocation error.\n");
+                free(u->slice_idx);
+                return 0;
+            }
+            u->slice_idx = idx;
+        }
+        u->slice_idx[u->nslice++] = pos;
+        pos = end;
+    }
+    u->slice_idx[u->nslice] = pos;
+    return 1;
+}
+
+static Universe *_create(const char *path, uint32_t version) {
     UniverseHeader header;
     Universe *u = malloc(sizeof(Universe));
     if(u == NULL) {
@@ -123,7 +607,12 @@ Universe *universe_create(const char *path) {
     }
     u->is_open = 1;
     u->is_modified = 0;
+    u->version = version;
+    u->is_stream = 0;
+    u->at_end = 0;
     u->nslice = 0;
+    u->next = 0;
+    u->block = 0;
     u->slice_idx = calloc(1, sizeof(long));
     if(u->slice_idx == NULL) {
         printf("Memory allocation error.\n");
@@ -131,13 +620,19 @@ Universe *universe_create(const char *path) {
         return NULL;
     }
     strncpy(header.string, UNIVERSE_STRING, sizeof(header.string));
-    header.version = UNIVERSE_VERSION;
+    header.version = version;
     header.nslice = 0;
+    long first_block = 0;                       // No index blocks until there's a slice
     fwrite(&header, sizeof(UniverseHeader), 1, u->fstream);
+    fwrite(&first_block, sizeof(long), 1, u->fstream);
     
     return u;
 }
 
+Universe *universe_create(const char *path) {
+    return _create(path, UNIVERSE_VERSION);
+}
+
 Universe *universe_open(const char *path) {
     UniverseHeader header;
     Universe *u = malloc(sizeof(Universe));
@@ -146,6 +641,11 @@ Universe *universe_open(const char *path) {
         return NULL;
     }
     u->path = path;
+    if(universe_is_stream(path)) {
+        printf("%s is a stream, it can only be read front to back (see universe_open_stream).\n", path);
+        free(u);
+        return NULL;
+    }
     u->fstream = fopen(path, "r+");
     if(u->fstream == NULL) {
         printf("Could not open universe file, %s, because: %s\n", path, strerror(errno));
@@ -154,17 +654,33 @@ Universe *universe_open(const char *path) {
     }
     u->is_open = 1;
     u->is_modified = 0;
-    fread(&header, sizeof(UniverseHeader), 1, u->fstream);
-    if(strncmp(header.string, UNIVERSE_STRING, sizeof(header.string)) != 0) {
-        printf("%s does not appear to be a valid Universe Data File!\n", path);
-        free(u);
-        return NULL;
-    } else if(header.version != UNIVERSE_VERSION) {
-        printf("Universe Data File version mismatch.  File is %d, we need %d.\n", header.version, UNIVERSE_VERSION);
+    u->is_stream = 0;
+    u->at_end = 0;
+    u->next = 0;
+    u->block = 0;
+    long first_block;
+    if(!_read_header(u, &header, &first_block)) {
+        fclose(u->fstream);
         free(u);
         return NULL;
     }
+    if(header.nslice == UNIVERSE_STREAM) {      // A stream that was written to a file, find its slices
+        if(!_index_stream(u)) {
+            fclose(u->fstream);
+            free(u);
+            return NULL;
+        }
+        return u;
+    }
     u->nslice = header.nslice;
+    if(u->version >= 2) {
+        if(!_read_blocks(u, first_block)) {
+            fclose(u->fstream);
+            free(u);
+            return NULL;
+        }
+        return u;
+    }
     
     u->slice_idx = malloc(sizeof(long)*u->nslice);
     if(u->slice_idx == NULL) {
@@ -195,23 +711,23 @@ int universe_free(Universe *u) {
 }
 
 Slice *universe_get_slice(Universe *u, uint64_t slice) {
-    Slice *s = malloc(sizeof(Slice));
-    if(s == NULL) {
-        printf("Memory allocation error.\n");
+    if(u->slice_idx == NULL || slice >= u->nslice) {    // Streams being read forward have no index
+        printf("%s has no slice %llu.\n", u->path, (unsigned long long)slice);
         return NULL;
     }
     fseek(u->fstream, u->slice_idx[slice], SEEK_SET);
-    fread(&s->time, sizeof(uint64_t) + sizeof(Vector), 2, u->fstream); // reads time, nbody and the two boundary vectors
-    
-    s->bodies = malloc(sizeof(Particle)*s->nbody);
-    if(s->bodies == NULL) {
-        printf("Memory allocation error.\n");
-        free(s);
+    return _read_slice(u, PARTICLE_FIELD_ALL);
+}
+
+// Like universe_get_slice, but only the given PARTICLE_FIELD_*s are read (the others are 0).  Version 3 files keep each
+// field on its own, so only those bytes are read; older ones keep whole bodies, so they all come back.
+Slice *universe_get_slice_fields(Universe *u, uint64_t slice, uint32_t fields) {
+    if(u->slice_idx == NULL || slice >= u->nslice) {
+        printf("%s has no slice %llu.\n", u->path, (unsigned long long)slice);
         return NULL;
     }
-    fread(s->bodies, sizeof(Particle), s->nbody, u->fstream);
-    
-    return s;
+    fseek(u->fstream, u->slice_idx[slice], SEEK_SET);
+    return _read_slice(u, fields);
 }
 
 Slice *universe_get_first_slice(Universe *u) {
@@ -219,15 +735,116 @@ Slice *universe_get_first_slice(Universe *u) {
 }
 
 Slice *universe_get_last_slice(Universe *u) {
+    if(u->nslice == 0 || u->nslice == UNIVERSE_STREAM) {
+        printf("%s has no slices.\n", u->path);
+        return NULL;
+    }
     return universe_get_slice(u, u->nslice - 1);
 }
 
-int universe_append_slice(Universe *u, Slice *s) {
+// Version 3: the slice header, which columns are constant, then the columns.  Like _write_slice, deleted bodies are
+// only left out when packing them was put off (ndelete), otherwise they're written as they are.  Returns 0 on failure.
+static int _write_columns(FILE *f, Slice *s) {
+    Slice live = *s;
+    UniverseColumns c = { PARTICLE_FIELD_ALL, 0 };
+    Particle *first = NULL;
+    uint32_t skip = (s->ndelete > 0) ? PARTICLE_FLAG_DELETE : 0;  // Flags of bodies to leave out
+    live.nbody = s->nbody - s->ndelete;
+    for(uint64_t i = 0; c.constant != 0 && i < s->nbody; i++) {   // Which columns are the same all the way down
+        if(s->bodies[i].flags & skip) { continue; }
+        if(first == NULL) {
+            first = &s->bodies[i];
+            continue;
+        }
+        for(int k = 0; k < PARTICLE_NFIELD; k++) {
+            const ParticleField *pf = &_particle_layout[k];
+            if((c.constant & pf->field) && memcmp((char *)&s->bodies[i] + pf->offset, (char *)first + pf->offset, pf->size) != 0) {
+                c.constant &= ~pf->field;
+            }
+        }
+    }
+    if(fwrite(&live.time, _SLICE_HEADER_SIZE, 1, f) != 1 || fwrite(&c, sizeof(UniverseColumns), 1, f) != 1) {
+        return 0;
+    } else if(first == NULL) {
+        return 1;
+    }
+    char *buf = malloc(sizeof(Vector) * _COLUMN_CHUNK);
+    int ok = (buf != NULL);
+    if(buf == NULL) { printf("Memory allocation error.\n"); }
+    for(int k = 0; ok && k < PARTICLE_NFIELD; k++) {
+        const ParticleField *pf = &_particle_layout[k];
+        if(c.constant & pf->field) {
+            ok = (fwrite((char *)first + pf->offset, pf->size, 1, f) == 1);
+            continue;
+        }
+        uint64_t m = 0;
+        for(uint64_t i = 0; ok && i < s->nbody; i++) {      // Gathered a chunk at a time
+            if(s->bodies[i].flags & skip) { continue; }
+            memcpy(buf + pf->size * m++, (char *)&s->bodies[i] + pf->offset, pf->size);
+            if(m == _COLUMN_CHUNK) {
+                ok = (fwrite(buf, pf->size, m, f) == m);
+                m = 0;
+            }
+        }
+        ok = ok && (fwrite(buf, pf->size, m, f) == m);
+    }
+    free(buf);
+    return ok;
+}
+
+static int _write_slice(Universe *u, Slice *s) {    // At the current position, in u's version.  Returns 0 on failure.
+    FILE *f = u->fstream;
+    if(u->version >= UNIVERSE_VERSION_COLUMNAR) {
+        return _write_columns(f, s);
+    } else if(s->ndelete == 0) {
+        return fwrite(&s->time, _SLICE_HEADER_SIZE, 1, f) == 1 && fwrite(s->bodies, sizeof(Particle), s->nbody, f) == s->nbody;
+    }
+    Slice live = *s;                                // Packing was put off, so leave the deleted bodies out as we go
+    live.nbody = s->nbody - s->ndelete;
+    int ok = (fwrite(&live.time, _SLICE_HEADER_SIZE, 1, f) == 1);
+    for(uint64_t i = 0; ok && i < s->nbody; ) {
+        if(s->bodies[i].flags & PARTICLE_FLAG_DELETE) { ++i; continue; }
+        uint64_t j = i;
+        while(j < s->nbody && !(s->bodies[j].flags & PARTICLE_FLAG_DELETE)) { ++j; }
+        ok = (fwrite(&s->bodies[i], sizeof(Particle), j - i, f) == j - i);
+        i = j;
+    }
+    return ok;
+}
+
+static int _append_stream(Universe *u, Slice *s) {
+    if(u->slice_idx != NULL) {                      // A stream file from universe_open: slice_idx[nslice] is where its data ends
+        fseek(u->fstream, u->slice_idx[u->nslice], SEEK_SET);
+        if(!u->is_modified) {                       // Drop anything after that (a slice whoever wrote it didn't finish)
+            fflush(u->fstream);
+            if(ftruncate(fileno(u->fstream), u->slice_idx[u->nslice]) != 0) {
+                printf("Could not truncate %s, because: %s\n", u->path, strerror(errno));
+                return 0;
+            }
+            u->is_modified = 1;
+        }
+        long *idx = realloc(u->slice_idx, sizeof(long) * (u->nslice + 2));
+        if(idx == NULL) {
+            printf("Memory allocation error.\n");
+            return 0;
+        }
+        u->slice_idx = idx;
+    }
+    if(!_write_slice(u, s) || fflush(u->fstream) != 0) {     // Flushed, so readers downstream see whole slices right away
+        printf("Could not write to %s, because: %s\n", u->path, strerror(errno));
+        return 0;
+    }
+    ++u->nslice;
+    if(u->slice_idx != NULL) { u->slice_idx[u->nslice] = ftell(u->fstream); }
+    return 1;
+}
+
+static int _append_v1(Universe *u, Slice *s) {     // Rewrites the whole index after the new slice, every time
     ++u->nslice;
     
     UniverseHeader header;
     strncpy(header.string, UNIVERSE_STRING, sizeof(header.string));
-    header.version = UNIVERSE_VERSION;
+    header.version = u->version;
     header.nslice = u->nslice;
     
     rewind(u->fstream);
@@ -241,9 +858,197 @@ int universe_append_slice(Universe *u, Slice *s) {
     fseek(u->fstream, -(sizeof(long)*(u->nslice - 1)), SEEK_END);
     u->slice_idx[u->nslice - 1] = ftell(u->fstream);
     
-    fwrite(&s->time, sizeof(uint64_t) + sizeof(Vector), 2, u->fstream); // writes time, nbody and the two boundary vectors
-    fwrite(s->bodies, sizeof(Particle), s->nbody, u->fstream);
+    _write_slice(u, s);
     fwrite(u->slice_idx, sizeof(long), u->nslice, u->fstream);
     
     return 1;
 }
+
+int universe_append_slice(Universe *u, Slice *s) {
+    if(u->is_stream) {
+        return _append_stream(u, s);
+    } else if(u->version < 2) {
+        return _append_v1(u, s);
+    }
+    long *idx = realloc(u->slice_idx, sizeof(long) * (u->nslice + 1));
+    if(idx == NULL) {
+        printf("Memory allocation error.\n");
+        return 0;
+    }
+    u->slice_idx = idx;
+    fseek(u->fstream, 0, SEEK_END);
+    if(u->nslice % UNIVERSE_BLOCK_SLICES == 0) {   // The last block is full (or there isn't one), start another
+        static const UniverseIndexBlock empty;
+        long block = ftell(u->fstream);
+        fwrite(&empty, sizeof(UniverseIndexBlock), 1, u->fstream);
+        fseek(u->fstream, (u->block > 0) ? u->block : (long)UNIVERSE_FIRST_BLOCK_POS, SEEK_SET);   // Link it in
+        fwrite(&block, sizeof(long), 1, u->fstream);
+        u->block = block;
+        fseek(u->fstream, 0, SEEK_END);
+    }
+    long pos = ftell(u->fstream);
+    int ok = _write_slice(u, s);
+    
+    // Only once the slice is all there: its index entry, then the count that makes it part of the file
+    fseek(u->fstream, u->block + sizeof(long) * (1 + u->nslice % UNIVERSE_BLOCK_SLICES), SEEK_SET);
+    ok = ok && fwrite(&pos, sizeof(long), 1, u->fstream) == 1;
+    u->slice_idx[u->nslice++] = pos;
+    UniverseHeader header;
+    strncpy(header.string, UNIVERSE_STRING, sizeof(header.string));
+    header.version = u->version;
+    header.nslice = u->nslice;
+    rewind(u->fstream);
+    ok = ok && fwrite(&header, sizeof(UniverseHeader), 1, u->fstream) == 1;
+    if(!ok) {
+        printf("Could not write to %s, because: %s\n", u->path, strerror(errno));
+    }
+    return ok;
+}
+
+int universe_is_stream(const char *path) {     // Can only be read or written front to back: UNIVERSE_STDIO or a FIFO
+    struct stat st;
+    return strcmp(path, UNIVERSE_STDIO) == 0 || (stat(path, &st) == 0 && S_ISFIFO(st.st_mode));
+}
+
+// Keep stdout for universe_create_stream(UNIVERSE_STDIO), and point stdout at stderr, so nothing printed afterwards
+// can end up in the stream.  Call it before printing anything.  Returns 0 on failure.
+int universe_claim_stdout(void) {
+    if(_stdout_fd >= 0) { return 1; }
+    fflush(stdout);
+    if((_stdout_fd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        printf("Could not move stdout out of the way, because: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+static Universe *_create_stream(const char *path, uint32_t version) {
+    UniverseHeader header;
+    Universe *u = calloc(1, sizeof(Universe));
+    if(u == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    u->path = path;
+    if(strcmp(path, UNIVERSE_STDIO) == 0) {
+        int fd = dup((_stdout_fd >= 0) ? _stdout_fd : STDOUT_FILENO);
+        u->fstream = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    } else if(!universe_is_stream(path) && !access(path, W_OK)) {
+        printf("Cannot create universe file: file already exists!\n");
+        free(u);
+        return NULL;
+    } else {
+        u->fstream = fopen(path, "w");
+    }
+    if(u->fstream == NULL) {
+        printf("Could not open universe stream, %s, because: %s\n", path, strerror(errno));
+        free(u);
+        return NULL;
+    }
+    u->is_open = 1;
+    u->is_stream = 1;
+    u->version = version;
+    strncpy(header.string, UNIVERSE_STRING, sizeof(header.string));
+    header.version = version;
+    header.nslice = UNIVERSE_STREAM;
+    long first_block = 0;
+    if(fwrite(&header, sizeof(UniverseHeader), 1, u->fstream) != 1 || fwrite(&first_block, sizeof(long), 1, u->fstream) != 1 ||
+       fflush(u->fstream) != 0) {
+        printf("Could not write to %s, because: %s\n", path, strerror(errno));
+        fclose(u->fstream);
+        free(u);
+        return NULL;
+    }
+    return u;
+}
+
+// A universe that's only ever appended to, with no index (see the top of universe.h).  path is UNIVERSE_STDIO for
+// stdout, a FIFO, or a file that doesn't exist yet.
+Universe *universe_create_stream(const char *path) {
+    return _create_stream(path, UNIVERSE_VERSION);
+}
+
+// A new version 3 universe, its slices stored a column at a time (see the top of universe.h).  path can be a stream
+// (see universe_is_stream), then it's one of those.
+Universe *universe_create_columnar(const char *path) {
+    if(universe_is_stream(path)) {
+        return _create_stream(path, UNIVERSE_VERSION_COLUMNAR);
+    }
+    return _create(path, UNIVERSE_VERSION_COLUMNAR);
+}
+
+// Open a universe to read front to back with universe_next_slice, without seeking: UNIVERSE_STDIO for stdin, a FIFO,
+// or any universe file (streams or not).
+Universe *universe_open_stream(const char *path) {
+    UniverseHeader header;
+    Universe *u = calloc(1, sizeof(Universe));
+    if(u == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    u->path = path;
+    u->fstream = (strcmp(path, UNIVERSE_STDIO) == 0) ? stdin : fopen(path, "r");
+    if(u->fstream == NULL) {
+        printf("Could not open universe file, %s, because: %s\n", path, strerror(errno));
+        free(u);
+        return NULL;
+    }
+    u->is_open = 1;
+    u->is_stream = 1;
+    long first_block;
+    if(!_read_header(u, &header, &first_block)) {
+        fclose(u->fstream);
+        free(u);
+        return NULL;
+    }
+    u->nslice = header.nslice;                  // Indexed files' slices are back to back too, bar version 2's index blocks
+    return u;
+}
+
+// The next slice of a universe from universe_open_stream, free it with slice_free.  NULL at the end (then at_end is
+// set) or on failure.
+Slice *universe_next_slice(Universe *u) {
+    if(u->next >= u->nslice) {
+        u->at_end = 1;
+        return NULL;
+    }
+    if(u->version >= 2 && u->nslice != UNIVERSE_STREAM && u->next % UNIVERSE_BLOCK_SLICES == 0 &&
+       !_skip(u->fstream, sizeof(UniverseIndexBlock))) {    // Every block is right before the slice that starts it
+        printf("Could not read slice %llu of %s, it's cut short.\n", (unsigned long long)u->next, u->path);
+        return NULL;
+    }
+    Slice *s = _read_slice(u, PARTICLE_FIELD_ALL);
+    if(s != NULL) { ++u->next; }
+    return s;
+}
+
+// The last slice of any universe, stream or not (reading all of a stream to get to it).  NULL on failure.
+Slice *universe_read_last_slice(const char *path) {
+    Slice *last = NULL, *s;
+    if(!universe_is_stream(path)) {
+        Universe *u = universe_open(path);
+        if(u == NULL) {
+            return NULL;
+        }
+        last = universe_get_last_slice(u);
+        universe_close(u);
+        universe_free(u);
+        return last;
+    }
+    Universe *u = universe_open_stream(path);
+    if(u == NULL) {
+        return NULL;
+    }
+    while((s = universe_next_slice(u)) != NULL) {
+        if(last != NULL) { slice_free(last); }
+        last = s;
+    }
+    if(!u->at_end || last == NULL) {
+        if(u->at_end) { printf("%s has no slices.\n", path); }
+        if(last != NULL) { slice_free(last); }
+        last = NULL;
+    }
+    universe_close(u);
+    universe_free(u);
+    return last;
+}
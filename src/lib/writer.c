@@ -0,0 +1,129 @@
+//
+//  writer.c
+//  SymUniverse - Background thread that appends slices to a universe file.
+//
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "writer.h"
+#include "SymUniverseConfig.h"
+
+static void *_writer_thread(void *arg) {
+    UniverseWriter *w = (UniverseWriter *)arg;
+    
+    pthread_mutex_lock(&w->lock);
+    while(1) {
+        while(w->count == 0 && !w->shutdown) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if(w->count == 0) { break; }            // Shut down, and there's nothing left to write
+        int n = w->count;                       // Write everything queued so far in one go
+        int error = w->error;
+        pthread_mutex_unlock(&w->lock);
+        
+        for(int k = 0; k < n; k++) {            // Slices go out in the order they were pushed
+            WriterItem *it = &w->queue[(w->head + k) % w->depth];
+            if(!error && !universe_append_slice(it->universe, it->slice)) { error = 1; }
+            slicepool_put(it->pool, it->slice);
+        }
+        
+        pthread_mutex_lock(&w->lock);
+        w->error = error;
+        w->head = (w->head + n) % w->depth;
+        w->count -= n;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+UniverseWriter *writer_create(Universe *u, SlicePool *pool, int depth) {
+    if(depth < 1) { depth = 1; }
+    UniverseWriter *w = calloc(1, sizeof(UniverseWriter));
+    if(w == NULL) {
+        printf("Memory allocation error.\n");
+        return NULL;
+    }
+    w->universe = u;
+    w->pool = pool;
+    w->depth = depth;
+    w->queue = malloc(sizeof(WriterItem) * depth);
+    if(w->queue == NULL) {
+        printf("Memory allocation error.\n");
+        free(w);
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if(pthread_create(&w->thread, NULL, _writer_thread, (void *)w)) {
+        printf("Failed to create pthread.\n");
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        free(w->queue);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+int writer_push(UniverseWriter *w, Slice *s) {  // Queue s for writing, blocking while the queue is full.  Returns 0 if writing has failed.
+    return writer_push_to(w, w->universe, w->pool, s);
+}
+
+int writer_push_to(UniverseWriter *w, Universe *u, SlicePool *pool, Slice *s) {    // writer_push to u, releasing s to pool
+    slice_hold(s);
+    pthread_mutex_lock(&w->lock);
+    while(w->count == w->depth && !w->error) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if(w->error) {
+        pthread_mutex_unlock(&w->lock);
+        slicepool_put(pool, s);
+        return 0;
+    }
+    WriterItem *it = &w->queue[(w->head + w->count) % w->depth];
+    it->universe = u;
+    it->pool = pool;
+    it->slice = s;
+    ++w->count;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return 1;
+}
+
+int writer_wait(UniverseWriter *w, Slice *s) {  // Wait until s, and so everything pushed before it, is on disk.  Returns 0 if writing has failed.
+    pthread_mutex_lock(&w->lock);
+    while(slice_shared(s)) {                // Other universes may keep the queue busy, so don't wait for it to empty
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    int ok = !w->error;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+int writer_drain(UniverseWriter *w) {   // Wait until everything pushed so far is on disk.  Returns 0 if writing has failed.
+    pthread_mutex_lock(&w->lock);
+    while(w->count > 0) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    int ok = !w->error;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+int writer_free(UniverseWriter *w) {    // Drain, then stop the thread.  Returns 0 if writing has failed.
+    if(w == NULL) { return 1; }
+    pthread_mutex_lock(&w->lock);
+    w->shutdown = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);      // The thread only exits once the queue is empty
+    int ok = !w->error;
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w->queue);
+    free(w);
+    return ok;
+}
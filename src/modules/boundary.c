@@ -51,11 +51,14 @@ static const char *_opt_str[_NOPT] = { "boundary" };
 EXPORT
 const char *name = "boundary";      // Name _must_ be unique
 
+EXPORT
+const int abi_version = MODULE_ABI_VERSION;
+
 typedef struct {
     int (*boundary_method)(Slice *s, Particle *p);
 } Config;
 
-int _get_opt_idx(const char *opt_str) {
+static int _get_opt_idx(const char *opt_str) {
     for(int i = 0; i < _NOPT; i++) {
         if(strcmp(opt_str, _opt_str[i]) == 0) { return i; }
     }
@@ -134,11 +137,26 @@ void help(void) {
 }
 
 EXPORT
-int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
+void fields(Config *cfg, ModuleFields *f) {  // Particle fields exec touches, so sym can avoid copying the rest
+    f->ps_read = 0;
+    f->s_read = PARTICLE_FIELD_FLAGS | PARTICLE_FIELD_POS | PARTICLE_FIELD_VEL;
+    f->s_write = PARTICLE_FIELD_POS | PARTICLE_FIELD_VEL | (cfg->boundary_method == boundary_diffuse ? PARTICLE_FIELD_FLAGS : 0);
+    f->s_set = 0;
+    f->s_accum = 0;
+    f->reach = MODULE_REACH_SELF;
+}
+
+EXPORT
+int exec_range(Config *cfg, Slice *ps, Slice *s, uint64_t begin, uint64_t end) {  // exec for bodies [begin, end), lets sym fuse us with neighbouring O(N) modules
     int ret = MOD_RET_OK;
-    for(int i = 0; i < s->nbody; i++) {
+    for(uint64_t i = begin; i < end; i++) {
         if(s->bodies[i].flags & PARTICLE_FLAG_DELETE) { continue; }
         ret |= cfg->boundary_method(s, &s->bodies[i]);
     }
-    return ret;                             // Return value can control flow of overall execution, see MOD_RET_*
+    return ret;
+}
+
+EXPORT
+int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
+    return exec_range(cfg, ps, s, 0, s->nbody);  // Return value can control flow of overall execution, see MOD_RET_*
 }
@@ -0,0 +1,531 @@
+//
+//  bvhcollide.c
+//  SymUniverse - Module for swept sphere collision detection with a bounding volume hierarchy (LBVH).
+//
+//
+
+// -- MODULE RULES (these MUST be followed for consistency) --
+// 1. Do not modify ps.  It's there for consistency only.
+// 2. Do not define cfg globally.  Different pipeline instances keep track of different cfgs.
+// 3. Never shrink p.  If you want to delete a particle, mark it with PARTICLE_FLAG_DELETE and return MOD_RET_PACK.  Packing will take care of it later.
+// 4. If you want to add a particle, append it to the end and mark it with PARTICLE_FLAG_CREATE. (Or use helper int slice_append_particle(Slice *s, Particle *p))
+// 5. If you open or allocate anything globally, clean it up in the finalizer.
+
+// -- MODULE GUIDELINES (these should probably be followed) --
+// 1. help() should give a full description of the module, module options, and where it should be placed in the pipeline.
+// 2. The standard format for cfg_str should be a comma delimated list of either binary options or option=value pairs, e.g. option1,option2=value2,etc.
+// 3. Avoid global allocations if possible.
+// 4. Only perform more than one transformation if doing so has significant optimization, otherwise write a seperate module.
+// 5. You should probably check for and ignore any particle marked PARTICLE_FLAG_DELETE.
+// 6. You can safely assume that any particle not marked PARTICLE_FLAG_CREATE has a one-to-one correspondence in ps, and visa verse.
+// 7. If you detect a fundamental error (e.g. bad physics like superluminal particles), print an informative message and return MOD_RET_ABRT.
+// 8. _Anything_ you print should be prefixed with "[module_name] ".
+// 9. Force modules should have an option whether or not to zero acceleration before computing.  They should default to no.
+// 10. Major optimizations should have separate modules, e.g. a standard serial version, an OpenMP parallel version, a AMR version, etc.
+// 11. There's nothing wrong with modules having their own modules, if it makes sense.
+// 12. Use existing helper functions when dealing with Universes and their inhabitants.  This keeps code/data structures consistent. (see universe.h)
+// 13. Report asymptotic algorithm performance in help(), e.g. O(NlogN), O(N^2), O(N), etc.
+
+// -- FINAL NOTE: A module can do just about anything.  Be clear to the user what to expect.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sym.h"
+#include "universe.h"
+#include "collisions.h"
+#include "threadpool.h"
+#include "SymUniverseConfig.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define DEFAULT_TC 1
+#define DEFAULT_METHOD collision_resolve_point
+
+#define _MORTON_BITS        21      // Bits per axis; 3 * 21 = 63 bit codes
+#define _STACK_SIZE         128     // Tree depth is bounded by the 63 code bits + 64 tie-break bits, in practice far less
+#define _TASKS_PER_THREAD   4
+#define _INFLATE            2.0     // Swept boxes are padded by _INFLATE * radius (see _swept_box)
+
+EXPORT
+const char *name = "bvhcollide";      // Name _must_ be unique
+
+EXPORT
+const int abi_version = MODULE_ABI_VERSION;
+
+typedef struct {
+    int                 tc;
+    ThreadPool          *pool;
+    CollisionResolver   resolve;
+} Config;
+
+typedef struct {
+    Vector  min;
+    Vector  max;
+} Box;
+
+typedef struct {                    // Leaf sort key
+    uint64_t    code;               // Morton code of the box centre
+    uint64_t    body;               // Index into s->bodies
+} Leaf;
+
+typedef struct {                    // Candidate pairs found by a single traversal task
+    CollisionPair   *pairs;
+    uint64_t        npair;
+    uint64_t        size;
+    int             err;
+} PairList;
+
+// Linear BVH (Karras 2012).  Internal nodes are [0, n - 1), leaf k is node n - 1 + k, the root is node 0.
+typedef struct {
+    Slice       *ps;
+    Slice       *s;
+    double      ts;
+    uint64_t    n;
+    uint64_t    *active;            // Bodies taking part, in index order
+    Leaf        *leaf;              // Sorted by (code, body)
+    Box         *box;               // 2n - 1 node boxes
+    Box         *cbox;              // Per task centroid bounds, then the overall bounds in cbox[0]
+    int64_t     *left;              // Internal node children
+    int64_t     *right;
+    uint64_t    *last;              // Last leaf covered by an internal node (first is always the node itself or lower)
+    int64_t     *parent;            // 2n - 1 parents, -1 for the root
+    int         *visits;            // Refit arrival counters
+    int         ntask;
+    PairList    *lists;
+} Tree;
+
+__attribute__((constructor))
+static void initializer(void) {             // Called when module is opened (dlopen)
+    
+}
+
+__attribute__((destructor))
+static void finalizer(void) {               // Called when module is closed (dlclose)
+    
+}
+
+EXPORT
+void *init(char *cfg_str) {                 // Called when added to the pipeline.  Note: the pipeline can have multiple instances of a module with different cfg.
+    Config *cfg;
+    if((cfg = malloc(sizeof(Config))) == NULL) {
+        printf("Memory allocation failure.\n");
+        return NULL;
+    }
+    cfg->tc = DEFAULT_TC;
+    cfg->resolve = DEFAULT_METHOD;
+
+    while(cfg_str != NULL && cfg_str[0] != '\0') {
+        char *val = strsep(&cfg_str, ",");
+        char *opt = strsep(&val, "=");
+        if(strcmp(opt, "tc") == 0 && val != NULL) {
+            cfg->tc = atoi(val);
+            if(cfg->tc < 1) {
+                MPRINTF("Thread count must be at least 1!\n", NULL);
+                free(cfg);
+                return NULL;
+            }
+        } else if(strcmp(opt, "method") == 0 && val != NULL) {
+            if(strcmp(val, "point") == 0) {
+                cfg->resolve = collision_resolve_point;
+            } else if(strcmp(val, "sphere") == 0) {
+                cfg->resolve = collision_resolve_sphere;
+            } else {
+                MPRINTF("method must take one of the options: point or sphere.\n", NULL);
+                free(cfg);
+                return NULL;
+            }
+        } else {
+            MPRINTF("Option not recognized! See help (-h) for options.\n", NULL);
+            free(cfg);
+            return NULL;
+        }
+    }
+
+    if((cfg->pool = threadpool_create(cfg->tc)) == NULL) {
+        MPRINTF("Failed to create thread pool.\n", NULL);
+        free(cfg);
+        return NULL;
+    }
+    return (void *)cfg;                     // This void pointer refers to internal configuration.  Can be anything useful.
+}
+
+EXPORT
+void deinit(Config *cfg) {                    // Called when pipeline is deconstructed.
+    threadpool_free(cfg->pool);
+    free(cfg);
+}
+
+EXPORT
+void help(void) {
+    MPRINTF("This module detects and resolves collisions using a bounding volume hierarchy.\n", NULL);
+    MPRINTF("Each particle is bounded by its swept sphere (previous to current position, padded by twice its radius).\n", NULL);
+    MPRINTF("The tree is a linear BVH built from Morton codes, so queries stay O(NlogN) however mixed the radii are.\n", NULL);
+    MPRINTF("Candidate pairs go through the same narrow phase as ptcollide/scollide and are resolved in conflict-free batches.\n", NULL);
+    MPRINTF("Typically this should be placed after forces and integration.\n", NULL);
+    MPRINTF("For best results, disable boundary detection in integrate and use the boundary module after this.\n", NULL);
+    MPRINTF("Available options are:\n", NULL);
+    MPRINTF("\t- tc: Set the number of worker threads (default: %d).\n", DEFAULT_TC);
+    MPRINTF("\t- method: collision resolution (default: point)\n", NULL);
+    MPRINTF("\t\t- point (as ptcollide; does not guarantee conservation of angular momentum).\n", NULL);
+    MPRINTF("\t\t- sphere (as scollide).\n", NULL);
+    MPRINTF("Example: -m bvhcollide[tc=8,method=point]\n", NULL);
+}
+
+static uint64_t _morton_expand(uint64_t v) {    // Spread the low 21 bits of v out to every third bit
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+    v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2)  & 0x1249249249249249ULL;
+    return v;
+}
+
+static uint64_t _morton_axis(double x, double min, double max) {
+    double scale = (max > min) ? (x - min) / (max - min) : 0;
+    double q = scale * ((1 << _MORTON_BITS) - 1);
+    if(q < 0) { q = 0; }
+    if(q > (1 << _MORTON_BITS) - 1) { q = (1 << _MORTON_BITS) - 1; }
+    return (uint64_t)q;
+}
+
+static int _leaf_cmp(const void *a, const void *b) {
+    const Leaf *la = a, *lb = b;
+    if(la->code != lb->code) { return (la->code < lb->code) ? -1 : 1; }
+    if(la->body != lb->body) { return (la->body < lb->body) ? -1 : 1; }
+    return 0;
+}
+
+static int _pair_cmp(const void *a, const void *b) {
+    const CollisionPair *pa = a, *pb = b;
+    if(pa->i != pb->i) { return (pa->i < pb->i) ? -1 : 1; }
+    if(pa->j != pb->j) { return (pa->j < pb->j) ? -1 : 1; }
+    return 0;
+}
+
+static inline int _box_overlap(Box *a, Box *b) {
+    return a->min.x <= b->max.x && b->min.x <= a->max.x &&
+           a->min.y <= b->max.y && b->min.y <= a->max.y &&
+           a->min.z <= b->max.z && b->min.z <= a->max.z;
+}
+
+static inline void _box_union(Box *dst, Box *a, Box *b) {
+    dst->min.x = fmin(a->min.x, b->min.x);
+    dst->min.y = fmin(a->min.y, b->min.y);
+    dst->min.z = fmin(a->min.z, b->min.z);
+    dst->max.x = fmax(a->max.x, b->max.x);
+    dst->max.y = fmax(a->max.y, b->max.y);
+    dst->max.z = fmax(a->max.z, b->max.z);
+}
+
+// Box around the swept sphere from p0 to p1.  The narrow phase moves bodies along ps->pos + s->vel * t, which is not
+// always where integrate put them, so sweep to that end point too.  It also accepts contacts that are up to R past
+// the end of the step, so pad by twice the radius to keep the broad phase conservative.
+static void _swept_box(Box *b, Particle *p0, Particle *p1, double ts) {
+    double r = _INFLATE * p1->radius;
+    Vector e;
+    e.x = p0->pos.x + p1->vel.x * ts;
+    e.y = p0->pos.y + p1->vel.y * ts;
+    e.z = p0->pos.z + p1->vel.z * ts;
+    b->min.x = fmin(fmin(p0->pos.x, p1->pos.x), e.x) - r;
+    b->min.y = fmin(fmin(p0->pos.y, p1->pos.y), e.y) - r;
+    b->min.z = fmin(fmin(p0->pos.z, p1->pos.z), e.z) - r;
+    b->max.x = fmax(fmax(p0->pos.x, p1->pos.x), e.x) + r;
+    b->max.y = fmax(fmax(p0->pos.y, p1->pos.y), e.y) + r;
+    b->max.z = fmax(fmax(p0->pos.z, p1->pos.z), e.z) + r;
+}
+
+static void _bounds_task(void *arg, int t) {    // Swept boxes for a range of bodies, and the bounds of their centres
+    Tree *tr = (Tree *)arg;
+    uint64_t lo = tr->n * t / tr->ntask;
+    uint64_t hi = tr->n * (t + 1) / tr->ntask;
+    Box *cb = &tr->cbox[t + 1];
+    cb->min.x = cb->min.y = cb->min.z = INFINITY;
+    cb->max.x = cb->max.y = cb->max.z = -INFINITY;
+    for(uint64_t k = lo; k < hi; k++) {
+        Box *b = &tr->box[tr->n - 1 + k];  // Stash in the leaf slot for now, leaves are reordered after the sort
+        _swept_box(b, &tr->ps->bodies[tr->active[k]], &tr->s->bodies[tr->active[k]], tr->ts);
+        Vector c;
+        c.x = 0.5 * (b->min.x + b->max.x);
+        c.y = 0.5 * (b->min.y + b->max.y);
+        c.z = 0.5 * (b->min.z + b->max.z);
+        Box cc = { c, c };
+        _box_union(cb, cb, &cc);
+    }
+}
+
+static void _morton_task(void *arg, int t) {
+    Tree *tr = (Tree *)arg;
+    uint64_t lo = tr->n * t / tr->ntask;
+    uint64_t hi = tr->n * (t + 1) / tr->ntask;
+    Box *cb = &tr->cbox[0];
+    for(uint64_t k = lo; k < hi; k++) {
+        Box *b = &tr->box[tr->n - 1 + k];
+        tr->leaf[k].body = tr->active[k];
+        tr->leaf[k].code = _morton_expand(_morton_axis(0.5 * (b->min.x + b->max.x), cb->min.x, cb->max.x)) << 2 |
+                           _morton_expand(_morton_axis(0.5 * (b->min.y + b->max.y), cb->min.y, cb->max.y)) << 1 |
+                           _morton_expand(_morton_axis(0.5 * (b->min.z + b->max.z), cb->min.z, cb->max.z));
+    }
+}
+
+static void _leafbox_task(void *arg, int t) {   // Recompute leaf boxes in sorted order
+    Tree *tr = (Tree *)arg;
+    uint64_t lo = tr->n * t / tr->ntask;
+    uint64_t hi = tr->n * (t + 1) / tr->ntask;
+    for(uint64_t k = lo; k < hi; k++) {
+        _swept_box(&tr->box[tr->n - 1 + k], &tr->ps->bodies[tr->leaf[k].body], &tr->s->bodies[tr->leaf[k].body], tr->ts);
+        tr->parent[tr->n - 1 + k] = -1;
+    }
+}
+
+static inline int _delta(Tree *tr, int64_t i, int64_t j) {     // Length of the common prefix of leaves i and j, -1 if out of range
+    if(j < 0 || j >= (int64_t)tr->n) { return -1; }
+    uint64_t ci = tr->leaf[i].code, cj = tr->leaf[j].code;
+    if(ci == cj) {                              // Duplicate codes: fall back on leaf position to break the tie
+        return 64 + __builtin_clzll((uint64_t)i ^ (uint64_t)j);
+    }
+    return __builtin_clzll(ci ^ cj);
+}
+
+static void _build_task(void *arg, int t) {     // Each internal node is independent (Karras 2012, algorithm 4)
+    Tree *tr = (Tree *)arg;
+    int64_t nint = tr->n - 1;
+    int64_t lo = nint * t / tr->ntask;
+    int64_t hi = nint * (t + 1) / tr->ntask;
+    for(int64_t i = lo; i < hi; i++) {
+        // Direction of the range, and its far end j
+        int d = (_delta(tr, i, i + 1) - _delta(tr, i, i - 1) >= 0) ? 1 : -1;
+        int dmin = _delta(tr, i, i - d);
+        int64_t lmax = 2;
+        while(_delta(tr, i, i + lmax * d) > dmin) { lmax *= 2; }
+        int64_t l = 0;
+        for(int64_t s = lmax / 2; s >= 1; s /= 2) {
+            if(_delta(tr, i, i + (l + s) * d) > dmin) { l += s; }
+        }
+        int64_t j = i + l * d;
+
+        // Split position
+        int dnode = _delta(tr, i, j);
+        int64_t split = 0;
+        for(int64_t div = 2; ; div *= 2) {
+            int64_t s = (l + div - 1) / div;
+            if(_delta(tr, i, i + (split + s) * d) > dnode) { split += s; }
+            if(s == 1) { break; }
+        }
+        int64_t gamma = i + split * d + ((d < 0) ? -1 : 0);
+
+        int64_t first = (i < j) ? i : j;
+        int64_t last = (i < j) ? j : i;
+        tr->left[i] = (first == gamma) ? nint + gamma : gamma;
+        tr->right[i] = (last == gamma + 1) ? nint + gamma + 1 : gamma + 1;
+        tr->last[i] = last;
+        tr->parent[tr->left[i]] = i;
+        tr->parent[tr->right[i]] = i;
+        tr->visits[i] = 0;
+    }
+}
+
+static void _refit_task(void *arg, int t) {     // Walk up from each leaf; the second child to arrive fills in the parent
+    Tree *tr = (Tree *)arg;
+    uint64_t lo = tr->n * t / tr->ntask;
+    uint64_t hi = tr->n * (t + 1) / tr->ntask;
+    for(uint64_t k = lo; k < hi; k++) {
+        int64_t node = tr->parent[tr->n - 1 + k];
+        while(node >= 0) {
+            if(__sync_fetch_and_add(&tr->visits[node], 1) == 0) { break; }
+            _box_union(&tr->box[node], &tr->box[tr->left[node]], &tr->box[tr->right[node]]);
+            __sync_synchronize();
+            node = tr->parent[node];
+        }
+    }
+}
+
+static void _query_task(void *arg, int t) {     // Stack based traversal for a run of (spatially adjacent) leaves
+    Tree *tr = (Tree *)arg;
+    PairList *pl = &tr->lists[t];
+    int64_t nint = tr->n - 1;
+    uint64_t lo = tr->n * t / tr->ntask;
+    uint64_t hi = tr->n * (t + 1) / tr->ntask;
+    int64_t stack[_STACK_SIZE];
+    Collision c;
+
+    for(uint64_t k = lo; k < hi; k++) {
+        Box *bk = &tr->box[nint + k];
+        int sp = 0;
+        stack[sp++] = 0;
+        while(sp > 0) {
+            int64_t node = stack[--sp];
+            if(!_box_overlap(&tr->box[node], bk)) { continue; }
+            if(node >= nint) {                              // Leaf
+                uint64_t m = node - nint;
+                if(m <= k) { continue; }                    // Each pair is found once, from its lower leaf
+                uint64_t i = tr->leaf[k].body, j = tr->leaf[m].body;
+                if(i > j) { uint64_t tmp = i; i = j; j = tmp; }
+                if(tr->s->bodies[i].flags & tr->s->bodies[j].flags & PARTICLE_FLAG_GHOST) { continue; }    // Both belong to other ranks
+                if(!collision_detect(tr->ps, tr->s, i, j, tr->ts, &c)) { continue; }
+                if(pl->npair == pl->size) {
+                    uint64_t size = pl->size ? pl->size * 2 : 64;
+                    CollisionPair *pairs = realloc(pl->pairs, sizeof(CollisionPair) * size);
+                    if(pairs == NULL) {
+                        pl->err = 1;
+                        return;
+                    }
+                    pl->pairs = pairs;
+                    pl->size = size;
+                }
+                pl->pairs[pl->npair].i = i;
+                pl->pairs[pl->npair].j = j;
+                ++pl->npair;
+                continue;
+            }
+            if(tr->last[node] <= k) { continue; }           // Everything below is a lower leaf
+            if(sp + 2 > _STACK_SIZE) {
+                pl->err = 2;
+                return;
+            }
+            stack[sp++] = tr->right[node];
+            stack[sp++] = tr->left[node];
+        }
+    }
+}
+
+static void _tree_free(Tree *tr) {          // Tree arrays live in the scratch arena, only the pair lists are ours
+    if(tr->lists != NULL) {
+        for(int t = 0; t < tr->ntask; t++) {
+            free(tr->lists[t].pairs);
+        }
+    }
+}
+
+// !!!: It would be nice to have a recursive, time-ordered collision detection option.
+EXPORT
+void fields(Config *cfg, ModuleFields *f) {  // Particle fields exec touches, so sym can avoid copying the rest
+    f->ps_read = PARTICLE_FIELD_POS;
+    f->s_read = PARTICLE_FIELD_FLAGS | PARTICLE_FIELD_MASS | PARTICLE_FIELD_RADIUS | PARTICLE_FIELD_POS | PARTICLE_FIELD_VEL;
+    f->s_write = PARTICLE_FIELD_POS | PARTICLE_FIELD_VEL;
+    f->s_set = 0;
+    f->s_accum = 0;
+    f->reach = MODULE_REACH_NEAR;
+}
+
+EXPORT
+int tunables(Config *cfg, uint64_t nbody, int nthread, int k, char *buf, size_t size) {  // For sym --autotune
+    int n = 0, max = (nbody < (uint64_t)nthread) ? (int)nbody : nthread;
+    int point = (cfg->resolve == collision_resolve_point);
+    while(threadpool_tune_count(max, n) > 0) { ++n; }
+    if(k < n) {                             // tc=1 first, it's the reference
+        snprintf(buf, size, "tc=%d", threadpool_tune_count(max, k));
+    } else if(k < 2 * n && point) {         // Brute force detection can win for small or very spread out slices
+        snprintf(buf, size, "ptcollide[tc=%d]", threadpool_tune_count(max, k - n));
+    } else if(k == n && !point) {
+        snprintf(buf, size, "scollide[]");
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+EXPORT
+int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
+    Tree tr;
+    memset(&tr, 0, sizeof(Tree));
+    if(s->nbody < 2) { return MOD_RET_OK; }
+    tr.ts = collision_timestep(ps, s);
+    if(!tr.ts) { return MOD_RET_OK; }  // Everything in our sym seems to be sitting still! (at least in the x direction)
+    tr.ps = ps;
+    tr.s = s;
+
+    // 1. Gather the bodies that take part
+    if((tr.active = slice_scratch(s, sizeof(uint64_t) * ps->nbody)) == NULL) {
+        MPRINTF("Memory allocation error.\n", NULL);
+        return MOD_RET_ABRT;
+    }
+    for(uint64_t i = 0; i < ps->nbody; i++) {
+        if(s->bodies[i].flags & (PARTICLE_FLAG_DELETE | PARTICLE_FLAG_CREATE)) { continue; }
+        tr.active[tr.n++] = i;
+    }
+    if(tr.n < 2) {
+        _tree_free(&tr);
+        return MOD_RET_OK;
+    }
+    tr.ntask = cfg->tc * _TASKS_PER_THREAD;
+    if(tr.ntask > tr.n - 1) { tr.ntask = (int)(tr.n - 1); }
+
+    tr.leaf = slice_scratch(s, sizeof(Leaf) * tr.n);
+    tr.box = slice_scratch(s, sizeof(Box) * (2 * tr.n - 1));
+    tr.cbox = slice_scratch(s, sizeof(Box) * (tr.ntask + 1));
+    tr.left = slice_scratch(s, sizeof(int64_t) * (tr.n - 1));
+    tr.right = slice_scratch(s, sizeof(int64_t) * (tr.n - 1));
+    tr.last = slice_scratch(s, sizeof(uint64_t) * (tr.n - 1));
+    tr.parent = slice_scratch(s, sizeof(int64_t) * (2 * tr.n - 1));
+    tr.visits = slice_scratch(s, sizeof(int) * (tr.n - 1));
+    if((tr.lists = slice_scratch(s, sizeof(PairList) * tr.ntask)) != NULL) {
+        memset(tr.lists, 0, sizeof(PairList) * tr.ntask);
+    }
+    if(tr.leaf == NULL || tr.box == NULL || tr.cbox == NULL || tr.left == NULL || tr.right == NULL ||
+       tr.last == NULL || tr.parent == NULL || tr.visits == NULL || tr.lists == NULL) {
+        MPRINTF("Memory allocation error.\n", NULL);
+        _tree_free(&tr);
+        return MOD_RET_ABRT;
+    }
+
+    // 2. Swept boxes, Morton codes of their centres, and sort
+    threadpool_run(cfg->pool, _bounds_task, &tr, tr.ntask);
+    tr.cbox[0] = tr.cbox[1];
+    for(int t = 2; t <= tr.ntask; t++) {
+        _box_union(&tr.cbox[0], &tr.cbox[0], &tr.cbox[t]);
+    }
+    threadpool_run(cfg->pool, _morton_task, &tr, tr.ntask);
+    qsort(tr.leaf, tr.n, sizeof(Leaf), _leaf_cmp);
+    threadpool_run(cfg->pool, _leafbox_task, &tr, tr.ntask);
+
+    // 3. Build the hierarchy and fit boxes bottom up
+    tr.parent[0] = -1;
+    threadpool_run(cfg->pool, _build_task, &tr, tr.ntask);
+    threadpool_run(cfg->pool, _refit_task, &tr, tr.ntask);
+
+    // 4. Traverse for every leaf, keep pairs that pass the narrow phase
+    threadpool_run(cfg->pool, _query_task, &tr, tr.ntask);
+    uint64_t npair = 0;
+    int err = 0;
+    for(int t = 0; t < tr.ntask; t++) {
+        npair += tr.lists[t].npair;
+        err |= tr.lists[t].err;
+    }
+    if(err & 2) {
+        MPRINTF("Traversal stack overflow; the tree is deeper than %d.\n", _STACK_SIZE);
+        _tree_free(&tr);
+        return MOD_RET_ABRT;
+    }
+    CollisionPair *pairs = (npair > 0) ? malloc(sizeof(CollisionPair) * npair) : NULL;
+    if(err || (npair > 0 && pairs == NULL)) {
+        MPRINTF("Memory allocation error.\n", NULL);
+        _tree_free(&tr);
+        return MOD_RET_ABRT;
+    }
+    npair = 0;
+    for(int t = 0; t < tr.ntask; t++) {
+        if(tr.lists[t].npair == 0) { continue; }
+        memcpy(&pairs[npair], tr.lists[t].pairs, sizeof(CollisionPair) * tr.lists[t].npair);
+        npair += tr.lists[t].npair;
+    }
+    _tree_free(&tr);
+    qsort(pairs, npair, sizeof(CollisionPair), _pair_cmp);
+
+    // 5. Resolve in conflict-free batches
+    CollisionStats stats;
+    if(!collision_resolve_pairs(cfg->pool, ps, s, tr.ts, pairs, npair, cfg->resolve, &stats)) {
+        MPRINTF("Memory allocation error.\n", NULL);
+        free(pairs);
+        return MOD_RET_ABRT;
+    }
+    if(stats.nfail > 0) {
+        MPRINTF("Oops, we got %llu collisions we couldn't handle.\n", (unsigned long long)stats.nfail);
+    }
+    MPRINTF("Processed %llu collisions.\n", (unsigned long long)stats.ncollide);
+
+    free(pairs);
+    return MOD_RET_OK;                      // Return value can control flow of overall execution, see MOD_RET_*
+}
@@ -41,6 +41,9 @@
 EXPORT
 const char *name = "cleara";                 // Name _must_ be unique
 
+EXPORT
+const int abi_version = MODULE_ABI_VERSION;
+
 typedef struct {
     int configed;
 } Config;
@@ -80,11 +83,26 @@ void help(void) {
 }
 
 EXPORT
-int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
-    for(int i = 0; i < s->nbody; i++) {
+void fields(Config *cfg, ModuleFields *f) {  // Particle fields exec touches, so sym can avoid copying the rest
+    f->ps_read = 0;
+    f->s_read = 0;
+    f->s_write = PARTICLE_FIELD_ACC;
+    f->s_set = PARTICLE_FIELD_ACC;
+    f->s_accum = 0;
+    f->reach = MODULE_REACH_SELF;
+}
+
+EXPORT
+int exec_range(Config *cfg, Slice *ps, Slice *s, uint64_t begin, uint64_t end) {  // exec for bodies [begin, end), lets sym fuse us with neighbouring O(N) modules
+    for(uint64_t i = begin; i < end; i++) {
         s->bodies[i].acc.x = 0;
         s->bodies[i].acc.y = 0;
         s->bodies[i].acc.z = 0;
     }
-    return MOD_RET_OK;                      // Return value can control flow of overall execution, see MOD_RET_*
+    return MOD_RET_OK;
+}
+
+EXPORT
+int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
+    return exec_range(cfg, ps, s, 0, s->nbody);  // Return value can control flow of overall execution, see MOD_RET_*
 }
@@ -41,6 +41,9 @@
 EXPORT
 const char *name = "dummy";                 // Name _must_ be unique
 
+EXPORT
+const int abi_version = MODULE_ABI_VERSION;       // Modules built against an older sym.h are turned away
+
 typedef struct {
     int configed;
 } Config;
@@ -78,6 +81,16 @@ void help(void) {
     MPRINTF("Example: -m dummy\n", NULL);
 }
 
+EXPORT
+void fields(Config *cfg, ModuleFields *f) {  // Particle fields exec touches, so sym can avoid copying the rest
+    f->ps_read = 0;
+    f->s_read = 0;
+    f->s_write = 0;
+    f->s_set = 0;
+    f->s_accum = 0;
+    f->reach = MODULE_REACH_SELF;
+}
+
 EXPORT
 int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
     return MOD_RET_OK;                      // Return value can control flow of overall execution, see MOD_RET_*
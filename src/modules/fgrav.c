@@ -47,6 +47,9 @@
 EXPORT
 const char *name = "fgrav";      // Name _must_ be unique
 
+EXPORT
+const int abi_version = MODULE_ABI_VERSION;
+
 typedef struct {
     int cleara;
     double plummer2;            // Plummer distance squared (we never use the un-squared version)
@@ -117,6 +120,16 @@ void help(void) {
     MPRINTF("Example: -m fgrav[cleara=1]\n", NULL);
 }
 
+EXPORT
+void fields(Config *cfg, ModuleFields *f) {  // Particle fields exec touches, so sym can avoid copying the rest
+    f->ps_read = 0;
+    f->s_read = PARTICLE_FIELD_FLAGS | PARTICLE_FIELD_MASS | PARTICLE_FIELD_POS;
+    f->s_write = PARTICLE_FIELD_ACC;
+    f->s_set = cfg->cleara ? PARTICLE_FIELD_ACC : 0;
+    f->s_accum = cfg->cleara ? 0 : PARTICLE_FIELD_ACC;    // Without cleara we only add to acc, so other forces can run alongside us
+    f->reach = MODULE_REACH_ALL;
+}
+
 EXPORT
 int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
     // Slightly less efficient to do this separately, but makes the code reusable later
@@ -134,6 +147,7 @@ int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps,
         if(s->bodies[i].flags & PARTICLE_FLAG_DELETE) { continue; }
         for(int j = i + 1; j < s->nbody; j++) {
             if(s->bodies[j].flags & PARTICLE_FLAG_DELETE) { continue; }
+            if(s->bodies[i].flags & s->bodies[j].flags & PARTICLE_FLAG_GHOST) { continue; }    // Both belong to other ranks
             Vector r;
             vector_sub(&r, &s->bodies[i].pos, &s->bodies[j].pos);
             double f = pow(vector_dot(&r, &r) + cfg->plummer2,-1.5);    // note: this pow() takes about 75% of total compute time
@@ -44,6 +44,9 @@
 EXPORT
 const char *name = "hscollide";      // Name _must_ be unique
 
+EXPORT
+const int abi_version = MODULE_ABI_VERSION;
+
 typedef struct {                    // Not currently used, but there for later use
     int configed;
 } Config;
@@ -58,13 +58,16 @@ static const char *_opt_str[_NOPT] = { "boundary", "method", "timestep" };
 EXPORT
 const char *name = "integrate";      // Name _must_ be unique
 
+EXPORT
+const int abi_version = MODULE_ABI_VERSION;
+
 typedef struct {
     int (*boundary_method)(Slice *s, Particle *p);
     int (*integration_method)(Particle *p, double ts);
     double timestep;
 } Config;
 
-int _integrate_pre(Particle *p, double ts) {
+static int _integrate_pre(Particle *p, double ts) {
     p->pos.x += p->vel.x * ts;
     p->pos.y += p->vel.y * ts;
     p->pos.z += p->vel.z * ts;
@@ -74,7 +77,7 @@ int _integrate_pre(Particle *p, double ts) {
     return MOD_RET_OK;
 }
 
-int _integrate_leapfrog(Particle *p, double ts) {
+static int _integrate_leapfrog(Particle *p, double ts) {
     p->vel.x += p->acc.x * ts;
     p->vel.y += p->acc.y * ts;
     p->vel.z += p->acc.z * ts;
@@ -84,7 +87,7 @@ int _integrate_leapfrog(Particle *p, double ts) {
     return MOD_RET_OK;
 }
 
-int _get_opt_idx(const char *opt_str) {
+static int _get_opt_idx(const char *opt_str) {
     for(int i = 0; i < _NOPT; i++) {
         if(strcmp(opt_str, _opt_str[i]) == 0) { return i; }
     }
@@ -188,12 +191,27 @@ void help(void) {
 }
 
 EXPORT
-int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
+void fields(Config *cfg, ModuleFields *f) {  // Particle fields exec touches, so sym can avoid copying the rest
+    f->ps_read = 0;
+    f->s_read = PARTICLE_FIELD_FLAGS | PARTICLE_FIELD_POS | PARTICLE_FIELD_VEL | PARTICLE_FIELD_ACC;
+    f->s_write = PARTICLE_FIELD_POS | PARTICLE_FIELD_VEL | (cfg->boundary_method == boundary_diffuse ? PARTICLE_FIELD_FLAGS : 0);
+    f->s_set = 0;
+    f->s_accum = 0;
+    f->reach = MODULE_REACH_SELF;
+}
+
+EXPORT
+int exec_range(Config *cfg, Slice *ps, Slice *s, uint64_t begin, uint64_t end) {  // exec for bodies [begin, end), lets sym fuse us with neighbouring O(N) modules
     int ret = MOD_RET_OK;
-    for(int i = 0; i < s->nbody; i++) {
+    for(uint64_t i = begin; i < end; i++) {
         if(s->bodies[i].flags & PARTICLE_FLAG_DELETE) { continue; }
         ret |= cfg->integration_method(&s->bodies[i], cfg->timestep);
         ret |= cfg->boundary_method(s, &s->bodies[i]);
     }
-    return ret;                             // Return value can control flow of overall execution, see MOD_RET_*
+    return ret;
+}
+
+EXPORT
+int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
+    return exec_range(cfg, ps, s, 0, s->nbody);  // Return value can control flow of overall execution, see MOD_RET_*
 }
@@ -37,6 +37,7 @@
 #include <pthread.h>
 #include "sym.h"
 #include "universe.h"
+#include "threadpool.h"
 #include "SymUniverseConfig.h"
 
 #define EXPORT __attribute__((visibility("default")))
@@ -44,14 +45,19 @@
 #define DEFAULT_CLEARA 0
 #define DEFAULT_PLUMMER2 0      // Used to impose a "Plummer sphere".  Shouldn't be needed if we're doing hscollide.
 #define DEFAULT_TC 1            // Default thread count (number of worker threads)
+#define DEFAULT_PIN THREADPOOL_PIN_NONE
 
 EXPORT
 const char *name = "pfgrav";      // Name _must_ be unique
 
+EXPORT
+const int abi_version = MODULE_ABI_VERSION;
+
 typedef struct {
     int cleara;
     double plummer2;            // Plummer distance squared (we never use the un-squared version)
     int tc;
+    int pin;                    // THREADPOOL_PIN_* for the worker threads
 } Config;
 
 __attribute__((constructor))
@@ -75,6 +81,7 @@ void *init(char *cfg_str) {                 // Called when added to the pipeline
     cfg->cleara = DEFAULT_CLEARA;
     cfg->plummer2 = DEFAULT_PLUMMER2;
     cfg->tc = DEFAULT_TC;
+    cfg->pin = DEFAULT_PIN;
 
     while(cfg_str != NULL && cfg_str[0] != '\0') {
         char *val = strsep(&cfg_str, ",");
@@ -95,6 +102,18 @@ void *init(char *cfg_str) {                 // Called when added to the pipeline
                 free(cfg);
                 return NULL;
             }
+        } else if(strcmp(opt, "pin") == 0) {
+            if(val != NULL && strcmp(val, "compact") == 0) {
+                cfg->pin = THREADPOOL_PIN_COMPACT;
+            } else if(val != NULL && strcmp(val, "scatter") == 0) {
+                cfg->pin = THREADPOOL_PIN_SCATTER;
+            } else if(val != NULL && strcmp(val, "none") == 0) {
+                cfg->pin = THREADPOOL_PIN_NONE;
+            } else {
+                MPRINTF("Option pin accepts only compact, scatter or none!\n", NULL);
+                free(cfg);
+                return NULL;
+            }
         } else {
             MPRINTF("Option not recognized! See help (-h) for options.\n", NULL);
             free(cfg);
@@ -125,18 +144,23 @@ void help(void) {
     MPRINTF("\t\tThis shouldn't be necessary if we're using particles with physical size, e.g. hscollide.\n", NULL);
     MPRINTF("\t- tc: Set the number of worker threads.\n", NULL);
     MPRINTF("\t\tThis takes an integer value.  The default is 1, so this should probably always be set.\n", NULL);
+    MPRINTF("\t- pin: Pin the worker threads to CPUs (see sym -A).\n", NULL);
+    MPRINTF("\t\tcompact fills one NUMA node before the next, scatter goes round robin over them.  The default is none.\n", NULL);
     MPRINTF("Example: -m pfgrav[cleara=1,tc=8]\n", NULL);
 }
 
 typedef struct {
     int     id;
+    int     cpu;                // To pin to, -1 for none
     Config  *cfg;
     Slice   *s;
     Vector  *a;
 } ThreadConfig;
 
-void *_thread_exec(void *cfg) {
+static void *_thread_exec(void *cfg) {
     ThreadConfig tcfg = *(ThreadConfig *)cfg;
+    if(tcfg.cpu >= 0) { threadpool_pin(tcfg.cpu); }
+    memset(tcfg.a, 0, sizeof(Vector) * tcfg.s->nbody);     // Our own copy, so zero (first touch) it here, on our node
     
     // Some brute force round robbining
     int loops = tcfg.s->nbody / tcfg.cfg->tc;
@@ -147,6 +171,7 @@ void *_thread_exec(void *cfg) {
         if(tcfg.s->bodies[c].flags & PARTICLE_FLAG_DELETE) { continue; }
         for(int j = c + 1; j < tcfg.s->nbody; j++) {
             if(tcfg.s->bodies[j].flags & PARTICLE_FLAG_DELETE) { continue; }
+            if(tcfg.s->bodies[c].flags & tcfg.s->bodies[j].flags & PARTICLE_FLAG_GHOST) { continue; }    // Both belong to other ranks
             Vector r;
             vector_sub(&r, &tcfg.s->bodies[c].pos, &tcfg.s->bodies[j].pos);
             double f = pow(vector_dot(&r, &r) + tcfg.cfg->plummer2,-1.5);    // note: this pow() takes about 75% of total compute time
@@ -162,24 +187,32 @@ void *_thread_exec(void *cfg) {
     pthread_exit(NULL);
 }
 
+EXPORT
+void fields(Config *cfg, ModuleFields *f) {  // Particle fields exec touches, so sym can avoid copying the rest
+    f->ps_read = 0;
+    f->s_read = PARTICLE_FIELD_FLAGS | PARTICLE_FIELD_MASS | PARTICLE_FIELD_POS;
+    f->s_write = PARTICLE_FIELD_ACC;
+    f->s_set = cfg->cleara ? PARTICLE_FIELD_ACC : 0;
+    f->s_accum = cfg->cleara ? 0 : PARTICLE_FIELD_ACC;    // Without cleara we only add to acc, so other forces can run alongside us
+    f->reach = MODULE_REACH_ALL;
+}
+
+EXPORT
+int tunables(Config *cfg, uint64_t nbody, int nthread, int k, char *buf, size_t size) {  // For sym --autotune: tc=1 (the reference), 2, 4 ...
+    int max = (nbody < (uint64_t)nthread) ? (int)nbody : nthread;
+    if(threadpool_tune_count(max, k) == 0) { return 0; }
+    snprintf(buf, size, "tc=%d", threadpool_tune_count(max, k));
+    return 1;
+}
+
 EXPORT
 int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
-    pthread_t *threads = malloc(sizeof(pthread_t) * cfg->tc);
-    if(threads == NULL) {
-        MPRINTF("Memory allocation error.\n", NULL);
-        return MOD_RET_ABRT;
-    }
+    // Per-step buffers come from the slice's scratch arena, so there's nothing to free
+    pthread_t *threads = slice_scratch(s, sizeof(pthread_t) * cfg->tc);
     pthread_attr_t attr;
-    Vector *a = calloc(s->nbody * cfg->tc, sizeof(Vector));  // All (replicated) accelerations.  This is a little messy and a memory hog.
-    if(a == NULL) {
-        MPRINTF("Memory allocation error.\n", NULL);
-        free(threads);
-        return MOD_RET_ABRT;
-    }
-    ThreadConfig *thread_cfg = malloc(sizeof(ThreadConfig) * cfg->tc);
-    if(thread_cfg == NULL) {
-        free(threads);
-        free(a);
+    Vector *a = slice_scratch(s, sizeof(Vector) * s->nbody * cfg->tc);  // All (replicated) accelerations.  This is a little messy and a memory hog.
+    ThreadConfig *thread_cfg = slice_scratch(s, sizeof(ThreadConfig) * cfg->tc);
+    if(threads == NULL || a == NULL || thread_cfg == NULL) {
         MPRINTF("Memory allocation error.\n", NULL);
         return MOD_RET_ABRT;
     }
@@ -197,15 +230,15 @@ int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps,
     // Start the threads
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    ThreadTopology *topology = threadpool_topology();
     for(int i = 0; i < cfg->tc; i++) {
         thread_cfg[i].cfg = cfg;
         thread_cfg[i].id = i;
+        thread_cfg[i].cpu = threadpool_pin_cpu(topology, cfg->pin, i);
         thread_cfg[i].a = &a[i * s->nbody];
         thread_cfg[i].s = s;
         if(pthread_create(&threads[i], &attr, _thread_exec, (void *)&thread_cfg[i])) {
             MPRINTF("Failed to create pthread.\n", NULL);
-            free(thread_cfg);
-            free(threads);
             return MOD_RET_ABRT;
         }
     }
@@ -226,9 +259,6 @@ int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps,
         }
     }
     
-    free(a);
-    free(thread_cfg);
-    free(threads);
     //pthread_exit(NULL);
     return MOD_RET_OK;                      // Return value can control flow of overall execution, see MOD_RET_*
 }
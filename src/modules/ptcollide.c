@@ -30,24 +30,48 @@
 
 // -- FINAL NOTE: A module can do just about anything.  Be clear to the user what to expect.
 
-// FIXME: This module doesn't do anything yet!
-
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "sym.h"
 #include "universe.h"
+#include "collisions.h"
+#include "threadpool.h"
 #include "SymUniverseConfig.h"
 
 #define EXPORT __attribute__((visibility("default")))
 
+#define DEFAULT_TC 1            // Default thread count.  tc > 1 switches to batched parallel resolution.
+#define _TASKS_PER_THREAD 4     // Detection rows are interleaved over tc * _TASKS_PER_THREAD tasks to balance the triangle
+
 EXPORT
 const char *name = "ptcollide";      // Name _must_ be unique
 
-typedef struct {                    // Not currently used, but there for later use
-    int configed;
+EXPORT
+const int abi_version = MODULE_ABI_VERSION;
+
+typedef struct {
+    int         tc;
+    ThreadPool  *pool;
 } Config;
 
+typedef struct {                    // Candidate pairs found by a single detection task
+    CollisionPair   *pairs;
+    uint64_t        npair;
+    uint64_t        size;
+    int             err;
+} PairList;
+
+typedef struct {                    // Shared state for parallel detection
+    Slice           *ps;
+    Slice           *s;
+    double          ts;
+    int             ntask;
+    CollisionSoA    *soa;
+    PairList        *lists;         // One list per task
+} DetectState;
+
 __attribute__((constructor))
 static void initializer(void) {             // Called when module is opened (dlopen)
     
@@ -65,126 +89,189 @@ void *init(char *cfg_str) {                 // Called when added to the pipeline
         printf("Memory allocation failure.\n");
         return NULL;
     }
-    cfg->configed = 1;
+    cfg->tc = DEFAULT_TC;
+    cfg->pool = NULL;
+
+    while(cfg_str != NULL && cfg_str[0] != '\0') {
+        char *val = strsep(&cfg_str, ",");
+        char *opt = strsep(&val, "=");
+        if(strcmp(opt, "tc") == 0 && val != NULL) {
+            cfg->tc = atoi(val);
+            if(cfg->tc < 1) {
+                MPRINTF("Thread count must be at least 1!\n", NULL);
+                free(cfg);
+                return NULL;
+            }
+        } else {
+            MPRINTF("Option not recognized! See help (-h) for options.\n", NULL);
+            free(cfg);
+            return NULL;
+        }
+    }
+
+    if(cfg->tc > 1 && (cfg->pool = threadpool_create(cfg->tc)) == NULL) {
+        MPRINTF("Failed to create thread pool.\n", NULL);
+        free(cfg);
+        return NULL;
+    }
     return (void *)cfg;                     // This void pointer refers to internal configuration.  Can be anything useful.
 }
 
 EXPORT
 void deinit(Config *cfg) {                    // Called when pipeline is deconstructed.
+    threadpool_free(cfg->pool);
     free(cfg);
 }
 
 EXPORT
 void help(void) {
-    MPRINTF("This module resolves hard sphere collisions.\n", NULL);
-    MPRINTF("This simple algorithm is O(N^2), and takes no options.\n", NULL);
+    MPRINTF("This module resolves point-like collisions.\n", NULL);
+    MPRINTF("Warning: this modules does NOT guarantee conservation of angular momentum.\n", NULL);
+    MPRINTF("This simple algorithm is O(N^2).\n", NULL);
     MPRINTF("Typically this should be placed after forces and integration.\n", NULL);
     MPRINTF("For best results, disable boundary detection in integrate and use the boundary module after this.\n", NULL);
+    MPRINTF("There is one available option:\n", NULL);
+    MPRINTF("\t- tc: Set the number of worker threads (default: %d).\n", DEFAULT_TC);
+    MPRINTF("\t\tWith tc > 1, candidate pairs are detected in parallel, split into conflict-free batches\n", NULL);
+    MPRINTF("\t\tand each batch is resolved concurrently.  Results are deterministic and independent of tc,\n", NULL);
+    MPRINTF("\t\tbut may differ slightly from tc=1: pairs that only start colliding after an earlier resolution\n", NULL);
+    MPRINTF("\t\tin the same step are not picked up until the next step.\n", NULL);
+    MPRINTF("Example: -m ptcollide[tc=8]\n", NULL);
+}
+
+static int _pair_cmp(const void *a, const void *b) {
+    const CollisionPair *pa = a, *pb = b;
+    if(pa->i != pb->i) { return (pa->i < pb->i) ? -1 : 1; }
+    if(pa->j != pb->j) { return (pa->j < pb->j) ? -1 : 1; }
+    return 0;
+}
+
+static void _detect_task(void *arg, int t) {  // Broad + narrow phase over rows t, t + ntask, ...  Read-only on the slices.
+    DetectState *st = (DetectState *)arg;
+    PairList *l = &st->lists[t];
+    Collision c;
+    for(uint64_t i = t; i < st->ps->nbody; i += st->ntask) {
+        if(st->s->bodies[i].flags & (PARTICLE_FLAG_DELETE | PARTICLE_FLAG_CREATE | PARTICLE_FLAG_GHOST)) { continue; }  // Ghosts come last, so j would be one too
+        for(uint64_t j = i+1; j < st->ps->nbody; j += COLLISION_LANES) {
+            unsigned m = collision_filter(st->soa, i, j, st->ts);
+            while(m) {                      // Only the survivors see the scalar narrow phase
+                uint64_t k = j + __builtin_ctz(m);
+                m &= m - 1;
+                if(!collision_detect(st->ps, st->s, i, k, st->ts, &c)) { continue; }
+                if(l->npair == l->size) {
+                    uint64_t size = l->size ? l->size * 2 : 64;
+                    CollisionPair *pairs = realloc(l->pairs, sizeof(CollisionPair) * size);
+                    if(pairs == NULL) {
+                        l->err = 1;
+                        return;
+                    }
+                    l->pairs = pairs;
+                    l->size = size;
+                }
+                l->pairs[l->npair].i = i;
+                l->pairs[l->npair].j = k;
+                ++l->npair;
+            }
+        }
+    }
+}
+
+static int _exec_parallel(Config *cfg, Slice *ps, Slice *s, double ts) {
+    DetectState st;
+    CollisionSoA soa;
+    st.ps = ps;
+    st.s = s;
+    st.ts = ts;
+    st.soa = &soa;
+    st.ntask = cfg->tc * _TASKS_PER_THREAD;
+    if(!collision_soa_load(&soa, ps, s)) {
+        MPRINTF("Memory allocation error.\n", NULL);
+        return MOD_RET_ABRT;
+    }
+    if((st.lists = slice_scratch(s, sizeof(PairList) * st.ntask)) == NULL) {
+        MPRINTF("Memory allocation error.\n", NULL);
+        return MOD_RET_ABRT;
+    }
+    memset(st.lists, 0, sizeof(PairList) * st.ntask);
+
+    // 1. Find candidate pairs in parallel, then put them back in serial (i, j) order
+    threadpool_run(cfg->pool, _detect_task, &st, st.ntask);
+    uint64_t npair = 0;
+    int err = 0;
+    for(int t = 0; t < st.ntask; t++) {
+        npair += st.lists[t].npair;
+        err |= st.lists[t].err;
+    }
+    CollisionPair *pairs = (npair > 0) ? malloc(sizeof(CollisionPair) * npair) : NULL;
+    if(err || (npair > 0 && pairs == NULL)) {
+        err = 1;
+    } else {
+        npair = 0;
+        for(int t = 0; t < st.ntask; t++) {
+            if(st.lists[t].npair == 0) { continue; }
+            memcpy(&pairs[npair], st.lists[t].pairs, sizeof(CollisionPair) * st.lists[t].npair);
+            npair += st.lists[t].npair;
+        }
+        qsort(pairs, npair, sizeof(CollisionPair), _pair_cmp);
+    }
+    for(int t = 0; t < st.ntask; t++) {
+        free(st.lists[t].pairs);
+    }
+
+    // 2. Resolve them in conflict-free batches
+    CollisionStats stats;
+    if(err || !collision_resolve_pairs(cfg->pool, ps, s, ts, pairs, npair, collision_resolve_point, &stats)) {
+        MPRINTF("Memory allocation error.\n", NULL);
+        free(pairs);
+        return MOD_RET_ABRT;
+    }
+    MPRINTF("Processed %llu collisions in %llu batches.\n", (unsigned long long)stats.ncollide, (unsigned long long)stats.nbatch);
+
+    free(pairs);
+    return MOD_RET_OK;
 }
 
 // !!!: It would be nice to have a recursive, time-ordered collision detection option.
-// FIXME: This algorithm is not yet implemented!
+EXPORT
+void fields(Config *cfg, ModuleFields *f) {  // Particle fields exec touches, so sym can avoid copying the rest
+    f->ps_read = PARTICLE_FIELD_POS;
+    f->s_read = PARTICLE_FIELD_FLAGS | PARTICLE_FIELD_MASS | PARTICLE_FIELD_RADIUS | PARTICLE_FIELD_POS | PARTICLE_FIELD_VEL;
+    f->s_write = PARTICLE_FIELD_POS | PARTICLE_FIELD_VEL;
+    f->s_set = 0;
+    f->s_accum = 0;
+    f->reach = MODULE_REACH_NEAR;
+}
+
+EXPORT
+int tunables(Config *cfg, uint64_t nbody, int nthread, int k, char *buf, size_t size) {  // For sym --autotune
+    int n = 0, max = (nbody < (uint64_t)nthread) ? (int)nbody : nthread;
+    while(threadpool_tune_count(max, n) > 0) { ++n; }
+    if(k < n) {                             // tc=1 first, it's the reference
+        snprintf(buf, size, "tc=%d", threadpool_tune_count(max, k));
+    } else if(k < 2 * n) {                  // The same point resolution, with O(NlogN) detection
+        snprintf(buf, size, "bvhcollide[tc=%d]", threadpool_tune_count(max, k - n));
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
 EXPORT
 int exec(Config *cfg, Slice *ps, Slice *s) {  // Main execution loop.  Maps (ps, s) -> s.  Should _not_ modify ps.  Uses cfg to specify pipeline params.
-    Vector p, pp, v;
-    double ts = 0;
     if(s->nbody < 1) { return MOD_RET_OK; }
-    for(int i = 0; i < ps->nbody; i++) {    // A little odd.  Basically, we want to account for the fact that some particles may have zero v.x;
-        if(s->bodies[i].vel.x == 0) { continue; }
-        ts = (s->bodies[i].pos.x - ps->bodies[i].pos.x) / s->bodies[i].vel.x; // Reverse engineer the timestep.  Only need to do this once.
-        break;
-    }
+    double ts = collision_timestep(ps, s);
     if(!ts) { return MOD_RET_OK; }  // Everything in our sym seems to be sitting still! (at least in the x direction)
-    
-    int ccount = 0;
-    for(int i = 0; i < ps->nbody; i++) {
-        if(s->bodies[i].flags & (PARTICLE_FLAG_DELETE | PARTICLE_FLAG_CREATE)) { continue; }
-        for(int j = i+1; j < ps->nbody; j++) {
-            if(s->bodies[j].flags & (PARTICLE_FLAG_DELETE | PARTICLE_FLAG_CREATE)) { continue; }
-            
-            // 1. move into the rest frame of body i
-            vector_sub(&p, &s->bodies[j].pos, &ps->bodies[i].pos);
-            vector_sub(&pp, &ps->bodies[j].pos, &ps->bodies[i].pos);
-            vector_sub(&v, &s->bodies[j].vel, &s->bodies[i].vel);
-            
-            // TODO 1b. early collision elimination
-            //if(0) { continue; }
-            
-            // 2. move to scattering frame
-            double v2 = vector_dot(&v, &v);
-            if(v2 == 0) { continue; }
-            double t0 = - vector_dot(&v, &pp) / (v2 * ts);  // time to perpendicular bisector to infinite line defined by pp -> p
-
-            Vector chi;                                     // vector defining bisector
-            chi.x = v.x * t0 + pp.x;
-            chi.y = v.y * t0 + pp.y;
-            chi.z = v.z * t0 + pp.z;
-            double b = sqrt(vector_dot(&chi, &chi));        // impact parameter
-            double R = s->bodies[i].radius + s->bodies[j].radius;
-            if(b > R) { continue; }  // definitely don't collide
-            
-            double vel = sqrt(v2);                          // note: this is always >= 0
-            double xi = - vel * t0;
-            if(xi >= 0) { continue; }                        // particle is moving away
-            double xf = vel * (ts - t0);
-            if(xf < - R) { continue; }
-            
-            // 3. past this point, we know there's a collision
-            ++ccount;
-            double tc = - (xi + R) / vel;                   // time of collision
-            double v1f = 2 * s->bodies[j].mass / (s->bodies[j].mass + s->bodies[i].mass) * vel;
-            double v2f = (s->bodies[j].mass - s->bodies[i].mass) / (s->bodies[j].mass + s->bodies[i].mass) * vel;
-            double x1f = v1f * (ts - tc);
-            double x2f = v2f * (ts - tc) - R;
-            
-            // 4. return to sym frame
-            if(b != 0) {
-                Vector ux, uy; //,uz;      // together as a row matrix, these give the inverse rotation matrix. (uz is unused)
-                ux.x = v.x / vel;
-                ux.y = v.y / vel;
-                ux.z = v.z / vel;
-                uy.x = chi.x / b;
-                uy.y = chi.y / b;
-                uy.z = chi.z / b;
-                // vector_cross(&uz, &ux, &uy);
-                // rotate + translate in one step
-                s->bodies[j].pos.x = x2f * ux.x + b * uy.x + s->bodies[i].pos.x;
-                s->bodies[j].pos.y = x2f * ux.y + b * uy.y + s->bodies[i].pos.y;
-                s->bodies[j].pos.z = x2f * ux.z + b * uy.z + s->bodies[i].pos.z;
-                s->bodies[i].pos.x += x1f * ux.x;
-                s->bodies[i].pos.y += x1f * ux.y;
-                s->bodies[i].pos.z += x1f * ux.z;
-                
-                s->bodies[j].vel.x = v2f * ux.x + s->bodies[i].vel.x;
-                s->bodies[j].vel.y = v2f * ux.y + s->bodies[i].vel.y;
-                s->bodies[j].vel.z = v2f * ux.z + s->bodies[i].vel.z;
-                s->bodies[i].vel.x += v1f * ux.x;
-                s->bodies[i].vel.y += v1f * ux.y;
-                s->bodies[i].vel.z += v1f * ux.z;
-            } else {                    // in the off chance b = 0, we have a divide by zero, we have to do things differently
-                Vector uv;
-                uv.x = v.x / vel;       // Both position & velocity will lie relative to the velocity unit vector
-                uv.y = v.y / vel;
-                uv.z = v.z / vel;
-                
-                s->bodies[j].pos.x = x2f * uv.x + s->bodies[i].pos.x;
-                s->bodies[j].pos.y = x2f * uv.y + s->bodies[i].pos.y;
-                s->bodies[j].pos.z = x2f * uv.z + s->bodies[i].pos.z;
-                s->bodies[i].pos.x += x1f * uv.x;
-                s->bodies[i].pos.y += x1f * uv.y;
-                s->bodies[i].pos.z += x1f * uv.z;
-                s->bodies[j].vel.x = v2f * uv.x + s->bodies[i].vel.x;
-                s->bodies[j].vel.y = v2f * uv.y + s->bodies[i].vel.y;
-                s->bodies[j].vel.z = v2f * uv.z + s->bodies[i].vel.z;
-                s->bodies[i].vel.x += v1f * uv.x;
-                s->bodies[i].vel.y += v1f * uv.y;
-                s->bodies[i].vel.z += v1f * uv.z;
-            }
-            
-        }
+
+    if(cfg->tc > 1) {
+        return _exec_parallel(cfg, ps, s, ts);
     }
-    
-    MPRINTF("Processed %d collisions.\n", ccount);
+
+    CollisionStats stats;
+    if(!collision_resolve_all(ps, s, ts, collision_resolve_point, &stats)) {
+        MPRINTF("Memory allocation error.\n", NULL);
+        return MOD_RET_ABRT;
+    }
+    MPRINTF("Processed %llu collisions.\n", (unsigned long long)stats.ncollide);
     
     return MOD_RET_OK;                      // Return value can control flow of overall execution, see MOD_RET_*
 }
@@ -0,0 +1,284 @@
+//
+//  reduce.c
+//  SymUniverse - In-situ analysis plug-in (sym -a) writing global reductions of every slice to a time series.
+//
+//
+
+// -- ANALYSIS PLUG-IN RULES --
+// 1. Never modify s, the step loop is still reading it.  Don't keep it past analyze either, it's recycled afterwards.
+// 2. analyze runs on a thread of its own, concurrently with the pipeline (but never with itself).
+// 3. Skip bodies marked PARTICLE_FLAG_DELETE, they're only still there because packing was put off.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "sym.h"
+#include "universe.h"
+#include "SymUniverseConfig.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define DEFAULT_FILE        "reduce.dat"
+#define DEFAULT_EVERY       1
+#define DEFAULT_CONTACTS    1
+
+#define _NOPT           3
+#define _OPT_FILE       0
+#define _OPT_EVERY      1
+#define _OPT_CONTACTS   2
+
+static const char *_opt_str[_NOPT] = { "file", "every", "contacts" };
+
+EXPORT
+const char *name = "reduce";        // Name _must_ be unique
+
+EXPORT
+const int abi_version = MODULE_ABI_VERSION;
+
+typedef struct {
+    FILE        *f;
+    int         every;
+    int         contacts;
+    uint64_t    seen;               // Slices given so far
+    uint64_t    size;               // Contact search buffers, kept between slices
+    uint64_t    *idx;               // Bodies taking part
+    int64_t     *cell;              // ... their grid cells (x, y, z each)
+    uint64_t    *order;             // ... sorted by grid bucket (as indices into idx)
+    uint64_t    nbucket;
+    uint64_t    *start;             // order[start[b] .. start[b + 1] - 1] are in bucket b
+} Config;
+
+static int _get_opt_idx(const char *opt_str) {
+    for(int i = 0; i < _NOPT; i++) {
+        if(strcmp(opt_str, _opt_str[i]) == 0) { return i; }
+    }
+    return -1;
+}
+
+__attribute__((constructor))
+static void initializer(void) {             // Called when module is opened (dlopen)
+
+}
+
+__attribute__((destructor))
+static void finalizer(void) {               // Called when module is closed (dlclose)
+
+}
+
+EXPORT
+void *init(char *cfg_str) {                 // Called when sym starts the plug-in.  Every instance has its own cfg (and file).
+    Config *cfg;
+    const char *file = DEFAULT_FILE;
+    if((cfg = calloc(1, sizeof(Config))) == NULL) {
+        printf("Memory allocation failure.\n");
+        return NULL;
+    }
+    cfg->every = DEFAULT_EVERY;
+    cfg->contacts = DEFAULT_CONTACTS;
+
+    while(cfg_str != NULL && cfg_str[0] != '\0') {
+        char *val = strsep(&cfg_str, ",");
+        char *opt = strsep(&val, "=");
+        switch(_get_opt_idx(opt)) {
+            case _OPT_FILE:
+                file = val;
+                break;
+            case _OPT_EVERY:
+                cfg->every = (val != NULL) ? atoi(val) : 0;
+                break;
+            case _OPT_CONTACTS:
+                cfg->contacts = (val != NULL) ? atoi(val) : 1;
+                break;
+            default:
+                MPRINTF("Invalid argument, %s.  Valid options are: file=?,every=?,contacts=?\n", opt);
+                free(cfg);
+                return NULL;
+        }
+    }
+    if(file == NULL || file[0] == '\0' || cfg->every < 1) {
+        MPRINTF("file needs a name, and every has to be at least 1.\n", NULL);
+        free(cfg);
+        return NULL;
+    }
+    if((cfg->f = fopen(file, "a")) == NULL) {   // Appended to, like a resumed universe
+        MPRINTF("Could not open %s, because: %s\n", file, strerror(errno));
+        free(cfg);
+        return NULL;
+    }
+    fseek(cfg->f, 0, SEEK_END);
+    if(ftell(cfg->f) == 0) {
+        fprintf(cfg->f, "# time bodies mass kinetic_energy px py pz com_x com_y com_z min_x min_y min_z max_x max_y max_z%s\n",
+                cfg->contacts ? " contacts" : "");
+    }
+    return (void *)cfg;
+}
+
+EXPORT
+void deinit(Config *cfg) {                  // Called once the sim is done with it.
+    fclose(cfg->f);
+    free(cfg->idx);
+    free(cfg->cell);
+    free(cfg->order);
+    free(cfg->start);
+    free(cfg);
+}
+
+EXPORT
+void help(void) {
+    MPRINTF("In-situ analysis plug-in (use it with -a, not -m): writes global reductions of every slice to a time series,\n", NULL);
+    MPRINTF("one line per slice, so the full slices needn't be written just to compute them later (see -w).\n", NULL);
+    MPRINTF("Columns: time, bodies, total mass, kinetic energy, momentum, centre of mass, bounding box of the bodies and\n", NULL);
+    MPRINTF("(optionally) contacts, the pairs of bodies touching or overlapping.\n", NULL);
+    MPRINTF("It runs on its own thread and never holds up the simulation: if it falls behind, slices are skipped.\n", NULL);
+    MPRINTF("Asymptotic performance: O(N) (contacts are found with a hashed grid of cells the size of the largest body).\n", NULL);
+    MPRINTF("Initialization parameters take the form: option1=value1,option2=value2,...\n", NULL);
+    MPRINTF("Available options are:\n", NULL);
+    MPRINTF("\t- file: time series to append to (default: %s)\n", DEFAULT_FILE);
+    MPRINTF("\t- every: only reduce every this many slices (default: %d)\n", DEFAULT_EVERY);
+    MPRINTF("\t- contacts: count contacts, 1 or 0 (default: %d)\n", DEFAULT_CONTACTS);
+    MPRINTF("Example: -a reduce[file=run1.dat,every=10]\n", NULL);
+}
+
+static int _cell(double x, double h, int64_t *c) {     // Grid cell of coordinate x.  0 if it doesn't have one.
+    double v = floor(x / h);
+    if(!(fabs(v) < 1e18)) { return 0; }
+    *c = (int64_t)v;
+    return 1;
+}
+
+static uint64_t _bucket(int64_t x, int64_t y, int64_t z, uint64_t nbucket) {
+    return ((uint64_t)x * 73856093ULL ^ (uint64_t)y * 19349663ULL ^ (uint64_t)z * 83492791ULL) & (nbucket - 1);
+}
+
+static int _reserve(Config *cfg, uint64_t n) {
+    uint64_t nbucket = 1;
+    while(nbucket < 2 * n) { nbucket <<= 1; }
+    if(n > cfg->size) {
+        uint64_t *idx = realloc(cfg->idx, sizeof(uint64_t) * n);
+        if(idx != NULL) { cfg->idx = idx; }
+        int64_t *cell = realloc(cfg->cell, sizeof(int64_t) * 3 * n);
+        if(cell != NULL) { cfg->cell = cell; }
+        uint64_t *order = realloc(cfg->order, sizeof(uint64_t) * n);
+        if(order != NULL) { cfg->order = order; }
+        if(idx == NULL || cell == NULL || order == NULL) { return 0; }
+        cfg->size = n;
+    }
+    if(nbucket > cfg->nbucket) {
+        uint64_t *start = realloc(cfg->start, sizeof(uint64_t) * (nbucket + 1));
+        if(start == NULL) { return 0; }
+        cfg->start = start;
+    }
+    cfg->nbucket = nbucket;
+    return 1;
+}
+
+// Pairs of bodies that touch or overlap.  Cells are as wide as the largest body, so anything touching a body is in
+// its cell or a neighbouring one.  -1 on allocation failure.
+static int64_t _contacts(Config *cfg, Slice *s) {
+    uint64_t n = 0;
+    double rmax = 0;
+    for(uint64_t i = 0; i < s->nbody; i++) {
+        Particle *p = &s->bodies[i];
+        if(p->flags & (PARTICLE_FLAG_DELETE | PARTICLE_FLAG_NOCOLL) || !(p->radius > 0)) { continue; }
+        rmax = fmax(rmax, p->radius);
+        ++n;
+    }
+    if(n < 2) { return 0; }
+    if(!_reserve(cfg, n)) { return -1; }
+    double h = 2 * rmax;
+    uint64_t nb = cfg->nbucket, m = 0;
+    memset(cfg->start, 0, sizeof(uint64_t) * (nb + 1));
+    for(uint64_t i = 0; i < s->nbody; i++) {    // Counting sort by bucket
+        Particle *p = &s->bodies[i];
+        int64_t *c = &cfg->cell[3 * m];
+        if(p->flags & (PARTICLE_FLAG_DELETE | PARTICLE_FLAG_NOCOLL) || !(p->radius > 0) ||
+           !_cell(p->pos.x, h, &c[0]) || !_cell(p->pos.y, h, &c[1]) || !_cell(p->pos.z, h, &c[2])) { continue; }
+        cfg->idx[m++] = i;
+        ++cfg->start[_bucket(c[0], c[1], c[2], nb) + 1];
+    }
+    for(uint64_t b = 0; b < nb; b++) {
+        cfg->start[b + 1] += cfg->start[b];
+    }
+    for(uint64_t k = 0; k < m; k++) {           // start[b] walks to start[b + 1] here ...
+        int64_t *c = &cfg->cell[3 * k];
+        cfg->order[cfg->start[_bucket(c[0], c[1], c[2], nb)]++] = k;
+    }
+    for(uint64_t b = nb; b > 0; b--) {          // ... so shift it back
+        cfg->start[b] = cfg->start[b - 1];
+    }
+    cfg->start[0] = 0;
+
+    int64_t count = 0;
+    for(uint64_t k = 0; k < m; k++) {
+        Particle *p = &s->bodies[cfg->idx[k]];
+        int64_t *c = &cfg->cell[3 * k];
+        for(int d = 0; d < 27; d++) {
+            int64_t cx = c[0] + d % 3 - 1, cy = c[1] + d / 3 % 3 - 1, cz = c[2] + d / 9 - 1;
+            uint64_t b = _bucket(cx, cy, cz, nb);
+            for(uint64_t e = cfg->start[b]; e < cfg->start[b + 1]; e++) {
+                uint64_t j = cfg->order[e];
+                if(j <= k) { continue; }        // Each pair once
+                Particle *q = &s->bodies[cfg->idx[j]];
+                int64_t *qc = &cfg->cell[3 * j];
+                if(qc[0] != cx || qc[1] != cy || qc[2] != cz) { continue; }  // Another cell in the same bucket
+                Vector dx;
+                vector_sub(&dx, &q->pos, &p->pos);
+                double r = p->radius + q->radius;
+                if(vector_dot(&dx, &dx) <= r * r) { ++count; }
+            }
+        }
+    }
+    return count;
+}
+
+EXPORT
+int analyze(Config *cfg, Slice *s) {        // Given every finished slice, on the plug-in's own thread.  Returns 0 to stop.
+    if(cfg->seen++ % cfg->every != 0) { return 1; }
+    uint64_t n = 0;
+    double mass = 0, ke = 0;
+    Vector mom = { 0, 0, 0 }, com = { 0, 0, 0 };
+    Vector lo = { INFINITY, INFINITY, INFINITY }, hi = { -INFINITY, -INFINITY, -INFINITY };
+    for(uint64_t i = 0; i < s->nbody; i++) {
+        Particle *p = &s->bodies[i];
+        if(p->flags & PARTICLE_FLAG_DELETE) { continue; }
+        ++n;
+        mass += p->mass;
+        ke += 0.5 * p->mass * vector_dot(&p->vel, &p->vel);
+        mom.x += p->mass * p->vel.x;
+        mom.y += p->mass * p->vel.y;
+        mom.z += p->mass * p->vel.z;
+        com.x += p->mass * p->pos.x;
+        com.y += p->mass * p->pos.y;
+        com.z += p->mass * p->pos.z;
+        lo.x = fmin(lo.x, p->pos.x);
+        lo.y = fmin(lo.y, p->pos.y);
+        lo.z = fmin(lo.z, p->pos.z);
+        hi.x = fmax(hi.x, p->pos.x);
+        hi.y = fmax(hi.y, p->pos.y);
+        hi.z = fmax(hi.z, p->pos.z);
+    }
+    if(mass != 0) {
+        com.x /= mass;
+        com.y /= mass;
+        com.z /= mass;
+    }
+    fprintf(cfg->f, "%llu %llu %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g",
+            (unsigned long long)s->time, (unsigned long long)n, mass, ke, mom.x, mom.y, mom.z, com.x, com.y, com.z,
+            lo.x, lo.y, lo.z, hi.x, hi.y, hi.z);
+    if(cfg->contacts) {
+        int64_t c = _contacts(cfg, s);
+        if(c < 0) {
+            MPRINTF("Memory allocation failure.\n", NULL);
+            return 0;
+        }
+        fprintf(cfg->f, " %lld", (long long)c);
+    }
+    fprintf(cfg->f, "\n");
+    if(fflush(cfg->f) != 0) {               // A line at a time, so it can be followed as it grows
+        MPRINTF("Could not write the time series, because: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,82 @@
+//
+//  carry.c - Carrying only the fields the pipeline writes between slices gives the same bodies as copying them all
+//  SymUniverse
+//
+//  Usage: test_carry <scratch file> <module directory>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sim.h"
+
+#define NBODY 6
+#define NSTEP 6
+
+static int fail(const char *what) {
+    printf("FAIL: %s\n", what);
+    return 0;
+}
+
+static void make_slice(Slice *s, Particle *bodies) {   // Two species, uflags 1 and 2
+    memset(s, 0, sizeof(Slice));
+    memset(bodies, 0, sizeof(Particle) * NBODY);
+    for(int i = 0; i < NBODY; i++) {
+        bodies[i].uflags = (i % 2 == 0) ? 0x1 : 0x2;
+        bodies[i].mass = 1;
+        bodies[i].radius = 0.001;
+        bodies[i].pos.x = i;
+        bodies[i].pos.y = 0.5 * (i % 3);
+        bodies[i].pos.z = 0.2 * i * i;
+    }
+    s->bound_min.x = s->bound_min.y = s->bound_min.z = -10;
+    s->bound_max.x = s->bound_max.y = s->bound_max.z = 10;
+    s->nbody = NBODY;
+    s->bodies = bodies;
+    s->capacity = NBODY;
+    s->refs = 1;
+}
+
+// Run the pipeline argv for NSTEP steps on a copy of start into out, with the carry sym works out or (full) copying every field.
+static int run(SimModules *mods, int argc, char *argv[], int full, Slice *start, Particle *out) {
+    SimOptions opt;
+    sim_default_options(&opt, mods);
+    opt.timesteps = NSTEP;
+    Sim *sim = sim_create(&opt, argc, argv);
+    if(sim == NULL) { return fail("sim_create"); }
+    if(full) { sim->carry = PARTICLE_FIELD_ALL; }
+    int ok = (sim_set_slice(sim, start) && sim_run(sim) && sim_slice(sim)->nbody == NBODY) || fail("sim_run");
+    if(ok) { memcpy(out, sim_slice(sim)->bodies, sizeof(Particle) * NBODY); }
+    sim_destroy(sim);
+    return ok;
+}
+
+static int same_run(SimModules *mods, int argc, char *argv[], const char *what) {
+    Slice s;
+    Particle start[NBODY], carried[NBODY], copied[NBODY];
+    make_slice(&s, start);
+    int ok = run(mods, argc, argv, 0, &s, carried);
+    ok = run(mods, argc, argv, 1, &s, copied) && ok;
+    ok = (ok && isfinite(copied[0].acc.x) && copied[0].acc.x != 0) || fail("bodies blew up, the comparison means nothing");
+    ok = (ok && memcmp(carried, copied, sizeof(carried)) == 0) || fail(what);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 3) {
+        printf("Usage: %s <scratch file> <module directory>\n", argv[0]);
+        return 1;
+    }
+    SimModules *mods = sim_open_modules(argv[2]);
+    if(mods == NULL) { return 1; }
+
+    char *all[] = { "cleara", "fgrav[cleara=0]", "integrate[timestep=0.01]" };
+    char *masked[] = { "cleara{mask=0x2}", "fgrav[cleara=0]", "integrate[timestep=0.01]" };
+    int ok = same_run(mods, 3, all, "carry, whole pipeline");
+    ok = same_run(mods, 3, masked, "carry, acc only cleared for one species") && ok;
+
+    sim_free_modules(mods);
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,95 @@
+//
+//  columnar.c - Version 3 (columnar) universes give back the bodies they were given
+//  SymUniverse
+//
+//  Usage: test_columnar <scratch file>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "universe.h"
+#include "umap.h"
+
+#define NBODY 5
+
+static int fail(const char *what) {
+    printf("FAIL: %s\n", what);
+    return 0;
+}
+
+static void make_slice(Slice *s, Particle *bodies, uint64_t time) {    // Bodies 1 and 3 flagged deleted
+    memset(s, 0, sizeof(Slice));
+    memset(bodies, 0, sizeof(Particle) * NBODY);
+    for(int i = 0; i < NBODY; i++) {
+        bodies[i].flags = (i % 2 == 1) ? PARTICLE_FLAG_DELETE : 0;
+        bodies[i].mass = 1;                         // Constant columns
+        bodies[i].radius = 0.01;
+        bodies[i].pos.x = 0.1 * i;
+        bodies[i].vel.y = -0.2 * i;
+    }
+    s->time = time;
+    s->nbody = NBODY;
+    s->bodies = bodies;
+    s->capacity = NBODY;
+    s->refs = 1;
+}
+
+static int same(Particle *a, Particle *b, uint64_t n) {
+    return memcmp(a, b, sizeof(Particle) * n) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        printf("Usage: %s <scratch file>\n", argv[0]);
+        return 1;
+    }
+    const char *path = argv[1];
+    Particle bodies[NBODY], kept[NBODY];
+    Slice s;
+    int ok = 1;
+    unlink(path);
+
+    Universe *u = universe_create_columnar(path);
+    if(u == NULL) { return 1; }
+    make_slice(&s, bodies, 0);                      // Flagged, but not counted in ndelete: everything is written
+    ok = universe_append_slice(u, &s) || fail("append with ndelete == 0");
+    make_slice(&s, bodies, 1);                      // Packing put off: the flagged bodies are left out
+    s.ndelete = 2;
+    ok = (universe_append_slice(u, &s) || fail("append with ndelete == 2")) && ok;
+    universe_close(u);
+    universe_free(u);
+
+    make_slice(&s, bodies, 0);
+    uint64_t nkept = 0;
+    for(int i = 0; i < NBODY; i++) {
+        if(!(bodies[i].flags & PARTICLE_FLAG_DELETE)) { kept[nkept++] = bodies[i]; }
+    }
+    if((u = universe_open(path)) == NULL) { return 1; }
+    Slice *r0 = universe_get_slice(u, 0), *r1 = universe_get_slice(u, 1);
+    Slice *p0 = universe_get_slice_fields(u, 0, PARTICLE_FIELD_POS);
+    ok = (u->nslice == 2 || fail("slice count")) && ok;
+    ok = ((r0 != NULL && r0->nbody == NBODY && same(r0->bodies, bodies, NBODY)) || fail("slice 0 round trip")) && ok;
+    ok = ((r1 != NULL && r1->nbody == nkept && same(r1->bodies, kept, nkept)) || fail("slice 1 round trip")) && ok;
+    int pos_ok = (p0 != NULL);
+    for(int i = 0; pos_ok && i < NBODY; i++) {
+        if(p0->bodies[i].pos.x != bodies[i].pos.x || p0->bodies[i].mass != 0) { pos_ok = 0; }
+    }
+    ok = (pos_ok || fail("position only read")) && ok;
+    if(r0 != NULL) { slice_free(r0); }
+    if(r1 != NULL) { slice_free(r1); }
+    if(p0 != NULL) { slice_free(p0); }
+    universe_close(u);
+    universe_free(u);
+
+    UniverseMap *m = umap_open(path, UMAP_RANDOM);
+    Slice d = { 0 };
+    ok = ((m != NULL && umap_read(m, 0, PARTICLE_FIELD_ALL, &d) && d.nbody == NBODY && same(d.bodies, bodies, NBODY)) ||
+          fail("umap_read of slice 0")) && ok;
+    free(d.bodies);
+    umap_close(m);
+    unlink(path);
+    if(ok) { printf("PASS\n"); }
+    return ok ? 0 : 1;
+}